@@ -0,0 +1,425 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "mysqlfs.h"
+#include "pool.h"
+#include "bcache.h"
+#include "log.h"
+
+/** number of independently locked shards; a power of two */
+#define BCACHE_SHARDS	64
+/** slots and shards are aligned to this, so that no two share a cache line */
+#define BCACHE_LINE	64
+
+/**
+ * One cached data block.  Slots live in per-shard arrays, chained into the
+ * hash buckets of their shard; the data itself is in the shard's block
+ * arena, at the same index.
+ */
+struct bcache_slot {
+    struct bcache_slot	*next;		/**< next slot in the same bucket */
+    long		inode;		/**< inode of the block, 0 if the slot is free */
+    unsigned long	seq;		/**< sequence number of the block */
+    time_t		expires;	/**< the block is stale after this time */
+    unsigned int	len;		/**< bytes in the block, 0 for a hole */
+    unsigned char	ref;		/**< CLOCK reference bit, set on each hit */
+} __attribute__((aligned(BCACHE_LINE)));
+
+/**
+ * A shard of the cache: its own lock, hash buckets and CLOCK hand, so that
+ * readers of different blocks rarely contend.
+ */
+struct bcache_shard {
+    pthread_mutex_t	lock;		/**< protects everything below */
+    struct bcache_slot	*slots;		/**< nr_slots slots */
+    struct bcache_slot	**buckets;	/**< nr_slots hash chains */
+    char		*data;		/**< nr_slots blocks of DATA_BLOCK_SIZE */
+    unsigned long	hand;		/**< next slot the CLOCK looks at */
+    unsigned long	hits;		/**< bcache_read() found the block */
+    unsigned long	misses;		/**< bcache_read() did not */
+} __attribute__((aligned(BCACHE_LINE)));
+
+/**
+ * Which blocks of an inode may be cached, and how often they were
+ * invalidated.  Direct-mapped like the attribute cache; inodes that collide
+ * share an entry (inode -1), which only makes bcache_invalidate() look at
+ * more blocks than it needs to.
+ */
+struct bcache_extent {
+    long		inode;		/**< owner, 0 if nothing is cached, -1 if shared */
+    unsigned long	last;		/**< no block past this one is cached */
+    unsigned long	gen;		/**< bumped by every bcache_invalidate() */
+};
+
+static struct bcache_shard shards[BCACHE_SHARDS];
+static unsigned long nr_slots = 0;	/* per shard */
+static unsigned int block_timeout = 0;
+
+static struct bcache_extent *extents = NULL;
+static unsigned long nr_extents = 0;
+/** Stripes over extents[].  Lock order: stripe, then shard */
+static pthread_mutex_t stripes[BCACHE_SHARDS];
+
+static inline unsigned long long block_hash(long inode, unsigned long seq)
+{
+    /* Fibonacci hashing of both halves of the key, so that neither
+     * sequential inodes nor sequential blocks cluster */
+    return ((unsigned long long) inode * 11400714819323198485ULL) ^
+           ((seq + 1ULL) * 14029467366897019727ULL);
+}
+
+static inline struct bcache_shard *shard_of(unsigned long long hash)
+{
+    /* the high bits pick the shard, the low ones the bucket */
+    return &shards[(hash >> 40) & (BCACHE_SHARDS - 1)];
+}
+
+static inline unsigned long extent_index(long inode)
+{
+    return ((unsigned long) inode * 11400714819323198485ULL) % nr_extents;
+}
+
+static inline pthread_mutex_t *stripe_of(unsigned long idx)
+{
+    return &stripes[idx & (BCACHE_SHARDS - 1)];
+}
+
+/** find a valid block in a locked shard */
+static struct bcache_slot *slot_find(struct bcache_shard *shard, unsigned long long hash,
+				     long inode, unsigned long seq)
+{
+    struct bcache_slot *slot;
+
+    for (slot = shard->buckets[hash % nr_slots]; slot; slot = slot->next)
+	if (slot->inode == inode && slot->seq == seq)
+	    return slot;
+
+    return NULL;
+}
+
+/** take a slot of a locked shard out of its bucket and mark it free */
+static void slot_free(struct bcache_shard *shard, struct bcache_slot *slot)
+{
+    struct bcache_slot **pp;
+
+    pp = &shard->buckets[block_hash(slot->inode, slot->seq) % nr_slots];
+    for (; *pp; pp = &(*pp)->next) {
+	if (*pp == slot) {
+	    *pp = slot->next;
+	    break;
+	}
+    }
+    slot->inode = 0;
+    slot->next = NULL;
+}
+
+/** pick a slot of a locked shard to reuse: the first one the CLOCK finds unreferenced */
+static struct bcache_slot *slot_evict(struct bcache_shard *shard)
+{
+    struct bcache_slot *slot;
+    time_t now = time(NULL);
+
+    for (;;) {
+	slot = &shard->slots[shard->hand];
+	shard->hand = (shard->hand + 1) % nr_slots;
+
+	if (!slot->inode)
+	    return slot;
+	if (slot->ref && slot->expires >= now) {
+	    slot->ref = 0;
+	    continue;
+	}
+	slot_free(shard, slot);
+	return slot;
+    }
+}
+
+static inline char *slot_data(struct bcache_shard *shard, struct bcache_slot *slot)
+{
+    return shard->data + (slot - shard->slots) * DATA_BLOCK_SIZE;
+}
+
+int bcache_init(struct mysqlfs_opt *opt)
+{
+    int i;
+
+    if (!opt->block_cache || !opt->block_cache_timeout)
+	return 0;
+
+    nr_slots = (unsigned long) opt->block_cache * 1024 / DATA_BLOCK_SIZE / BCACHE_SHARDS;
+    if (nr_slots < 1)
+	nr_slots = 1;
+    nr_extents = nr_slots * BCACHE_SHARDS;
+
+    extents = calloc(nr_extents, sizeof(struct bcache_extent));
+    if (!extents)
+	goto err_out;
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	struct bcache_shard *shard = &shards[i];
+
+	if (posix_memalign((void **) &shard->slots, BCACHE_LINE,
+			   nr_slots * sizeof(struct bcache_slot)))
+	    goto err_out;
+	memset(shard->slots, 0, nr_slots * sizeof(struct bcache_slot));
+	shard->buckets = calloc(nr_slots, sizeof(struct bcache_slot *));
+	if (!shard->buckets)
+	    goto err_out;
+	if (posix_memalign((void **) &shard->data, BCACHE_LINE,
+			   nr_slots * DATA_BLOCK_SIZE))
+	    goto err_out;
+	pthread_mutex_init(&shard->lock, NULL);
+	pthread_mutex_init(&stripes[i], NULL);
+    }
+
+    block_timeout = opt->block_cache_timeout;
+
+    log_printf(LOG_D_OTHER, "%s(): timeout=%us blocks=%lu\n", __func__,
+	       block_timeout, nr_slots * BCACHE_SHARDS);
+    return 0;
+
+err_out:
+    log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+    bcache_cleanup();
+    return -ENOMEM;
+}
+
+void bcache_cleanup()
+{
+    int i;
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	struct bcache_shard *shard = &shards[i];
+
+	if (block_timeout) {
+	    pthread_mutex_destroy(&shard->lock);
+	    pthread_mutex_destroy(&stripes[i]);
+	}
+	free(shard->slots);
+	free(shard->buckets);
+	free(shard->data);
+	memset(shard, 0, sizeof(struct bcache_shard));
+    }
+    free(extents);
+    extents = NULL;
+    block_timeout = 0;
+}
+
+int bcache_enabled()
+{
+    return block_timeout != 0;
+}
+
+ssize_t bcache_read(long inode, unsigned long seq, size_t offset, char *buf, size_t size)
+{
+    unsigned long long hash;
+    struct bcache_shard *shard;
+    struct bcache_slot *slot;
+    ssize_t ret = -ENOENT;
+
+    if (!block_timeout)
+	return -ENOENT;
+
+    hash = block_hash(inode, seq);
+    shard = shard_of(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    slot = slot_find(shard, hash, inode, seq);
+    if (slot && slot->expires < time(NULL)) {
+	slot_free(shard, slot);
+	slot = NULL;
+    }
+    if (slot) {
+	slot->ref = 1;
+	ret = slot->len > offset ? MIN(size, slot->len - offset) : 0;
+	memcpy(buf, slot_data(shard, slot) + offset, ret);
+	shard->hits++;
+    } else {
+	shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return ret;
+}
+
+unsigned long bcache_generation(long inode)
+{
+    unsigned long idx, ret;
+
+    if (!block_timeout)
+	return 0;
+
+    idx = extent_index(inode);
+    pthread_mutex_lock(stripe_of(idx));
+    ret = extents[idx].gen;
+    pthread_mutex_unlock(stripe_of(idx));
+
+    return ret;
+}
+
+/** store a block, with the stripe of its extent e locked */
+static void put_locked(struct bcache_extent *e, long inode, unsigned long seq,
+		       const char *data, size_t len)
+{
+    unsigned long long hash = block_hash(inode, seq);
+    struct bcache_shard *shard = shard_of(hash);
+    struct bcache_slot *slot;
+
+    if (e->inode == inode) {
+	e->last = MAX(e->last, seq);
+    } else if (e->inode == 0) {
+	e->inode = inode;
+	e->last = seq;
+    } else {
+	e->inode = -1;
+	e->last = MAX(e->last, seq);
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    slot = slot_find(shard, hash, inode, seq);
+    if (!slot) {
+	slot = slot_evict(shard);
+	slot->inode = inode;
+	slot->seq = seq;
+	slot->next = shard->buckets[hash % nr_slots];
+	shard->buckets[hash % nr_slots] = slot;
+    }
+    slot->expires = time(NULL) + block_timeout;
+    slot->len = len;
+    slot->ref = 0;
+    if (len)
+	memcpy(slot_data(shard, slot), data, len);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void bcache_put(long inode, unsigned long seq, const char *data, size_t len, unsigned long gen)
+{
+    unsigned long idx;
+
+    if (!block_timeout || len > DATA_BLOCK_SIZE)
+	return;
+
+    idx = extent_index(inode);
+
+    pthread_mutex_lock(stripe_of(idx));
+    /* The block may have changed since it was read */
+    if (extents[idx].gen == gen)
+	put_locked(&extents[idx], inode, seq, data, len);
+    pthread_mutex_unlock(stripe_of(idx));
+}
+
+void bcache_replace(long inode, unsigned long seq, const char *data, size_t len)
+{
+    unsigned long idx;
+
+    if (!block_timeout)
+	return;
+    if (len > DATA_BLOCK_SIZE) {
+	bcache_invalidate(inode, seq, seq);
+	return;
+    }
+
+    idx = extent_index(inode);
+
+    pthread_mutex_lock(stripe_of(idx));
+    /* Reads still in flight have the old contents */
+    extents[idx].gen++;
+    put_locked(&extents[idx], inode, seq, data, len);
+    pthread_mutex_unlock(stripe_of(idx));
+}
+
+/** drop one block, if cached */
+static void invalidate_one(long inode, unsigned long seq)
+{
+    unsigned long long hash = block_hash(inode, seq);
+    struct bcache_shard *shard = shard_of(hash);
+    struct bcache_slot *slot;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((slot = slot_find(shard, hash, inode, seq)) != NULL)
+	slot_free(shard, slot);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void bcache_invalidate(long inode, unsigned long first, unsigned long last)
+{
+    unsigned long idx, seq, i;
+    struct bcache_extent *e;
+    int s;
+
+    if (!block_timeout)
+	return;
+
+    idx = extent_index(inode);
+    e = &extents[idx];
+
+    pthread_mutex_lock(stripe_of(idx));
+    e->gen++;
+
+    /* Nothing of this inode was ever cached */
+    if (e->inode != inode && e->inode != -1)
+	goto out;
+
+    last = MIN(last, e->last);
+    if (first > last)
+	goto out;
+
+    if (last - first < nr_slots * BCACHE_SHARDS) {
+	for (seq = first; seq <= last; seq++)
+	    invalidate_one(inode, seq);
+    } else {
+	/* The range is larger than the cache: cheaper to look at every slot */
+	for (s = 0; s < BCACHE_SHARDS; s++) {
+	    struct bcache_shard *shard = &shards[s];
+
+	    pthread_mutex_lock(&shard->lock);
+	    for (i = 0; i < nr_slots; i++) {
+		struct bcache_slot *slot = &shard->slots[i];
+
+		if (slot->inode == inode && slot->seq >= first && slot->seq <= last)
+		    slot_free(shard, slot);
+	    }
+	    pthread_mutex_unlock(&shard->lock);
+	}
+    }
+
+    /* An inode whose blocks are all gone no longer needs its entry */
+    if (first == 0 && last == e->last && e->inode == inode)
+	e->inode = 0;
+
+out:
+    pthread_mutex_unlock(stripe_of(idx));
+}
+
+void bcache_stats(unsigned long *hits, unsigned long *misses)
+{
+    int i;
+
+    *hits = *misses = 0;
+    if (!block_timeout)
+	return;
+
+    for (i = 0; i < BCACHE_SHARDS; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	*hits += shards[i].hits;
+	*misses += shards[i].misses;
+	pthread_mutex_unlock(&shards[i].lock);
+    }
+}
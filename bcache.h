@@ -0,0 +1,41 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** last block of a file, whatever its size, for bcache_invalidate() */
+#define BCACHE_END	((unsigned long) -1)
+
+struct mysqlfs_opt;
+
+/** Initialize the data block cache; a zero mysqlfs_opt::block_cache leaves it disabled */
+int bcache_init(struct mysqlfs_opt *opt);
+
+/** Drop all blocks and free the block cache */
+void bcache_cleanup();
+
+/** Whether the block cache is in use */
+int bcache_enabled();
+
+/** Copy up to size bytes from offset of a cached block to buf: bytes copied (short at the end of the block), or -ENOENT if not cached */
+ssize_t bcache_read(long inode, unsigned long seq, size_t offset, char *buf, size_t size);
+
+/** Generation of the cached blocks of an inode, to pass to bcache_put() for blocks read from the database after this call */
+unsigned long bcache_generation(long inode);
+
+/** Cache the complete contents of a block (NULL, 0 for a hole), unless the inode was invalidated since generation gen */
+void bcache_put(long inode, unsigned long seq, const char *data, size_t len, unsigned long gen);
+
+/** Cache the new contents of a block right after changing it in the database, instead of bcache_invalidate() */
+void bcache_replace(long inode, unsigned long seq, const char *data, size_t len);
+
+/** Forget the cached blocks first to last (inclusive) of an inode; call after changing them in the database */
+void bcache_invalidate(long inode, unsigned long first, unsigned long last);
+
+/** Hit and miss counts of bcache_read(), for the status file */
+void bcache_stats(unsigned long *hits, unsigned long *misses);
@@ -0,0 +1,277 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "dcache.h"
+#include "log.h"
+
+/** number of independently-locked shards; a power of two */
+#define DCACHE_SHARDS	64
+/** hash buckets in each shard; a power of two */
+#define DCACHE_BUCKETS	1024
+
+/**
+ * One cached directory entry: the name of an inode within its parent
+ * directory.  An inode of 0 marks a negative entry, ie a name that is known
+ * not to exist.  Entries live both on a hash chain and on the LRU list of
+ * their shard.
+ */
+struct dentry {
+    struct dentry	*hnext;		/**< next entry on the same hash chain */
+    struct dentry	*lru_prev,	/**< more recently used entry */
+			*lru_next;	/**< less recently used entry */
+    unsigned long	hash;		/**< hash of (parent, name) */
+    long		parent;		/**< inode of the directory holding the name */
+    long		inode;		/**< inode of the name, 0 if negative */
+    time_t		expires;	/**< entry is stale after this time */
+    char		name[];		/**< NUL-terminated name */
+};
+
+/** A shard of the cache with its own lock, hash table and LRU list */
+struct dcache_shard {
+    pthread_mutex_t	lock;		/**< protects everything below */
+    struct dentry	*buckets[DCACHE_BUCKETS];	/**< hash chains */
+    struct dentry	*lru_head,	/**< most recently used */
+			*lru_tail;	/**< least recently used, evicted first */
+    unsigned int	count;		/**< entries in this shard */
+};
+
+static struct dcache_shard *shards = NULL;
+static unsigned int dcache_timeout = 0;
+static unsigned int shard_max = 0;
+
+/** FNV-1a over the parent inode and the name */
+static unsigned long dentry_hash(long parent, const char *name)
+{
+    unsigned long h = 2166136261UL;
+    int i;
+
+    for (i = 0; i < sizeof(parent); i++) {
+	h ^= (parent >> (i * 8)) & 0xff;
+	h *= 16777619UL;
+    }
+    while (*name) {
+	h ^= (unsigned char) *name++;
+	h *= 16777619UL;
+    }
+
+    return h;
+}
+
+static inline struct dcache_shard *shard_of(unsigned long hash)
+{
+    return &shards[hash & (DCACHE_SHARDS - 1)];
+}
+
+static inline struct dentry **bucket_of(struct dcache_shard *s, unsigned long hash)
+{
+    return &s->buckets[(hash / DCACHE_SHARDS) & (DCACHE_BUCKETS - 1)];
+}
+
+static void lru_unlink(struct dcache_shard *s, struct dentry *d)
+{
+    if (d->lru_prev)
+	d->lru_prev->lru_next = d->lru_next;
+    else
+	s->lru_head = d->lru_next;
+    if (d->lru_next)
+	d->lru_next->lru_prev = d->lru_prev;
+    else
+	s->lru_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push(struct dcache_shard *s, struct dentry *d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = s->lru_head;
+    if (s->lru_head)
+	s->lru_head->lru_prev = d;
+    s->lru_head = d;
+    if (!s->lru_tail)
+	s->lru_tail = d;
+}
+
+/** find (parent, name) in a locked shard, returning the link that points to it */
+static struct dentry **dentry_find(struct dcache_shard *s, unsigned long hash,
+				   long parent, const char *name)
+{
+    struct dentry **pp = bucket_of(s, hash);
+
+    for (; *pp; pp = &(*pp)->hnext) {
+	struct dentry *d = *pp;
+	if (d->hash == hash && d->parent == parent && !strcmp(d->name, name))
+	    return pp;
+    }
+
+    return NULL;
+}
+
+/** unhash, unlink and free the entry *pp points to; shard must be locked */
+static void dentry_drop(struct dcache_shard *s, struct dentry **pp)
+{
+    struct dentry *d = *pp;
+
+    *pp = d->hnext;
+    lru_unlink(s, d);
+    s->count--;
+    free(d);
+}
+
+int dcache_init(struct mysqlfs_opt *opt)
+{
+    int i;
+
+    dcache_timeout = opt->dcache_timeout;
+    if (!dcache_timeout)
+	return 0;
+
+    shards = calloc(DCACHE_SHARDS, sizeof(struct dcache_shard));
+    if (!shards) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	dcache_timeout = 0;
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < DCACHE_SHARDS; i++)
+	pthread_mutex_init(&shards[i].lock, NULL);
+
+    shard_max = opt->dcache_entries / DCACHE_SHARDS;
+    if (shard_max < 1)
+	shard_max = 1;
+
+    log_printf(LOG_D_OTHER, "%s(): timeout=%us entries=%u\n", __func__,
+	       dcache_timeout, shard_max * DCACHE_SHARDS);
+    return 0;
+}
+
+void dcache_cleanup()
+{
+    int i;
+
+    if (!shards)
+	return;
+
+    for (i = 0; i < DCACHE_SHARDS; i++) {
+	struct dcache_shard *s = &shards[i];
+	while (s->lru_head) {
+	    struct dentry *d = s->lru_head;
+	    s->lru_head = d->lru_next;
+	    free(d);
+	}
+	pthread_mutex_destroy(&s->lock);
+    }
+    free(shards);
+    shards = NULL;
+    dcache_timeout = 0;
+}
+
+long dcache_lookup(long parent, const char *name)
+{
+    unsigned long hash;
+    struct dcache_shard *s;
+    struct dentry **pp;
+    long ret = DCACHE_MISS;
+
+    if (!dcache_timeout)
+	return DCACHE_MISS;
+
+    hash = dentry_hash(parent, name);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    pp = dentry_find(s, hash, parent, name);
+    if (pp) {
+	struct dentry *d = *pp;
+	if (d->expires < time(NULL)) {
+	    dentry_drop(s, pp);
+	} else {
+	    ret = d->inode ? d->inode : -ENOENT;
+	    lru_unlink(s, d);
+	    lru_push(s, d);
+	}
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+void dcache_add(long parent, const char *name, long inode)
+{
+    unsigned long hash;
+    struct dcache_shard *s;
+    struct dentry **pp, *d;
+    size_t len;
+
+    if (!dcache_timeout)
+	return;
+
+    hash = dentry_hash(parent, name);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    pp = dentry_find(s, hash, parent, name);
+    if (pp) {
+	d = *pp;
+	lru_unlink(s, d);
+    } else {
+	/* Make room first, so that a full shard never grows */
+	while (s->count >= shard_max && s->lru_tail) {
+	    struct dentry *victim = s->lru_tail;
+	    dentry_drop(s, dentry_find(s, victim->hash, victim->parent, victim->name));
+	}
+
+	len = strlen(name) + 1;
+	d = malloc(sizeof(struct dentry) + len);
+	if (!d) {
+	    pthread_mutex_unlock(&s->lock);
+	    return;
+	}
+	memcpy(d->name, name, len);
+	d->hash = hash;
+	d->parent = parent;
+	pp = bucket_of(s, hash);
+	d->hnext = *pp;
+	*pp = d;
+	s->count++;
+    }
+    d->inode = inode;
+    d->expires = time(NULL) + dcache_timeout;
+    lru_push(s, d);
+    pthread_mutex_unlock(&s->lock);
+}
+
+void dcache_remove(long parent, const char *name)
+{
+    unsigned long hash;
+    struct dcache_shard *s;
+    struct dentry **pp;
+
+    if (!dcache_timeout)
+	return;
+
+    hash = dentry_hash(parent, name);
+    s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    pp = dentry_find(s, hash, parent, name);
+    if (pp)
+	dentry_drop(s, pp);
+    pthread_mutex_unlock(&s->lock);
+}
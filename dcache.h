@@ -0,0 +1,29 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** dcache_lookup() result for a (parent, name) pair that is not in the cache */
+#define DCACHE_MISS	0
+
+struct mysqlfs_opt;
+
+/** Initialize the dentry cache; a zero mysqlfs_opt::dcache_timeout leaves it disabled */
+int dcache_init(struct mysqlfs_opt *opt);
+
+/** Drop all entries and free the dentry cache */
+void dcache_cleanup();
+
+/** Look up a name in a directory: inode (> 0), DCACHE_MISS, or -ENOENT for a cached negative entry */
+long dcache_lookup(long parent, const char *name);
+
+/** Record (parent, name) => inode; an inode of 0 records a negative (ENOENT) entry */
+void dcache_add(long parent, const char *name, long inode);
+
+/** Forget whatever is known about (parent, name) */
+void dcache_remove(long parent, const char *name);
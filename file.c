@@ -0,0 +1,489 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse/fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "file.h"
+#include "icache.h"
+#include "readahead.h"
+#include "log.h"
+
+/** buckets of the open-file table; a power of two */
+#define FILE_BUCKETS	1024
+
+/**
+ * Open files by inode, so that a read or truncate can first flush what
+ * other handles of the same file still buffer.  table_lock and
+ * mysqlfs_file::lock are never held together; dirty_lock comes after
+ * either.  No query runs under table_lock: a flush takes the handles it
+ * needs with a reference each (see flush_others()), and the last
+ * reference frees the handle.
+ */
+static struct mysqlfs_file *table[FILE_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+/** see file_open_generation(); protected by table_lock */
+static unsigned long generation = 0;
+
+/** limit of one buffer, 0 if writes are not buffered */
+static size_t buffer_max = 0;
+/** limit of all buffers together */
+static size_t total_max = 0;
+/** bytes buffered in all handles */
+static size_t dirty_total = 0;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline struct mysqlfs_file **bucket_of(long inode)
+{
+    return &table[inode & (FILE_BUCKETS - 1)];
+}
+
+/** the first handle of an inode in the table, with table_lock held */
+static struct mysqlfs_file *find_locked(long inode)
+{
+    struct mysqlfs_file *f;
+
+    for (f = *bucket_of(inode); f && f->inode != inode; f = f->next)
+	;
+    return f;
+}
+
+/**
+ * Account for bytes entering (count > 0) the buffer of a locked handle, or
+ * leaving it once written out; returns the new total of all buffers.
+ */
+static size_t dirty_add(struct mysqlfs_file *f, long count)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&dirty_lock);
+    dirty_total += count;
+    ret = dirty_total;
+    f->dirty += count;
+    f->dirty_end = f->dirty ? f->start + (off_t) f->len : 0;
+    pthread_mutex_unlock(&dirty_lock);
+
+    return ret;
+}
+
+/** bytes a handle has buffered or is writing out, without its lock */
+static size_t dirty_of(struct mysqlfs_file *f)
+{
+    size_t ret;
+
+    pthread_mutex_lock(&dirty_lock);
+    ret = f->dirty;
+    pthread_mutex_unlock(&dirty_lock);
+
+    return ret;
+}
+
+/** write out the buffer of a locked handle */
+static int flush_locked(MYSQL *mysql, struct mysqlfs_file *f)
+{
+    int ret;
+    size_t len = f->len;
+
+    if (!len)
+	return 0;
+
+    log_printf(LOG_D_OTHER, "%s(inode=%ld): %zu@%lld\n", __func__, f->inode,
+	       len, (long long) f->start);
+
+    ret = query_write(mysql, f->inode, f->buf, len, f->start);
+
+    /* the bytes are gone from the buffer even if the write fails; until
+     * then they count as dirty, for flush_others() and file_size_buffered() */
+    f->len = 0;
+    dirty_add(f, -(long) len);
+
+    if (ret < 0)
+	return ret;
+
+    return 0;
+}
+
+/** drop a reference to a handle, freeing it with the last */
+static void file_put(struct mysqlfs_file *f)
+{
+    int last;
+
+    pthread_mutex_lock(&table_lock);
+    last = !--f->refs;
+    pthread_mutex_unlock(&table_lock);
+
+    if (!last)
+	return;
+    pthread_mutex_destroy(&f->lock);
+    free(f->buf);
+    free(f);
+}
+
+/**
+ * Write out the buffers of the open handles of an inode other than skip
+ * that overlap size bytes at offset, or all of them if size is 0.  The
+ * handles with anything buffered are taken from the table with a
+ * reference each, and flushed once table_lock is released.
+ */
+static int flush_others(MYSQL *mysql, long inode, struct mysqlfs_file *skip,
+			off_t offset, size_t size)
+{
+    struct mysqlfs_file *f, **dirty = NULL;
+    size_t n = 0, i;
+    int ret = 0, err;
+
+    pthread_mutex_lock(&table_lock);
+    for (f = *bucket_of(inode); f; f = f->next)
+	if (f->inode == inode && f != skip && dirty_of(f))
+	    n++;
+    if (n && (dirty = malloc(n * sizeof(*dirty))) != NULL) {
+	for (i = 0, f = *bucket_of(inode); f && i < n; f = f->next) {
+	    if (f->inode == inode && f != skip && dirty_of(f)) {
+		f->refs++;
+		dirty[i++] = f;
+	    }
+	}
+	n = i;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    if (!n)
+	return 0;
+    if (!dirty)
+	return -ENOMEM;
+
+    for (i = 0; i < n; i++) {
+	f = dirty[i];
+	pthread_mutex_lock(&f->lock);
+	if (!size || (offset < f->start + (off_t) f->len &&
+		      f->start < offset + (off_t) size)) {
+	    err = flush_locked(mysql, f);
+	    if (err < 0)
+		ret = err;
+	}
+	pthread_mutex_unlock(&f->lock);
+	file_put(f);
+    }
+    free(dirty);
+
+    return ret;
+}
+
+int file_init(struct mysqlfs_opt *opt)
+{
+    buffer_max = (size_t) opt->write_buffer * 1024;
+    total_max = (size_t) opt->write_buffer_total * 1024;
+    if (total_max < buffer_max)
+	total_max = buffer_max;
+
+    log_printf(LOG_D_OTHER, "%s(): buffer=%zu total=%zu\n", __func__,
+	       buffer_max, total_max);
+    return 0;
+}
+
+void file_cleanup()
+{
+    buffer_max = 0;
+}
+
+struct mysqlfs_file *file_open(long inode)
+{
+    struct mysqlfs_file *f, **head = bucket_of(inode);
+
+    if ((f = calloc(1, sizeof(struct mysqlfs_file))) == NULL)
+	return NULL;
+    f->inode = inode;
+    f->refs = 1;
+    pthread_mutex_init(&f->lock, NULL);
+
+    pthread_mutex_lock(&table_lock);
+    if (!find_locked(inode))
+	generation++;
+    f->next = *head;
+    *head = f;
+    pthread_mutex_unlock(&table_lock);
+
+    return f;
+}
+
+int file_close(struct mysqlfs_file *f)
+{
+    struct mysqlfs_file **pp, *other;
+    int ret = 0;
+
+    pthread_mutex_lock(&table_lock);
+    for (pp = bucket_of(f->inode); *pp; pp = &(*pp)->next) {
+	if (*pp == f) {
+	    *pp = f->next;
+	    break;
+	}
+    }
+    if ((other = find_locked(f->inode)) == NULL) {
+	generation++;
+	ret = f->deleted;
+    } else if (f->deleted) {
+	/* the last handle purges */
+	other->deleted = 1;
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    pthread_mutex_lock(&f->lock);
+    if (f->len) {
+	log_printf(LOG_ERROR, "%s(inode=%ld): dropping %zu unflushed bytes\n",
+		   __func__, f->inode, f->len);
+	dirty_add(f, -(long) f->len);
+	f->len = 0;
+    }
+    pthread_mutex_unlock(&f->lock);
+    file_put(f);
+
+    return ret;
+}
+
+int file_mark_deleted(long inode)
+{
+    struct mysqlfs_file *f;
+    int ret = 0;
+
+    pthread_mutex_lock(&table_lock);
+    for (f = *bucket_of(inode); f; f = f->next) {
+	if (f->inode == inode) {
+	    f->deleted = 1;
+	    ret++;
+	}
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    return ret;
+}
+
+int file_is_open(long inode)
+{
+    int ret;
+
+    pthread_mutex_lock(&table_lock);
+    ret = find_locked(inode) != NULL;
+    pthread_mutex_unlock(&table_lock);
+
+    return ret;
+}
+
+size_t file_open_inodes(long *inodes, size_t max)
+{
+    struct mysqlfs_file *f;
+    size_t n = 0;
+    int i;
+
+    pthread_mutex_lock(&table_lock);
+    for (i = 0; i < FILE_BUCKETS; i++) {
+	for (f = table[i]; f; f = f->next) {
+	    /* count each inode at its first handle in the bucket */
+	    if (find_locked(f->inode) != f)
+		continue;
+	    if (n < max)
+		inodes[n] = f->inode;
+	    n++;
+	}
+    }
+    pthread_mutex_unlock(&table_lock);
+
+    return n;
+}
+
+unsigned long file_open_generation()
+{
+    unsigned long ret;
+
+    pthread_mutex_lock(&table_lock);
+    ret = generation;
+    pthread_mutex_unlock(&table_lock);
+
+    return ret;
+}
+
+int file_write(MYSQL *mysql, struct mysqlfs_file *f, const char *buf, size_t size,
+	       off_t offset)
+{
+    int ret = 0;
+    size_t cap;
+    char *p;
+    struct stat st;
+
+    /* What another handle buffers of these bytes is older: out with it first */
+    if (buffer_max) {
+	ret = flush_others(mysql, f->inode, f, offset, size);
+	if (ret < 0)
+	    return ret;
+    }
+
+    /* Large writes and unbuffered mounts go straight to the database */
+    if (size > buffer_max) {
+	pthread_mutex_lock(&f->lock);
+	ret = flush_locked(mysql, f);
+	pthread_mutex_unlock(&f->lock);
+	if (ret < 0)
+	    return ret;
+	return query_write(mysql, f->inode, buf, size, offset);
+    }
+
+    pthread_mutex_lock(&f->lock);
+
+    /* The buffer only holds one contiguous run */
+    if (f->len && (offset != f->start + f->len || f->len + size > buffer_max)) {
+	ret = flush_locked(mysql, f);
+	if (ret < 0)
+	    goto out;
+    }
+
+    if (f->len + size > f->cap) {
+	cap = f->cap ? f->cap : DATA_BLOCK_SIZE;
+	while (cap < f->len + size)
+	    cap *= 2;
+	if (cap > buffer_max)
+	    cap = buffer_max;
+	if ((p = realloc(f->buf, cap)) == NULL) {
+	    pthread_mutex_unlock(&f->lock);
+	    return query_write(mysql, f->inode, buf, size, offset);
+	}
+	f->buf = p;
+	f->cap = cap;
+    }
+
+    if (!f->len)
+	f->start = offset;
+    memcpy(f->buf + f->len, buf, size);
+    f->len += size;
+    ret = size;
+
+    /* Under memory pressure, whoever adds to it writes out its own buffer */
+    if (dirty_add(f, size) > total_max) {
+	int err = flush_locked(mysql, f);
+	if (err < 0)
+	    ret = err;
+    }
+
+out:
+    pthread_mutex_unlock(&f->lock);
+
+    if (ret > 0) {
+	/* the file has grown already, as far as stat() is concerned */
+	st.st_size = offset + size;
+	icache_update(f->inode, ICACHE_GROW, &st);
+    }
+
+    return ret;
+}
+
+/**
+ * After a read of size bytes at offset that returned got, keep read-ahead
+ * in front of a sequential reader.  The window starts at twice the read
+ * and doubles, up to readahead_window(), each time the reader gets within
+ * half a window of what was queued; a read elsewhere turns it off, and so
+ * does the end of the file.
+ */
+static void readahead_after(struct mysqlfs_file *f, off_t offset, size_t size, size_t got)
+{
+    size_t max = readahead_window();
+    off_t end = offset + got, start = 0;
+    size_t len = 0;
+
+    if (!max)
+	return;
+
+    pthread_mutex_lock(&f->lock);
+    if (offset != f->ra_next || got < size) {
+	f->ra_window = 0;
+	f->ra_end = 0;
+    } else if (f->ra_end < end + (off_t) f->ra_window / 2) {
+	if (!f->ra_window)
+	    f->ra_window = MIN(2 * size, max);
+	else if (f->ra_end > offset)
+	    f->ra_window = MIN(2 * f->ra_window, max);
+	start = MAX(f->ra_end, end);
+	len = end + f->ra_window - start;
+	f->ra_end = start + len;
+    }
+    f->ra_next = end;
+    pthread_mutex_unlock(&f->lock);
+
+    if (len)
+	readahead_queue(f->inode, start, len);
+}
+
+int file_read(MYSQL *mysql, struct mysqlfs_file *f, char *buf, size_t size,
+	      off_t offset)
+{
+    int ret;
+
+    ret = file_flush_inode(mysql, f->inode);
+    if (ret < 0)
+	return ret;
+
+    ret = query_read(mysql, f->inode, buf, size, offset);
+    if (ret >= 0)
+	readahead_after(f, offset, size, ret);
+
+    return ret;
+}
+
+int file_flush(MYSQL *mysql, struct mysqlfs_file *f)
+{
+    int ret;
+
+    pthread_mutex_lock(&f->lock);
+    ret = flush_locked(mysql, f);
+    pthread_mutex_unlock(&f->lock);
+
+    return ret;
+}
+
+int file_flush_inode(MYSQL *mysql, long inode)
+{
+    if (!buffer_max)
+	return 0;
+
+    return flush_others(mysql, inode, NULL, 0, 0);
+}
+
+void file_size_buffered(struct stat *st)
+{
+    struct mysqlfs_file *f;
+    long inode = st->st_ino;
+
+    if (!buffer_max)
+	return;
+
+    pthread_mutex_lock(&table_lock);
+    for (f = *bucket_of(inode); f; f = f->next) {
+	if (f->inode != inode)
+	    continue;
+	pthread_mutex_lock(&dirty_lock);
+	if (f->dirty && f->dirty_end > st->st_size)
+	    st->st_size = f->dirty_end;
+	pthread_mutex_unlock(&dirty_lock);
+    }
+    pthread_mutex_unlock(&table_lock);
+}
@@ -0,0 +1,78 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/**
+ * An open file: what fuse_file_info::fh points to.  Writes through the
+ * handle are gathered in a write-back buffer holding one contiguous run of
+ * dirty bytes, which goes to the database in one query_write() when the
+ * file is flushed or released, when a write doesn't continue the run, or
+ * when the buffer (or all buffers together) would grow past their limit.
+ * Reads through the handle are watched for sequential access, which
+ * readahead.c then stays ahead of.  The handles in the open-file table are
+ * also what keeps a deleted file's data around until its last close: open
+ * files are counted here, not in the database (see session.c).
+ */
+struct mysqlfs_file {
+    struct mysqlfs_file	*next;		/**< next open file in the same bucket of the open-file table */
+    long		inode;		/**< inode of the file */
+    pthread_mutex_t	lock;		/**< protects the buffer */
+    char		*buf;		/**< dirty bytes, NULL until the first buffered write */
+    size_t		len;		/**< number of dirty bytes in buf */
+    size_t		cap;		/**< allocated size of buf */
+    off_t		start;		/**< file offset of buf[0] */
+    off_t		ra_next;	/**< offset at which a sequential read would continue */
+    off_t		ra_end;		/**< end of what has been queued for read-ahead */
+    size_t		ra_window;	/**< read-ahead window, 0 while reads are not sequential */
+    int			deleted;	/**< the inode lost its last name while open, see file_mark_deleted() */
+    int			refs;		/**< the open handle and each flush of another thread in progress; protected by the table lock */
+    size_t		dirty;		/**< bytes of this handle buffered or being written out; protected by the dirty lock */
+    off_t		dirty_end;	/**< file offset at which those bytes end */
+};
+
+struct mysqlfs_opt;
+
+/** Set up the open-file table and the write-back buffer limits */
+int file_init(struct mysqlfs_opt *opt);
+
+/** Free the open-file table */
+void file_cleanup();
+
+/** Allocate the handle of a newly opened file; NULL if out of memory */
+struct mysqlfs_file *file_open(long inode);
+
+/** Free a handle, which the caller should have flushed: 1 if it was the last one of an inode deleted while open, for the caller to purge, else 0 */
+int file_close(struct mysqlfs_file *f);
+
+/** Note that an inode lost its last name: the number of handles open on it, 0 if the caller may purge it now */
+int file_mark_deleted(long inode);
+
+/** Whether this mount has the inode open */
+int file_is_open(long inode);
+
+/** Copy up to max of the inodes open on this mount to inodes, each once: how many there are in all */
+size_t file_open_inodes(long *inodes, size_t max);
+
+/** A counter that changes whenever an inode is opened for the first time or closed for the last */
+unsigned long file_open_generation();
+
+/** Write through a handle, into its buffer if possible: bytes written or -errno */
+int file_write(MYSQL *mysql, struct mysqlfs_file *f, const char *buf, size_t size, off_t offset);
+
+/** Read from a file, flushing what is buffered for it first: bytes read or -errno */
+int file_read(MYSQL *mysql, struct mysqlfs_file *f, char *buf, size_t size, off_t offset);
+
+/** Write the buffer of a handle to the database: 0 or -errno */
+int file_flush(MYSQL *mysql, struct mysqlfs_file *f);
+
+/** Write the buffers of all open handles of an inode to the database: 0 or -errno */
+int file_flush_inode(MYSQL *mysql, long inode);
+
+/** Raise st->st_size to the end of what open handles of st->st_ino still buffer */
+void file_size_buffered(struct stat *st);
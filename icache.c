@@ -0,0 +1,180 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "pool.h"
+#include "icache.h"
+#include "log.h"
+
+/** number of lock stripes over the slot table; a power of two */
+#define ICACHE_STRIPES	64
+
+/**
+ * One slot of the direct-mapped attribute cache.  An inode can only live in
+ * the slot its number hashes to, so a colliding inode simply replaces it.
+ */
+struct icache_slot {
+    long		inode;		/**< cached inode, 0 if the slot is free */
+    time_t		expires;	/**< attributes are stale after this time */
+    struct stat		st;		/**< the attributes themselves */
+};
+
+static struct icache_slot *slots = NULL;
+static unsigned long nr_slots = 0;
+static unsigned int attr_timeout = 0;
+static pthread_mutex_t stripes[ICACHE_STRIPES];
+
+static inline unsigned long slot_index(long inode)
+{
+    /* Fibonacci hashing spreads sequential inode numbers over the table */
+    return ((unsigned long) inode * 11400714819323198485ULL) % nr_slots;
+}
+
+static inline pthread_mutex_t *stripe_of(unsigned long idx)
+{
+    return &stripes[idx & (ICACHE_STRIPES - 1)];
+}
+
+int icache_init(struct mysqlfs_opt *opt)
+{
+    int i;
+
+    attr_timeout = opt->attr_timeout;
+    if (!attr_timeout)
+	return 0;
+
+    nr_slots = opt->attr_entries ? opt->attr_entries : 1;
+    slots = calloc(nr_slots, sizeof(struct icache_slot));
+    if (!slots) {
+	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	attr_timeout = 0;
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < ICACHE_STRIPES; i++)
+	pthread_mutex_init(&stripes[i], NULL);
+
+    log_printf(LOG_D_OTHER, "%s(): timeout=%us entries=%lu\n", __func__,
+	       attr_timeout, nr_slots);
+    return 0;
+}
+
+void icache_cleanup()
+{
+    int i;
+
+    if (!slots)
+	return;
+
+    for (i = 0; i < ICACHE_STRIPES; i++)
+	pthread_mutex_destroy(&stripes[i]);
+    free(slots);
+    slots = NULL;
+    attr_timeout = 0;
+}
+
+int icache_get(long inode, struct stat *stbuf)
+{
+    unsigned long idx;
+    struct icache_slot *slot;
+    int ret = -ENOENT;
+
+    if (!attr_timeout)
+	return -ENOENT;
+
+    idx = slot_index(inode);
+    slot = &slots[idx];
+
+    pthread_mutex_lock(stripe_of(idx));
+    if (slot->inode == inode) {
+	if (slot->expires < time(NULL)) {
+	    slot->inode = 0;
+	} else {
+	    memcpy(stbuf, &slot->st, sizeof(struct stat));
+	    ret = 0;
+	}
+    }
+    pthread_mutex_unlock(stripe_of(idx));
+
+    return ret;
+}
+
+void icache_put(long inode, const struct stat *stbuf)
+{
+    unsigned long idx;
+    struct icache_slot *slot;
+
+    if (!attr_timeout)
+	return;
+
+    idx = slot_index(inode);
+    slot = &slots[idx];
+
+    pthread_mutex_lock(stripe_of(idx));
+    slot->inode = inode;
+    slot->expires = time(NULL) + attr_timeout;
+    memcpy(&slot->st, stbuf, sizeof(struct stat));
+    pthread_mutex_unlock(stripe_of(idx));
+}
+
+void icache_update(long inode, int fields, const struct stat *stbuf)
+{
+    unsigned long idx;
+    struct icache_slot *slot;
+
+    if (!attr_timeout)
+	return;
+
+    idx = slot_index(inode);
+    slot = &slots[idx];
+
+    pthread_mutex_lock(stripe_of(idx));
+    if (slot->inode == inode) {
+	if (fields & ICACHE_MODE)
+	    slot->st.st_mode = stbuf->st_mode;
+	if (fields & ICACHE_UID)
+	    slot->st.st_uid = stbuf->st_uid;
+	if (fields & ICACHE_GID)
+	    slot->st.st_gid = stbuf->st_gid;
+	if (fields & ICACHE_ATIME)
+	    slot->st.st_atime = stbuf->st_atime;
+	if (fields & ICACHE_MTIME)
+	    slot->st.st_mtime = stbuf->st_mtime;
+	if (fields & ICACHE_SIZE)
+	    slot->st.st_size = stbuf->st_size;
+	if ((fields & ICACHE_GROW) && slot->st.st_size < stbuf->st_size)
+	    slot->st.st_size = stbuf->st_size;
+    }
+    pthread_mutex_unlock(stripe_of(idx));
+}
+
+void icache_invalidate(long inode)
+{
+    unsigned long idx;
+
+    if (!attr_timeout)
+	return;
+
+    idx = slot_index(inode);
+
+    pthread_mutex_lock(stripe_of(idx));
+    if (slots[idx].inode == inode)
+	slots[idx].inode = 0;
+    pthread_mutex_unlock(stripe_of(idx));
+}
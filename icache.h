@@ -0,0 +1,40 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Fields of a cached struct stat that icache_update() should change */
+enum icache_fields {
+  ICACHE_MODE	= 0x0001,	/**< st_mode */
+  ICACHE_UID	= 0x0002,	/**< st_uid */
+  ICACHE_GID	= 0x0004,	/**< st_gid */
+  ICACHE_ATIME	= 0x0008,	/**< st_atime */
+  ICACHE_MTIME	= 0x0010,	/**< st_mtime */
+  ICACHE_SIZE	= 0x0020,	/**< st_size, set exactly (truncate) */
+  ICACHE_GROW	= 0x0040,	/**< st_size, only ever increased (write) */
+};
+
+struct mysqlfs_opt;
+
+/** Initialize the inode attribute cache; a zero mysqlfs_opt::attr_timeout leaves it disabled */
+int icache_init(struct mysqlfs_opt *opt);
+
+/** Drop all entries and free the attribute cache */
+void icache_cleanup();
+
+/** Copy the cached attributes of an inode to stbuf: 0 on a hit, -ENOENT if not cached */
+int icache_get(long inode, struct stat *stbuf);
+
+/** Cache the complete attributes of an inode */
+void icache_put(long inode, const struct stat *stbuf);
+
+/** Write-through: change the given fields of an already cached inode */
+void icache_update(long inode, int fields, const struct stat *stbuf);
+
+/** Forget the cached attributes of an inode */
+void icache_invalidate(long inode);
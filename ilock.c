@@ -0,0 +1,190 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ilock.h"
+#include "log.h"
+
+/** buckets of the lock table, each with a mutex of its own; a power of two */
+#define ILOCK_BUCKETS	256
+
+/**
+ * The reader/writer lock of one inode.  It exists while a thread holds it
+ * or waits for it, so inodes never share a lock and the table only holds
+ * the inodes in use.
+ */
+struct ilock {
+    long		inode;
+    unsigned int	users;		/**< threads holding or waiting for the lock */
+    unsigned int	readers;	/**< threads holding it shared */
+    struct timespec	since;		/**< when the writer, or the first of the readers, took it */
+    pthread_rwlock_t	lock;
+    struct ilock	*next;
+};
+
+/**
+ * A bucket of the table.  Its mutex only guards the list and the counters
+ * and is never held while waiting for an inode lock, so threads locking
+ * different inodes only ever meet for the few instructions it takes to
+ * find their entries.
+ */
+struct ilock_bucket {
+    pthread_mutex_t	mutex;
+    struct ilock	*head;
+    unsigned long	taken;		/**< locks taken */
+    unsigned long	waits;		/**< of those, locks that were not free at once */
+    unsigned long long	wait_us;	/**< time spent waiting for them */
+    unsigned long long	hold_us;	/**< time inodes were locked, shared or not */
+};
+
+static struct ilock_bucket buckets[ILOCK_BUCKETS];
+
+static inline struct ilock_bucket *bucket_of(long inode)
+{
+    /* Fibonacci hashing spreads sequential inode numbers over the table */
+    return &buckets[((unsigned long) inode * 11400714819323198485ULL) % ILOCK_BUCKETS];
+}
+
+static inline unsigned long long elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000LL + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static struct ilock *find(struct ilock_bucket *b, long inode)
+{
+    struct ilock *l;
+
+    for (l = b->head; l && l->inode != inode; l = l->next)
+	;
+    return l;
+}
+
+void ilock_init()
+{
+    int i;
+
+    for (i = 0; i < ILOCK_BUCKETS; i++) {
+	memset(&buckets[i], 0, sizeof(buckets[i]));
+	pthread_mutex_init(&buckets[i].mutex, NULL);
+    }
+}
+
+void ilock_cleanup()
+{
+    struct ilock *l;
+    int i;
+
+    for (i = 0; i < ILOCK_BUCKETS; i++) {
+	pthread_mutex_lock(&buckets[i].mutex);
+	while ((l = buckets[i].head) != NULL) {
+	    buckets[i].head = l->next;
+	    pthread_rwlock_destroy(&l->lock);
+	    free(l);
+	}
+	pthread_mutex_unlock(&buckets[i].mutex);
+    }
+}
+
+void ilock_lock(long inode, int exclusive)
+{
+    struct ilock_bucket *b = bucket_of(inode);
+    struct timespec start, now;
+    struct ilock *l;
+    int busy;
+
+    pthread_mutex_lock(&b->mutex);
+    if ((l = find(b, inode)) == NULL) {
+	if ((l = calloc(1, sizeof(struct ilock))) == NULL) {
+	    pthread_mutex_unlock(&b->mutex);
+	    log_printf(LOG_ERROR, "%s(inode=%ld): %s\n", __func__, inode, strerror(ENOMEM));
+	    return;
+	}
+	l->inode = inode;
+	pthread_rwlock_init(&l->lock, NULL);
+	l->next = b->head;
+	b->head = l;
+    }
+    l->users++;
+    pthread_mutex_unlock(&b->mutex);
+
+    busy = exclusive ? pthread_rwlock_trywrlock(&l->lock) : pthread_rwlock_tryrdlock(&l->lock);
+    if (busy) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (exclusive)
+	    pthread_rwlock_wrlock(&l->lock);
+	else
+	    pthread_rwlock_rdlock(&l->lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&b->mutex);
+    b->taken++;
+    if (busy) {
+	b->waits++;
+	b->wait_us += elapsed_us(&start, &now);
+    }
+    if (exclusive || !l->readers++)
+	l->since = now;
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void ilock_unlock(long inode, int exclusive)
+{
+    struct ilock_bucket *b = bucket_of(inode);
+    struct timespec now;
+    struct ilock *l, **pp;
+
+    pthread_mutex_lock(&b->mutex);
+    if ((l = find(b, inode)) == NULL) {
+	/* ilock_lock() could not make the entry */
+	pthread_mutex_unlock(&b->mutex);
+	return;
+    }
+
+    if (exclusive || !--l->readers) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->hold_us += elapsed_us(&l->since, &now);
+    }
+    pthread_rwlock_unlock(&l->lock);
+
+    if (!--l->users) {
+	for (pp = &b->head; *pp != l; pp = &(*pp)->next)
+	    ;
+	*pp = l->next;
+	pthread_rwlock_destroy(&l->lock);
+	free(l);
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+void ilock_stats(unsigned long *taken, unsigned long *waits,
+		 unsigned long long *wait_us, unsigned long long *hold_us)
+{
+    int i;
+
+    *taken = *waits = 0;
+    *wait_us = *hold_us = 0;
+    for (i = 0; i < ILOCK_BUCKETS; i++) {
+	pthread_mutex_lock(&buckets[i].mutex);
+	*taken += buckets[i].taken;
+	*waits += buckets[i].waits;
+	*wait_us += buckets[i].wait_us;
+	*hold_us += buckets[i].hold_us;
+	pthread_mutex_unlock(&buckets[i].mutex);
+    }
+}
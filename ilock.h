@@ -0,0 +1,25 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+/** Initialize the inode lock table */
+void ilock_init();
+
+/** Free what is left of the inode lock table */
+void ilock_cleanup();
+
+/** Take the lock of an inode, shared by readers or exclusive to one writer */
+void ilock_lock(long inode, int exclusive);
+
+/** Release a lock taken by ilock_lock(), with the same exclusive flag */
+void ilock_unlock(long inode, int exclusive);
+
+/** Locks taken, how many of them had to wait, and the total wait and hold times in microseconds, for the status file */
+void ilock_stats(unsigned long *taken, unsigned long *waits,
+		 unsigned long long *wait_us, unsigned long long *hold_us);
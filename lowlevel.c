@@ -0,0 +1,819 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/**
+ * @file
+ * Inode-based frontend on top of the FUSE lowlevel API.  The kernel hands
+ * us the (parent inode, name) of every lookup and the inode of every other
+ * operation, so unlike the path-based frontend in mysqlfs.c no request ever
+ * has to resolve a full path again.  Selected with -olowlevel.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <utime.h>
+#include <fuse/fuse.h>
+#include <fuse/fuse_lowlevel.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "dcache.h"
+#include "icache.h"
+#include "lowlevel.h"
+#include "file.h"
+#include "reaper.h"
+#include "session.h"
+#include "log.h"
+
+/** buckets of the lookup count table; a power of two */
+#define NLOOKUP_BUCKETS	4096
+
+/** directory entry inode number when we don't know it, as the high-level API uses */
+#define LL_UNKNOWN_INO	0xffffffff
+
+static struct mysqlfs_opt *ll_opt = NULL;
+
+/** inode of "/" in the database; FUSE always calls it FUSE_ROOT_ID */
+static long root_inode = FUSE_ROOT_ID;
+
+/**
+ * Number of times the kernel was handed an inode in a lookup-like reply and
+ * hasn't forgotten it yet.  An unlinked inode must survive until this drops
+ * to zero, since the kernel may still send requests for it.
+ */
+struct nlookup {
+    struct nlookup	*next;		/**< next entry in the same bucket */
+    long		inode;		/**< database inode */
+    unsigned long	count;		/**< outstanding lookups */
+    int			unlinked;	/**< the inode lost a name since, see nlookup_unlink() */
+};
+
+static struct nlookup *nlookup_table[NLOOKUP_BUCKETS];
+static pthread_mutex_t nlookup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Map between FUSE inode numbers and database inodes.  Only the root
+ * differs, so swapping FUSE_ROOT_ID and the root inode is its own inverse.
+ */
+static inline long ll_map(long ino)
+{
+    if (ino == FUSE_ROOT_ID)
+	return root_inode;
+    if (ino == root_inode)
+	return FUSE_ROOT_ID;
+    return ino;
+}
+
+static void nlookup_inc(long inode)
+{
+    struct nlookup *n, **head = &nlookup_table[inode & (NLOOKUP_BUCKETS - 1)];
+
+    pthread_mutex_lock(&nlookup_lock);
+    for (n = *head; n; n = n->next)
+	if (n->inode == inode)
+	    break;
+    if (!n && (n = calloc(1, sizeof(struct nlookup))) != NULL) {
+	n->inode = inode;
+	n->next = *head;
+	*head = n;
+    }
+    if (n)
+	n->count++;
+    pthread_mutex_unlock(&nlookup_lock);
+}
+
+/**
+ * Drop count lookups of an inode and return how many remain; with none
+ * left, *unlinked (if given) tells whether the inode lost a name meanwhile.
+ */
+static unsigned long nlookup_dec(long inode, unsigned long count, int *unlinked)
+{
+    struct nlookup *n, **pp = &nlookup_table[inode & (NLOOKUP_BUCKETS - 1)];
+    unsigned long ret = 0;
+
+    pthread_mutex_lock(&nlookup_lock);
+    for (; (n = *pp) != NULL; pp = &n->next) {
+	if (n->inode != inode)
+	    continue;
+	if (n->count > count) {
+	    n->count -= count;
+	    ret = n->count;
+	} else {
+	    if (unlinked)
+		*unlinked = n->unlinked;
+	    *pp = n->next;
+	    free(n);
+	}
+	break;
+    }
+    pthread_mutex_unlock(&nlookup_lock);
+
+    return ret;
+}
+
+/**
+ * Note that an inode lost a name, or its last open file, and return its
+ * outstanding lookups: if there are any, mysqlfs_ll_forget() hands it to
+ * the reaper, else the caller does.
+ */
+static unsigned long nlookup_unlink(long inode)
+{
+    struct nlookup *n;
+    unsigned long ret = 0;
+
+    pthread_mutex_lock(&nlookup_lock);
+    for (n = nlookup_table[inode & (NLOOKUP_BUCKETS - 1)]; n; n = n->next) {
+	if (n->inode == inode) {
+	    n->unlinked = 1;
+	    ret = n->count;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&nlookup_lock);
+
+    return ret;
+}
+
+static void ll_reply_attr(fuse_req_t req, struct stat *stbuf)
+{
+    stbuf->st_ino = ll_map(stbuf->st_ino);
+    fuse_reply_attr(req, stbuf, ll_opt->attr_timeout);
+}
+
+/** reply with a looked-up or created inode, counting the lookup */
+static void ll_reply_entry(fuse_req_t req, const struct stat *stbuf)
+{
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+    e.ino = ll_map(stbuf->st_ino);
+    e.attr = *stbuf;
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = ll_opt->attr_timeout;
+    e.entry_timeout = ll_opt->dcache_timeout;
+
+    nlookup_inc(stbuf->st_ino);
+    /* an interrupted request never reaches the kernel, so won't be forgotten */
+    if (fuse_reply_entry(req, &e) == -ENOENT)
+	nlookup_dec(stbuf->st_ino, 1, NULL);
+}
+
+/**
+ * Drop the name of a file or directory, and the inode with it once the last
+ * name is gone and neither the kernel nor an open file still refers to it,
+ * in one transaction (see query_begin()).
+ */
+static int ll_remove(MYSQL *dbconn, long parent, const char *name)
+{
+    struct stat st;
+    int ret;
+
+    ret = query_lookup(dbconn, parent, name, &st);
+    if (ret < 0)
+	return ret;
+
+    if ((ret = query_begin(dbconn)) < 0)
+	return ret;
+
+    ret = query_rmdirentry(dbconn, name, parent);
+    if (ret < 0) {
+	log_printf(LOG_ERROR, "Error: query_rmdirentry()\n");
+	goto err_out;
+    }
+    icache_invalidate(st.st_ino);
+
+    /* No-op while other names are left */
+    ret = query_set_deleted(dbconn, st.st_ino);
+    if (ret < 0) {
+	log_printf(LOG_ERROR, "Error: query_set_deleted()\n");
+	goto err_out;
+    }
+
+    if ((ret = query_commit(dbconn)) < 0)
+	return ret;
+
+    /* Otherwise mysqlfs_ll_forget() hands it to the reaper */
+    if (!nlookup_unlink(st.st_ino))
+	ret = reaper_purge(dbconn, st.st_ino);
+
+    return ret;
+
+err_out:
+    query_rollback(dbconn);
+    return ret;
+}
+
+static void mysqlfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    struct stat st;
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, \"%s\")\n", __func__, parent, name);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = query_lookup(dbconn, ll_map(parent), name, &st);
+    pool_put(dbconn);
+
+    if (ret == -ENOENT && ll_opt->dcache_timeout) {
+	/* let the kernel cache the negative entry as well */
+	memset(&e, 0, sizeof(e));
+	e.entry_timeout = ll_opt->dcache_timeout;
+	fuse_reply_entry(req, &e);
+	return;
+    }
+    if (ret < 0) {
+	fuse_reply_err(req, -ret);
+	return;
+    }
+
+    ll_reply_entry(req, &st);
+}
+
+static void mysqlfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    MYSQL *dbconn;
+    long inode = ll_map(ino);
+    int unlinked = 0;
+
+    log_printf(LOG_D_CALL, "%s(%lu, %lu)\n", __func__, ino, nlookup);
+
+    /* the last reference to an unlinked inode is gone; others stay */
+    if (nlookup_dec(inode, nlookup, &unlinked) == 0 && unlinked &&
+	(dbconn = pool_get()) != NULL) {
+	reaper_purge(dbconn, inode);
+	pool_put(dbconn);
+    }
+
+    fuse_reply_none(req);
+}
+
+static void mysqlfs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			       struct fuse_file_info *fi)
+{
+    struct stat st;
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = query_getattr_inode(dbconn, ll_map(ino), &st);
+    pool_put(dbconn);
+
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	ll_reply_attr(req, &st);
+}
+
+static void mysqlfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			       int to_set, struct fuse_file_info *fi)
+{
+    struct stat st;
+    struct utimbuf tbuf;
+    MYSQL *dbconn;
+    long inode = ll_map(ino);
+    int ret = 0;
+
+    log_printf(LOG_D_CALL, "%s(%lu, 0x%x)\n", __func__, ino, to_set);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_MODE)
+	ret = query_chmod(dbconn, inode, attr->st_mode);
+
+    if (!ret && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+	ret = query_chown(dbconn, inode,
+			  (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1,
+			  (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1);
+
+    if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+	ret = file_flush_inode(dbconn, inode);
+	if (!ret)
+	    ret = query_truncate(dbconn, inode, attr->st_size);
+    }
+
+    if (!ret && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+	ret = query_getattr_inode(dbconn, inode, &st);
+	if (!ret) {
+	    tbuf.actime = (to_set & FUSE_SET_ATTR_ATIME) ? attr->st_atime : st.st_atime;
+	    tbuf.modtime = (to_set & FUSE_SET_ATTR_MTIME) ? attr->st_mtime : st.st_mtime;
+	    ret = query_utime(dbconn, inode, &tbuf);
+	}
+    }
+
+    if (!ret)
+	ret = query_getattr_inode(dbconn, inode, &st);
+    pool_put(dbconn);
+
+    if (ret) {
+	fuse_reply_err(req, ret < 0 ? -ret : EIO);
+	return;
+    }
+
+    ll_reply_attr(req, &st);
+}
+
+static void mysqlfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX];
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = query_read(dbconn, ll_map(ino), buf, sizeof(buf) - 1, 0);
+    pool_put(dbconn);
+
+    if (ret < 0) {
+	fuse_reply_err(req, -ret);
+	return;
+    }
+
+    buf[ret] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+/** create an inode named name in parent, optionally with content, and reply with its entry */
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+		      mode_t mode, dev_t rdev, const char *content)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    struct stat st;
+    MYSQL *dbconn;
+    long inode;
+    int ret;
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    if (S_ISDIR(mode))
+	inode = query_mkdir(dbconn, name, mode, ll_map(parent),
+			    ctx->uid, ctx->gid);
+    else
+	inode = query_mknod(dbconn, name, mode, rdev, ll_map(parent),
+			    S_ISREG(mode) || S_ISLNK(mode), ctx->uid, ctx->gid);
+    if (inode < 0) {
+	pool_put(dbconn);
+	fuse_reply_err(req, -inode);
+	return;
+    }
+
+    if (content) {
+	ret = query_write(dbconn, inode, content, strlen(content), 0);
+	if (ret < 0) {
+	    pool_put(dbconn);
+	    fuse_reply_err(req, -ret);
+	    return;
+	}
+    }
+
+    ret = query_getattr_inode(dbconn, inode, &st);
+    pool_put(dbconn);
+
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	ll_reply_entry(req, &st);
+}
+
+static void mysqlfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			     mode_t mode, dev_t rdev)
+{
+    log_printf(LOG_D_CALL, "%s(%lu, \"%s\", 0%o)\n", __func__, parent, name, mode);
+    ll_create(req, parent, name, mode, rdev, NULL);
+}
+
+static void mysqlfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+			     mode_t mode)
+{
+    log_printf(LOG_D_CALL, "%s(%lu, \"%s\", 0%o)\n", __func__, parent, name, mode);
+    ll_create(req, parent, name, S_IFDIR | mode, 0, NULL);
+}
+
+static void mysqlfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+			       const char *name)
+{
+    log_printf(LOG_D_CALL, "%s(\"%s\", %lu, \"%s\")\n", __func__, link, parent, name);
+    ll_create(req, parent, name, S_IFLNK | 0755, 0, link);
+}
+
+static void mysqlfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, \"%s\")\n", __func__, parent, name);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = ll_remove(dbconn, ll_map(parent), name);
+    pool_put(dbconn);
+
+    fuse_reply_err(req, -ret);
+}
+
+static void mysqlfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+			      fuse_ino_t newparent, const char *newname)
+{
+    MYSQL *dbconn;
+    long replaced;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, \"%s\", %lu, \"%s\")\n", __func__,
+	       parent, name, newparent, newname);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    /* rename() replaces an existing target, in the same call */
+    ret = query_rename_replace(dbconn, ll_map(parent), name, ll_map(newparent),
+			       newname, &replaced);
+    if (ret == 0 && replaced && !nlookup_unlink(replaced))
+	reaper_purge(dbconn, replaced);
+
+    pool_put(dbconn);
+    fuse_reply_err(req, -ret);
+}
+
+static void mysqlfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+			    const char *newname)
+{
+    struct stat st;
+    MYSQL *dbconn;
+    long inode = ll_map(ino);
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, %lu, \"%s\")\n", __func__, ino, newparent, newname);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = query_mkdirentry(dbconn, inode, newname, ll_map(newparent));
+    if (ret < 0) {
+	pool_put(dbconn);
+	fuse_reply_err(req, -ret);
+	return;
+    }
+
+    ret = query_getattr_inode(dbconn, inode, &st);
+    pool_put(dbconn);
+
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	ll_reply_entry(req, &st);
+}
+
+static inline struct mysqlfs_file *ll_file(struct fuse_file_info *fi)
+{
+    return (struct mysqlfs_file *) (unsigned long) fi->fh;
+}
+
+/** flush and free an open file, and drop the inode if that was its last use */
+static int ll_close(struct mysqlfs_file *f)
+{
+    MYSQL *dbconn;
+    long inode = f->inode;
+    int ret;
+
+    if ((dbconn = pool_get()) == NULL) {
+	file_close(f);
+	return -EMFILE;
+    }
+
+    ret = file_flush(dbconn, f);
+    if (ret < 0)
+	log_printf(LOG_ERROR, "Error: file_flush(inode=%ld): %s\n", inode, strerror(-ret));
+
+    /* Only the last close of a file deleted while open goes to the database */
+    ret = file_close(f) && !nlookup_unlink(inode) ? reaper_purge(dbconn, inode) : 0;
+    pool_put(dbconn);
+
+    return ret;
+}
+
+static void mysqlfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct mysqlfs_file *f;
+    long inode = ll_map(ino);
+
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    /* The handle counts the open, see session.c */
+    if ((f = file_open(inode)) == NULL) {
+	fuse_reply_err(req, ENOMEM);
+	return;
+    }
+    session_opened();
+
+    fi->fh = (unsigned long) f;
+    if (fuse_reply_open(req, fi) == -ENOENT)
+	ll_close(f);
+}
+
+static void mysqlfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			    struct fuse_file_info *fi)
+{
+    MYSQL *dbconn;
+    char *buf;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, %zu, %lld)\n", __func__, ino, size, (long long) off);
+
+    if ((buf = malloc(size)) == NULL) {
+	fuse_reply_err(req, ENOMEM);
+	return;
+    }
+
+    if ((dbconn = pool_get()) == NULL) {
+	free(buf);
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = file_read(dbconn, ll_file(fi), buf, size, off);
+    pool_put(dbconn);
+
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	fuse_reply_buf(req, buf, ret);
+    free(buf);
+}
+
+static void mysqlfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			     size_t size, off_t off, struct fuse_file_info *fi)
+{
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu, %zu, %lld)\n", __func__, ino, size, (long long) off);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = file_write(dbconn, ll_file(fi), buf, size, off);
+    pool_put(dbconn);
+
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	fuse_reply_write(req, ret);
+}
+
+static void mysqlfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    MYSQL *dbconn;
+    int ret;
+
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    if ((dbconn = pool_get()) == NULL) {
+	fuse_reply_err(req, EMFILE);
+	return;
+    }
+
+    ret = file_flush(dbconn, ll_file(fi));
+    pool_put(dbconn);
+
+    fuse_reply_err(req, -ret);
+}
+
+static void mysqlfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			     struct fuse_file_info *fi)
+{
+    mysqlfs_ll_flush(req, ino, fi);
+}
+
+static void mysqlfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    fuse_reply_err(req, -ll_close(ll_file(fi)));
+}
+
+/** A reply buffer for readdir(), filled up to the size the kernel asked for */
+struct ll_dirbuf {
+    fuse_req_t	req;		/**< request the buffer is being filled for */
+    char	*p;		/**< packed fuse_dirent entries */
+    size_t	size;		/**< bytes used in p */
+    size_t	max;		/**< bytes available in p */
+};
+
+/** fuse_fill_dir_t that packs a directory entry into a struct ll_dirbuf; 1 when full */
+static int ll_dirbuf_add(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    struct ll_dirbuf *b = buf;
+    struct stat st;
+    size_t len;
+
+    memset(&st, 0, sizeof(st));
+    st.st_ino = stbuf ? ll_map(stbuf->st_ino) : LL_UNKNOWN_INO;
+    if (stbuf)
+	st.st_mode = stbuf->st_mode;
+
+    len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+    if (b->size + len > b->max)
+	return 1;
+    fuse_add_direntry(b->req, b->p + b->size, b->max - b->size, name, &st, off);
+    b->size += len;
+
+    return 0;
+}
+
+static void mysqlfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct dir_cursor *cur;
+
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    if ((cur = calloc(1, sizeof(struct dir_cursor))) == NULL) {
+	fuse_reply_err(req, ENOMEM);
+	return;
+    }
+    cur->inode = ll_map(ino);
+
+    fi->fh = (unsigned long) cur;
+    if (fuse_reply_open(req, fi) == -ENOENT)
+	free(cur);
+}
+
+static void mysqlfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			       off_t off, struct fuse_file_info *fi)
+{
+    struct dir_cursor *cur = (struct dir_cursor *) (unsigned long) fi->fh;
+    struct ll_dirbuf b;
+    MYSQL *dbconn;
+    off_t n = 0;
+    int ret = 0;
+
+    log_printf(LOG_D_CALL, "%s(%lu, %zu, %lld)\n", __func__, ino, size, (long long) off);
+
+    b.req = req;
+    b.size = 0;
+    b.max = size;
+    if ((b.p = malloc(size)) == NULL) {
+	fuse_reply_err(req, ENOMEM);
+	return;
+    }
+
+    if (off <= n++ && ll_dirbuf_add(&b, ".", NULL, n))
+	goto out;
+    if (off <= n++ && ll_dirbuf_add(&b, "..", NULL, n))
+	goto out;
+
+    /* continue from the cursor, unless this is a rewinddir() or seekdir() */
+    cur->base = n;
+    if (off != cur->offset || off <= n) {
+	cur->offset = off > n ? off : n;
+	cur->name[0] = '\0';
+    }
+
+    if ((dbconn = pool_get()) == NULL) {
+	ret = -EMFILE;
+	goto out;
+    }
+    ret = query_readdir(dbconn, cur, &b, ll_dirbuf_add, ll_opt->readdirplus);
+    pool_put(dbconn);
+
+out:
+    if (ret < 0)
+	fuse_reply_err(req, -ret);
+    else
+	fuse_reply_buf(req, b.p, b.size);
+    free(b.p);
+}
+
+static void mysqlfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+				  struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "%s(%lu)\n", __func__, ino);
+
+    free((struct dir_cursor *) (unsigned long) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops mysqlfs_ll_oper = {
+    .lookup	= mysqlfs_ll_lookup,
+    .forget	= mysqlfs_ll_forget,
+    .getattr	= mysqlfs_ll_getattr,
+    .setattr	= mysqlfs_ll_setattr,
+    .readlink	= mysqlfs_ll_readlink,
+    .mknod	= mysqlfs_ll_mknod,
+    .mkdir	= mysqlfs_ll_mkdir,
+    .unlink	= mysqlfs_ll_unlink,
+    .rmdir	= mysqlfs_ll_unlink,
+    .symlink	= mysqlfs_ll_symlink,
+    .rename	= mysqlfs_ll_rename,
+    .link	= mysqlfs_ll_link,
+    .open	= mysqlfs_ll_open,
+    .read	= mysqlfs_ll_read,
+    .write	= mysqlfs_ll_write,
+    .flush	= mysqlfs_ll_flush,
+    .release	= mysqlfs_ll_release,
+    .fsync	= mysqlfs_ll_fsync,
+    .opendir	= mysqlfs_ll_opendir,
+    .readdir	= mysqlfs_ll_readdir,
+    .releasedir	= mysqlfs_ll_releasedir,
+};
+
+int mysqlfs_lowlevel_main(struct fuse_args *args, struct mysqlfs_opt *opt)
+{
+    struct fuse_chan *ch;
+    struct fuse_session *se;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+    MYSQL *dbconn;
+
+    ll_opt = opt;
+
+    if ((dbconn = pool_get()) == NULL)
+	return -1;
+    root_inode = query_inode(dbconn, "/");
+    pool_put(dbconn);
+    if (root_inode < 0) {
+	log_printf(LOG_ERROR, "Error: no root inode\n");
+	return -1;
+    }
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+	return -1;
+
+    if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+	se = fuse_lowlevel_new(args, &mysqlfs_ll_oper, sizeof(mysqlfs_ll_oper), NULL);
+	if (se != NULL) {
+	    if (fuse_set_signal_handlers(se) != -1) {
+		fuse_session_add_chan(se, ch);
+#if FUSE_VERSION >= 27
+		fuse_daemonize(foreground);
+#else
+		if (!foreground && daemon(0, 0) == -1)
+		    log_printf(LOG_ERROR, "Error: daemon(): %s\n", strerror(errno));
+#endif
+		if (multithreaded)
+		    err = fuse_session_loop_mt(se);
+		else
+		    err = fuse_session_loop(se);
+		fuse_remove_signal_handlers(se);
+		fuse_session_remove_chan(ch);
+	    }
+	    fuse_session_destroy(se);
+	}
+	fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err ? -1 : 0;
+}
@@ -0,0 +1,15 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+struct fuse_args;
+struct mysqlfs_opt;
+
+/** Mount and serve the filesystem through the inode-based FUSE lowlevel API; returns when unmounted */
+int mysqlfs_lowlevel_main(struct fuse_args *args, struct mysqlfs_opt *opt);
@@ -36,6 +36,15 @@
 #include "mysqlfs.h"
 #include "query.h"
 #include "pool.h"
+#include "dcache.h"
+#include "icache.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "ilock.h"
+#include "reaper.h"
+#include "session.h"
+#include "lowlevel.h"
+#include "file.h"
 #include "log.h"
 
 #ifdef STATUSDIR
@@ -59,6 +68,16 @@ static int snprint_status(char *, size_t, struct mysqlfs_opt *, long);
  */
 struct mysqlfs_opt *theopts;
 
+/** the struct mysqlfs_file of an open file, or NULL for the bogus status files */
+static inline struct mysqlfs_file *file_of(struct fuse_file_info *fi)
+{
+#ifdef STATUSDIR
+    if (fi->fh == inode_status_txt || fi->fh == inode_status_xml)
+        return NULL;
+#endif
+    return (struct mysqlfs_file *) (unsigned long) fi->fh;
+}
+
 static int mysqlfs_getattr(const char *path, struct stat *stbuf)
 {
     int ret;
@@ -111,81 +130,117 @@ static int mysqlfs_getattr(const char *path, struct stat *stbuf)
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_getattr(dbconn, path, stbuf);
+    ret = query_getattr_full(dbconn, path, stbuf);
+    if (ret < 0 && ret != -ENOENT)
+        log_printf(LOG_ERROR, "Error: query_getattr_full()\n");
 
-    if(ret){
-        if (ret != -ENOENT)
-            log_printf(LOG_ERROR, "Error: query_getattr()\n");
+    pool_put(dbconn);
+
+    return ret;
+}
+
+/** FUSE function for opendir(): resolve the directory and start a cursor over its entries */
+static int mysqlfs_opendir(const char *path, struct fuse_file_info *fi)
+{
+    MYSQL *dbconn;
+    long inode;
+    struct dir_cursor *cur;
+
+    log_printf(LOG_D_CALL, "mysqlfs_opendir(\"%s\")\n", path);
+
+#ifdef STATUSDIR
+    /* the bogus "status" directory has no inode, its cursor has 0 */
+    if (0 == strcmp (path, status_pathname))
+        inode = 0;
+    else
+#endif
+    {
+        if ((dbconn = pool_get()) == NULL)
+          return -EMFILE;
+
+        inode = query_inode(dbconn, path);
         pool_put(dbconn);
-        return ret;
-    }else{
-        long inode = query_inode(dbconn, path);
         if(inode < 0){
             log_printf(LOG_ERROR, "Error: query_inode()\n");
-            pool_put(dbconn);
             return inode;
         }
-
-        stbuf->st_size = query_size(dbconn, inode);
     }
 
-    pool_put(dbconn);
+    if ((cur = calloc(1, sizeof(struct dir_cursor))) == NULL)
+        return -ENOMEM;
+    cur->inode = inode;
+    fi->fh = (unsigned long) cur;
 
-    return ret;
+    return 0;
 }
 
+/**
+ * FUSE function for readdir().  Entries are handed to the filler with
+ * offsets, so FUSE calls again with the offset to continue from once its
+ * buffer is full; the cursor of the open directory lets the next batch pick
+ * up from there rather than listing the directory from the start.
+ */
 static int mysqlfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                            off_t offset, struct fuse_file_info *fi)
 {
-    (void) offset;
-    (void) fi;
     int ret;
     MYSQL *dbconn;
-    long inode;
+    struct dir_cursor *cur = (struct dir_cursor *) (unsigned long) fi->fh;
+    off_t n = 0;
 
-    log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\")\n", path);
+    log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\", %lld)\n", path, (long long) offset);
+
+    /* the entries that are not in the database come first */
+    if (offset <= n++ && filler(buf, ".", NULL, n))
+        return 0;
+    if (offset <= n++ && filler(buf, "..", NULL, n))
+        return 0;
 
 #ifdef STATUSDIR
-    if (0 == strcmp (path, status_pathname))
+    if (0 == cur->inode)
     {
         /* if printing the bogus "status" directory, dump the content and get out */
         log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\")(@%d)\n", path, __LINE__);
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        filler(buf, "txt", NULL, 0);
-        filler(buf, "xml", NULL, 0);
+        if (offset <= n++ && filler(buf, "txt", NULL, n))
+            return 0;
+        if (offset <= n++ && filler(buf, "xml", NULL, n))
+            return 0;
 
         return 0;
     }
-#endif
-
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
-
-    inode = query_inode(dbconn, path);
-    if(inode < 0){
-        log_printf(LOG_ERROR, "Error: query_inode()\n");
-        pool_put(dbconn);
-        return inode;
-    }
-
-    
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
 
-#ifdef STATUSDIR
     /* stuff in the bogus status subdir */
     if (0 == strcmp (path, "/"))
     {
         log_printf(LOG_D_CALL, "mysqlfs_readdir(\"%s\")(@%d)\n", path, __LINE__);
-        filler(buf, status_pathname+1, NULL, 0);
+        if (offset <= n++ && filler(buf, status_pathname+1, NULL, n))
+            return 0;
     }
 #endif
 
+    /* continue from the cursor, unless this is a rewinddir() or seekdir() */
+    cur->base = n;
+    if (offset != cur->offset || offset <= n) {
+        cur->offset = offset > n ? offset : n;
+        cur->name[0] = '\0';
+    }
 
-    ret = query_readdir(dbconn, inode, buf, filler);
+    if ((dbconn = pool_get()) == NULL)
+      return -EMFILE;
+
+    ret = query_readdir(dbconn, cur, buf, filler, theopts->readdirplus);
     pool_put(dbconn);
 
+    return ret;
+}
+
+/** FUSE function for releasedir(): drop the cursor made by mysqlfs_opendir() */
+static int mysqlfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_releasedir(\"%s\")\n", path);
+
+    free((struct dir_cursor *) (unsigned long) fi->fh);
+
     return 0;
 }
 
@@ -219,7 +274,8 @@ static int mysqlfs_mknod(const char *path, mode_t mode, dev_t rdev)
         return -ENOENT;
     }
 
-    ret = query_mknod(dbconn, path, mode, rdev, parent_inode, S_ISREG(mode) || S_ISLNK(mode));
+    ret = query_mknod(dbconn, path, mode, rdev, parent_inode, S_ISREG(mode) || S_ISLNK(mode),
+                      fuse_get_context()->uid, fuse_get_context()->gid);
     if(ret < 0){
         pool_put(dbconn);
         return ret;
@@ -253,7 +309,8 @@ static int mysqlfs_mkdir(const char *path, mode_t mode){
         return -ENOENT;
     }
 
-    ret = query_mkdir(dbconn, path, mode, inode);
+    ret = query_mkdir(dbconn, path, mode, inode,
+                      fuse_get_context()->uid, fuse_get_context()->gid);
     if(ret < 0){
         log_printf(LOG_ERROR, "Error: query_mkdir()\n");
         pool_put(dbconn);
@@ -264,17 +321,16 @@ static int mysqlfs_mkdir(const char *path, mode_t mode){
     return 0;
 }
 
-static int mysqlfs_unlink(const char *path)
+/**
+ * Remove a name on a given connection, in one transaction (see
+ * query_begin()).  If that was the last name of the inode, it is marked
+ * deleted and handed to the reaper once the transaction is committed.
+ */
+static int unlink_path(MYSQL *dbconn, const char *path)
 {
     int ret;
     long inode, parent, nlinks;
     char name[PATH_MAX];
-    MYSQL *dbconn;
-
-    log_printf(LOG_D_CALL, "mysqlfs_unlink(\"%s\")\n", path);
-
-    if ((dbconn = pool_get()) == NULL)
-      return -EMFILE;
 
     ret = query_inode_full(dbconn, path, name, sizeof(name),
 			   &inode, &parent, &nlinks);
@@ -282,40 +338,60 @@ static int mysqlfs_unlink(const char *path)
         if (ret != -ENOENT)
             log_printf(LOG_ERROR, "Error: query_inode_full(%s): %s\n",
 		       path, strerror(ret));
-	goto err_out;
+	return ret;
     }
 
+    if ((ret = query_begin(dbconn)) < 0)
+	return ret;
+
     ret = query_rmdirentry(dbconn, name, parent);
     if (ret < 0) {
         log_printf(LOG_ERROR, "Error: query_rmdirentry()\n");
 	goto err_out;
     }
+    icache_invalidate(inode);
 
     /* Only the last unlink() must set deleted flag. 
      * This is a shortcut - query_set_deleted() wouldn't
      * set the flag if there is still an existing direntry
      * anyway. But we'll save some DB processing here. */
     if (nlinks > 1)
-        return 0;
-    
+        return query_commit(dbconn);
+
     ret = query_set_deleted(dbconn, inode);
     if (ret < 0) {
         log_printf(LOG_ERROR, "Error: query_set_deleted()\n");
 	goto err_out;
     }
 
-    ret = query_purge_deleted(dbconn, inode);
-    if (ret < 0) {
-        log_printf(LOG_ERROR, "Error: query_purge_deleted()\n");
-	goto err_out;
-    }
+    if ((ret = query_commit(dbconn)) < 0)
+	return ret;
 
-    pool_put(dbconn);
+    ret = reaper_purge(dbconn, inode);
+    if (ret < 0)
+        log_printf(LOG_ERROR, "Error: reaper_purge()\n");
 
-    return 0;
+    return ret;
 
 err_out:
+    query_rollback(dbconn);
+    return ret;
+}
+
+static int mysqlfs_unlink(const char *path)
+{
+    int ret;
+    MYSQL *dbconn;
+
+    log_printf(LOG_D_CALL, "mysqlfs_unlink(\"%s\")\n", path);
+
+    if ((dbconn = pool_get()) == NULL)
+      return -EMFILE;
+
+    ret = unlink_path(dbconn, path);
+
     pool_put(dbconn);
+
     return ret;
 }
 
@@ -380,6 +456,7 @@ static int mysqlfs_chown(const char *path, uid_t uid, gid_t gid)
 static int mysqlfs_truncate(const char* path, off_t length)
 {
     int ret;
+    long inode;
     MYSQL *dbconn;
 
     log_printf(LOG_D_CALL, "mysql_truncate(\"%s\"): len=%lld\n", path, length);
@@ -387,7 +464,16 @@ static int mysqlfs_truncate(const char* path, off_t length)
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_truncate(dbconn, path, length);
+    inode = query_inode(dbconn, path);
+    if (inode < 0) {
+        pool_put(dbconn);
+        return inode;
+    }
+
+    /* data still buffered by open handles must not land past the new end */
+    ret = file_flush_inode(dbconn, inode);
+    if (ret == 0)
+        ret = query_truncate(dbconn, inode, length);
     if (ret < 0) {
         log_printf(LOG_ERROR, "Error: query_length()\n");
         pool_put(dbconn);
@@ -432,7 +518,7 @@ static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
 {
     MYSQL *dbconn;
     long inode;
-    int ret;
+    struct mysqlfs_file *f;
 
     log_printf(LOG_D_CALL, "mysqlfs_open(\"%s\")\n", path);
 
@@ -467,19 +553,17 @@ static int mysqlfs_open(const char *path, struct fuse_file_info *fi)
         return -ENOENT;
     }
 
-    /* Save inode for future use. Lets us skip path->inode translation.  */
-    fi->fh = inode;
-
-    log_printf(LOG_D_OTHER, "inode(\"%s\") = %d\n", path, fi->fh);
-
-    ret = query_inuse_inc(dbconn, inode, 1);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
-    }
+    log_printf(LOG_D_OTHER, "inode(\"%s\") = %ld\n", path, inode);
 
     pool_put(dbconn);
 
+    /* Save the handle for future use. Lets us skip path->inode translation.
+     * It also counts the open, see session.c. */
+    if ((f = file_open(inode)) == NULL)
+        return -ENOMEM;
+    fi->fh = (unsigned long) f;
+    session_opened();
+
     return 0;
 }
 
@@ -489,23 +573,46 @@ static int snprint_status(char *dest, size_t size, struct mysqlfs_opt *opt, long
     /* this needs to be migrated to header files so that the maintenance of pool.c doesn't ened a lock-step maintenance of this function */
     extern unsigned int lifo_unused_cnt;
     extern unsigned int lifo_pool_cnt;
+    unsigned long hits, misses, queued, dropped, taken, waits, pending, purged, rows;
+    unsigned long long wait_us, hold_us;
+
+    bcache_stats(&hits, &misses);
+    readahead_stats(&queued, &dropped);
+    ilock_stats(&taken, &waits, &wait_us, &hold_us);
+    reaper_stats(&pending, &purged, &rows);
 
     switch (inode)
     {
         case inode_status_txt: /* produce text/plain format */
             return snprintf (dest, size, "host: %s\nuser: %s\ndb:   %s\nport: %d\nuri:  "
                 "mysql://%s@%s:%d/%s\nfsck: %slog:  %s\nblocksize:  %u\nosxnospotlight: %s\nconnections init: %d\nconnections idle: %d\n"
-                "connections pool: %d\nconnections unused: %d\n",
+                "connections pool: %d\nconnections unused: %d\n"
+                "block cache: %u KiB\nblock cache hits: %lu\nblock cache misses: %lu\n"
+                "read-ahead: %zu KiB\nread-ahead queued: %lu\nread-ahead dropped: %lu\n"
+                "inode locks: %lu\ninode lock waits: %lu\ninode lock wait: %llu us\ninode lock hold: %llu us\n"
+                "reaper: %u rows\nreaper pending: %lu\nreaper purged: %lu\nreaper rows: %lu\n",
                 opt->host, opt->user, opt->db, (opt->port ? opt->port : MYSQL_PORT), opt->user, opt->host, (opt->port ? opt->port : MYSQL_PORT), opt->db,
-                (opt->fsck ? "true" : "false"), opt->logfile, DATA_BLOCK_SIZE, (opt->osxnospotlight ? "true (block)" : "false (allow)"), opt->init_conns, opt->max_idling_conns, lifo_pool_cnt, lifo_unused_cnt);
+                (opt->fsck ? "true" : "false"), opt->logfile, DATA_BLOCK_SIZE, (opt->osxnospotlight ? "true (block)" : "false (allow)"), opt->init_conns, opt->max_idling_conns, lifo_pool_cnt, lifo_unused_cnt,
+                (bcache_enabled() ? opt->block_cache : 0), hits, misses,
+                readahead_window() / 1024, queued, dropped,
+                taken, waits, wait_us, hold_us,
+                opt->reap_rows, pending, purged, rows);
 
         case inode_status_xml: /* produce text/xml format */
             return snprintf (dest, size, "<?xml version=\"1.0\"?>\n<mysqlfs xmlns=\"http://mysqlfs.sf.net/xsd/%s/statusfile.xsd\">\n  <host>%s</host>\n  <user>%s</user>\n  <db>%s</db>\n  <port>%d</port>\n"
                 "  <uri>mysql://%s@%s:%d/%s</uri>\n  <fsck>%s</fsck>\n  <log>%s</log>\n  <blocksize>%u</blocksize>\n  <osxnospotlight>%s</osxnospotlight>\n"
                 "  <connections>\n    <init>%d</init>\n    <idle>%d</idle>\n"
-                "    <pool>%d</pool>\n    <unused>%d</unused>\n  </connections>\n</mysqlfs>\n",
+                "    <pool>%d</pool>\n    <unused>%d</unused>\n  </connections>\n"
+                "  <blockcache>\n    <size>%u</size>\n    <hits>%lu</hits>\n    <misses>%lu</misses>\n  </blockcache>\n"
+                "  <readahead>\n    <window>%zu</window>\n    <queued>%lu</queued>\n    <dropped>%lu</dropped>\n  </readahead>\n"
+                "  <inodelocks>\n    <taken>%lu</taken>\n    <waits>%lu</waits>\n    <waitus>%llu</waitus>\n    <holdus>%llu</holdus>\n  </inodelocks>\n"
+                "  <reaper>\n    <chunk>%u</chunk>\n    <pending>%lu</pending>\n    <purged>%lu</purged>\n    <rows>%lu</rows>\n  </reaper>\n</mysqlfs>\n",
                 XMLVERSION, opt->host, opt->user, opt->db, (opt->port ? opt->port : MYSQL_PORT), opt->user, opt->host, (opt->port ? opt->port : MYSQL_PORT), opt->db,
-                (opt->fsck ? "true" : "false"), opt->logfile, DATA_BLOCK_SIZE, (opt->osxnospotlight ? "true" : "false"), opt->init_conns, opt->max_idling_conns, lifo_pool_cnt, lifo_unused_cnt);
+                (opt->fsck ? "true" : "false"), opt->logfile, DATA_BLOCK_SIZE, (opt->osxnospotlight ? "true" : "false"), opt->init_conns, opt->max_idling_conns, lifo_pool_cnt, lifo_unused_cnt,
+                (bcache_enabled() ? opt->block_cache : 0), hits, misses,
+                readahead_window() / 1024, queued, dropped,
+                taken, waits, wait_us, hold_us,
+                opt->reap_rows, pending, purged, rows);
     }
 
     return -1;
@@ -558,7 +665,7 @@ static int mysqlfs_read(const char *path, char *buf, size_t size, off_t offset,
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_read(dbconn, fi->fh, buf, size, offset);
+    ret = file_read(dbconn, file_of(fi), buf, size, offset);
     pool_put(dbconn);
 
     return ret;
@@ -575,16 +682,47 @@ static int mysqlfs_write(const char *path, const char *buf, size_t size,
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_write(dbconn, fi->fh, buf, size, offset);
+    ret = file_write(dbconn, file_of(fi), buf, size, offset);
+    pool_put(dbconn);
+
+    return ret;
+}
+
+/** FUSE function called on every close() of a file descriptor: commit what was written through it */
+static int mysqlfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int ret;
+    MYSQL *dbconn;
+    struct mysqlfs_file *f = file_of(fi);
+
+    log_printf(LOG_D_CALL, "mysqlfs_flush(\"%s\")\n", path);
+
+    if (f == NULL)
+        return 0;
+
+    if ((dbconn = pool_get()) == NULL)
+      return -EMFILE;
+
+    ret = file_flush(dbconn, f);
     pool_put(dbconn);
 
     return ret;
 }
 
+/** FUSE function for fsync(int fd); API call.  @see http://linux.die.net/man/2/fsync */
+static int mysqlfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    log_printf(LOG_D_CALL, "mysqlfs_fsync(\"%s\", %d)\n", path, datasync);
+
+    return mysqlfs_flush(path, fi);
+}
+
 static int mysqlfs_release(const char *path, struct fuse_file_info *fi)
 {
     int ret;
     MYSQL *dbconn;
+    struct mysqlfs_file *f;
+    long inode;
 
     log_printf(LOG_D_CALL, "mysqlfs_release(\"%s\")\n", path);
 
@@ -603,21 +741,18 @@ static int mysqlfs_release(const char *path, struct fuse_file_info *fi)
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_inuse_inc(dbconn, fi->fh, -1);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
-    }
+    f = file_of(fi);
+    inode = f->inode;
+    ret = file_flush(dbconn, f);
+    if (ret < 0)
+        log_printf(LOG_ERROR, "Error: file_flush(inode=%ld): %s\n", inode, strerror(-ret));
 
-    ret = query_purge_deleted(dbconn, fi->fh);
-    if (ret < 0) {
-        pool_put(dbconn);
-        return ret;
-    }
+    /* Only the last close of a file deleted while open goes to the database */
+    ret = file_close(f) ? reaper_purge(dbconn, inode) : 0;
 
     pool_put(dbconn);
 
-    return 0;
+    return ret;
 }
 
 static int mysqlfs_link(const char *from, const char *to)
@@ -625,7 +760,7 @@ static int mysqlfs_link(const char *from, const char *to)
     int ret;
     long inode, new_parent;
     MYSQL *dbconn;
-    char *tmp, *name, esc_name[PATH_MAX * 2];
+    char *tmp, name[PATH_MAX];
 
     log_printf(LOG_D_CALL, "link(%s, %s)\n", from, to);
 
@@ -639,20 +774,19 @@ static int mysqlfs_link(const char *from, const char *to)
     }
 
     tmp = strdup(to);
-    name = dirname(tmp);
-    new_parent = query_inode(dbconn, name);
+    new_parent = query_inode(dbconn, dirname(tmp));
     free(tmp);
     if (new_parent < 0) {
         pool_put(dbconn);
         return new_parent;
     }
 
+    /* query_mkdirentry() escapes the name itself */
     tmp = strdup(to);
-    name = basename(tmp);
-    mysql_real_escape_string(dbconn, esc_name, name, strlen(name));
+    snprintf(name, sizeof(name), "%s", basename(tmp));
     free(tmp);
 
-    ret = query_mkdirentry(dbconn, inode, esc_name, new_parent);
+    ret = query_mkdirentry(dbconn, inode, name, new_parent);
     if(ret < 0){
         pool_put(dbconn);
         return ret;
@@ -721,27 +855,39 @@ static int mysqlfs_readlink(const char *path, char *buf, size_t size)
 static int mysqlfs_rename(const char *from, const char *to)
 {
     int ret;
+    long replaced;
     MYSQL *dbconn;
 
     log_printf(LOG_D_CALL, "%s(%s -> %s)\n", __func__, from, to);
 
-    // FIXME: This should be wrapped in a transaction!!!
-    mysqlfs_unlink(to);
-
     if ((dbconn = pool_get()) == NULL)
       return -EMFILE;
 
-    ret = query_rename(dbconn, from, to);
+    /* Replacing the target and moving the entry are one call on the server */
+    ret = query_rename(dbconn, from, to, &replaced);
+    if (ret == 0 && replaced)
+        reaper_purge(dbconn, replaced);
 
     pool_put(dbconn);
 
     return ret;
 }
 
+/** Start the background threads that have work before any request asks for it, now that FUSE has daemonized */
+static void *mysqlfs_init(struct fuse_conn_info *conn)
+{
+    reaper_start();
+
+    return NULL;
+}
+
 /** used below in fuse_main() to define the entry points for a FUSE filesystem; this is the same VMT-like jump table used throughout the UNIX kernel. */
 static struct fuse_operations mysqlfs_oper = {
+    .init	= mysqlfs_init,
     .getattr	= mysqlfs_getattr,
+    .opendir	= mysqlfs_opendir,
     .readdir	= mysqlfs_readdir,
+    .releasedir	= mysqlfs_releasedir,
     .mknod	= mysqlfs_mknod,
     .mkdir	= mysqlfs_mkdir,
     .unlink	= mysqlfs_unlink,
@@ -753,7 +899,9 @@ static struct fuse_operations mysqlfs_oper = {
     .open	= mysqlfs_open,
     .read	= mysqlfs_read,
     .write	= mysqlfs_write,
+    .flush	= mysqlfs_flush,
     .release	= mysqlfs_release,
+    .fsync	= mysqlfs_fsync,
     .link	= mysqlfs_link,
     .symlink	= mysqlfs_symlink,
     .readlink	= mysqlfs_readlink,
@@ -798,10 +946,17 @@ enum
 /** fuse_opt for use with fuse_opt_parse() */
 static struct fuse_opt mysqlfs_opts[] =
   {
+    MYSQLFS_OPT_KEY(  "attr_entries=%u",	attr_entries,	0),
+    MYSQLFS_OPT_KEY(  "attr_timeout=%u",	attr_timeout,	0),
     MYSQLFS_OPT_KEY(  "background",	bg,	1),
+    MYSQLFS_OPT_KEY(  "block_cache=%u",	block_cache,	0),
+    MYSQLFS_OPT_KEY(  "block_cache_timeout=%u",	block_cache_timeout,	0),
+    MYSQLFS_OPT_KEY(  "block_size=%u",	block_size,	0),
     MYSQLFS_OPT_KEY(  "database=%s",	db,	1),
     MYSQLFS_OPT_KEY("--database=%s",	db,	1),
     MYSQLFS_OPT_KEY( "-D %s",		db,	1),
+    MYSQLFS_OPT_KEY(  "dcache_entries=%u",	dcache_entries,	0),
+    MYSQLFS_OPT_KEY(  "dcache_timeout=%u",	dcache_timeout,	0),
     MYSQLFS_OPT_KEY(  "fsck",		fsck,	1),
     MYSQLFS_OPT_KEY(  "fsck=%d",	fsck,	1),
     MYSQLFS_OPT_KEY("--fsck=%d",	fsck,	1),
@@ -809,6 +964,10 @@ static struct fuse_opt mysqlfs_opts[] =
     MYSQLFS_OPT_KEY(  "host=%s",	host,	0),
     MYSQLFS_OPT_KEY("--host=%s",	host,	0),
     MYSQLFS_OPT_KEY( "-h %s",		host,	0),
+    MYSQLFS_OPT_KEY(  "inline_max=%u",	inline_max,	0),
+    MYSQLFS_OPT_KEY(  "lease=%u",	lease,	0),
+    MYSQLFS_OPT_KEY(  "lowlevel",	lowlevel,	1),
+    MYSQLFS_OPT_KEY("nolowlevel",	lowlevel,	0),
     MYSQLFS_OPT_KEY(  "logfile=%s",	logfile,	0),
     MYSQLFS_OPT_KEY("--logfile=%s",	logfile,	0),
     MYSQLFS_OPT_KEY(  "mycnf_group=%s",	mycnf_group,	0), /* Read defaults from specified group in my.cnf  -- Command line options still have precedence.  */
@@ -816,14 +975,26 @@ static struct fuse_opt mysqlfs_opts[] =
     MYSQLFS_OPT_KEY(  "osxspotlight",	osxnospotlight,	0),
     MYSQLFS_OPT_KEY("noosxspotlight",	osxnospotlight,	1),
     MYSQLFS_OPT_KEY("osxnospotlight",	osxnospotlight,	1),
+    MYSQLFS_OPT_KEY(  "parallel=%u",	parallel,	0),
     MYSQLFS_OPT_KEY(  "password=%s",	passwd,	0),
     MYSQLFS_OPT_KEY("--password=%s",	passwd,	0),
     MYSQLFS_OPT_KEY(  "port=%d",	port,	0),
     MYSQLFS_OPT_KEY("--port=%d",	port,	0),
     MYSQLFS_OPT_KEY( "-P %d",		port,	0),
+    MYSQLFS_OPT_KEY(  "readahead=%u",	readahead,	0),
+    MYSQLFS_OPT_KEY(  "readahead_threads=%u",	readahead_threads,	0),
+    MYSQLFS_OPT_KEY(  "readdirplus",	readdirplus,	1),
+    MYSQLFS_OPT_KEY("noreaddirplus",	readdirplus,	0),
+    MYSQLFS_OPT_KEY(  "reap_delay=%u",	reap_delay,	0),
+    MYSQLFS_OPT_KEY(  "reap_rows=%u",	reap_rows,	0),
+    MYSQLFS_OPT_KEY(  "rmw",		rmw,	1),
+    MYSQLFS_OPT_KEY("normw",		rmw,	0),
     MYSQLFS_OPT_KEY(  "socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY("--socket=%s",	socket,	0),
     MYSQLFS_OPT_KEY( "-S %s",		socket,	0),
+    MYSQLFS_OPT_KEY(  "write_batch=%u",	write_batch,	0),
+    MYSQLFS_OPT_KEY(  "write_buffer=%u",	write_buffer,	0),
+    MYSQLFS_OPT_KEY(  "write_buffer_total=%u",	write_buffer_total,	0),
     MYSQLFS_OPT_KEY(  "user=%s",	user,	0),
     MYSQLFS_OPT_KEY("--user=%s",	user,	0),
     MYSQLFS_OPT_KEY( "-u %s",		user,	0),
@@ -893,6 +1064,24 @@ int main(int argc, char *argv[])
 	.init_conns	= 1,
 	.max_idling_conns = 5,
 	.mycnf_group	= "mysqlfs",
+	.dcache_timeout	= 10,
+	.dcache_entries	= 65536,
+	.attr_timeout	= 10,
+	.attr_entries	= 16384,
+	.block_cache	= 65536,
+	.block_cache_timeout = 10,
+	.inline_max	= 2048,
+	.readahead	= 1024,
+	.readahead_threads = 2,
+	.reap_rows	= 1000,
+	.reap_delay	= 10,
+	.lease		= 30,
+	.readdirplus	= 1,
+	.rmw		= 1,
+	.write_buffer	= 1024,
+	.write_batch	= 64,
+	.parallel	= 4,
+	.write_buffer_total = 65536,
 #ifdef DEBUG
 	.logfile	= "mysqlfs.log",
 #endif
@@ -905,12 +1094,41 @@ int main(int argc, char *argv[])
 
     fuse_opt_parse(&args, &opt, mysqlfs_opts, mysqlfs_opt_proc);
 
+    if (dcache_init(&opt) < 0) {
+        log_printf(LOG_ERROR, "Error: dcache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    if (icache_init(&opt) < 0) {
+        log_printf(LOG_ERROR, "Error: icache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    file_init(&opt);
+    ilock_init();
+    query_init(&opt);
+
     if (pool_init(&opt) < 0) {
         log_printf(LOG_ERROR, "Error: pool_init() failed\n");
         fuse_opt_free_args(&args);
         return EXIT_FAILURE;        
     }
 
+    /* Blocks are sized by the superblock, which pool_init() has read */
+    if (bcache_init(&opt) < 0) {
+        log_printf(LOG_ERROR, "Error: bcache_init() failed\n");
+        fuse_opt_free_args(&args);
+        return EXIT_FAILURE;
+    }
+
+    readahead_init(&opt);
+    reaper_init(&opt);
+
+    if (session_init(&opt) < 0)
+        log_printf(LOG_ERROR, "Error: session_init() failed, other mounts will not see open files\n");
+
     /*
      * I found that -- running from a script (ie no term?) -- the MySQLfs would not background, so the terminal is held; this makes automated testing difficult.
      *
@@ -928,10 +1146,21 @@ int main(int argc, char *argv[])
     if (NULL != opt.logfile)
         log_file = log_init(opt.logfile, 1);
 
-    fuse_main(args.argc, args.argv, &mysqlfs_oper);
+    if (opt.lowlevel)
+        mysqlfs_lowlevel_main(&args, &opt);
+    else
+        fuse_main(args.argc, args.argv, &mysqlfs_oper, NULL);
     fuse_opt_free_args(&args);
 
+    readahead_cleanup();
+    session_cleanup();
+    reaper_cleanup();
     pool_cleanup();
+    dcache_cleanup();
+    icache_cleanup();
+    bcache_cleanup();
+    ilock_cleanup();
+    file_cleanup();
 
     return EXIT_SUCCESS;
 }
@@ -12,8 +12,21 @@
 /** maximum length of a full pathname */
 #define PATH_MAX 1024
 
-/** size of a single datablock written to the database; should be less than the size of a "blob" or mysqlfs.sql needs to be altered (pkg/statusfile.xsd limits to unsigned int; schema.sql uses BLOB which limits this at 2^16-1 */
-#define DATA_BLOCK_SIZE	4096
+#ifndef NAME_MAX
+/** maximum length of a single name in a directory (tree.name) */
+#define NAME_MAX 255
+#endif
+
+/** block size of filesystems that predate the superblock table, and of new ones unless -oblock_size says otherwise */
+#define DEFAULT_BLOCK_SIZE	4096
+/** smallest block size a filesystem can be created with */
+#define MIN_BLOCK_SIZE	1024
+/** largest block size a filesystem can be created with; data_blocks.data is a MEDIUMBLOB, which holds 2^24-1 */
+#define MAX_BLOCK_SIZE	(1024 * 1024)
+
+/** size of a single datablock written to the database: the block size of the mounted filesystem, read from its superblock at mount time by query_superblock() */
+extern unsigned int data_block_size;
+#define DATA_BLOCK_SIZE	data_block_size
 
 /** basic preprocessor-phase maximum macro */
 #define MIN(a,b)	((a) < (b) ? (a) : (b))
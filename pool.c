@@ -16,6 +16,7 @@
 #include <string.h>
 #include <errno.h>
 #include <pthread.h>
+#include <unistd.h>
 
 #include <fuse/fuse.h>
 #ifdef HAVE_MYSQL_MYSQL_H
@@ -25,6 +26,7 @@
 #include <mysql.h>
 #endif
 
+#include "mysqlfs.h"
 #include "query.h"
 #include "pool.h"
 #include "log.h"
@@ -37,6 +39,17 @@ struct pool_lifo {
     void		*conn;		/**< payload if this item in the list */
 };
 
+/**
+ * A pooled connection.  The MYSQL handle comes first, so that a pointer to
+ * it is a pointer to the whole and pool_get() callers can treat it as a plain
+ * MYSQL *.
+ */
+struct pool_conn {
+    MYSQL		mysql;			/**< the connection */
+    void		*stmts[POOL_STMT_MAX];	/**< statements prepared on it, NULL until first used */
+    int			txn_depth;		/**< transactions open on it, see query_begin() */
+};
+
 /* We have only one pool -> use global variables. */
 struct pool_lifo *lifo_pool = NULL;
 struct pool_lifo *lifo_unused = NULL;
@@ -50,24 +63,30 @@ unsigned int lifo_pool_cnt = 0;
 
 static MYSQL *pool_open_mysql_connection()
 {
+    struct pool_conn *conn;
     MYSQL *mysql;
     my_bool reconnect = 1;
 
-    mysql = mysql_init(NULL);
+    conn = calloc(1, sizeof(struct pool_conn));
+    mysql = conn ? mysql_init(&conn->mysql) : NULL;
     if (!mysql) {
 	log_printf(LOG_ERROR, "%s(): %s\n", __func__, strerror(ENOMEM));
+	free(conn);
         return NULL;
     }
 
     if (opt->mycnf_group)
 	mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, opt->mycnf_group);
 
+    /* Affected rows count the rows matched, changed or not: see write_inline();
+     * the CALL of query_rename_replace() returns a result set */
     if (! mysql_real_connect(mysql, opt->host, opt->user,
 			     opt->passwd, opt->db,
-			     opt->port, opt->socket, 0)) {
+			     opt->port, opt->socket, CLIENT_FOUND_ROWS | CLIENT_MULTI_RESULTS)) {
         log_printf(LOG_ERROR, "ERROR: mysql_real_connect(): %s\n",
 		   mysql_error(mysql));
 	mysql_close(mysql);
+	free(conn);
         return NULL;
     }
 
@@ -79,13 +98,22 @@ static MYSQL *pool_open_mysql_connection()
 
 static void pool_close_mysql_connection(MYSQL *mysql)
 {
-    if (mysql)
-        mysql_close(mysql);
+    struct pool_conn *conn = (struct pool_conn *) mysql;
+    int i;
+
+    if (!mysql)
+	return;
+
+    for (i = 0; i < POOL_STMT_MAX; i++)
+	if (conn->stmts[i])
+	    mysql_stmt_close(conn->stmts[i]);
+    mysql_close(mysql);
+    free(conn);
 }
 
 static int pool_check_mysql_setup(MYSQL *mysql)
 {
-    int ret = 0;
+    int ret = 0, created = 0;
 
     /* Check the server version.  */
     unsigned long mysql_version;
@@ -103,8 +131,20 @@ static int pool_check_mysql_setup(MYSQL *mysql)
 
     /* Create root directory if it doesn't exist. */
     ret = query_inode_full(mysql, "/", NULL, 0, NULL, NULL, NULL);
-    if (ret == -ENOENT)
-	ret = query_mkdir(mysql, "/", 0755, 0);
+    if (ret == -ENOENT) {
+	ret = query_mkdir(mysql, "/", 0755, 0, getuid(), getgid());
+	created = 1;
+    }
+    if (ret < 0)
+	goto out;
+
+    /* The block size and inline size are fixed when the filesystem is created. */
+    ret = query_superblock(mysql, opt->block_size, opt->inline_max, created);
+    if (ret < 0)
+	goto out;
+
+    /* Operations of several statements are transactions on InnoDB tables. */
+    ret = query_engine(mysql);
     if (ret < 0)
 	goto out;
 
@@ -232,3 +272,13 @@ void pool_put(void *conn)
 	if (lifo_put(conn) < 0)
 	    pool_close_mysql_connection(conn);
 }
+
+void **pool_stmts(void *conn)
+{
+    return ((struct pool_conn *) conn)->stmts;
+}
+
+int *pool_txn_depth(void *conn)
+{
+    return &((struct pool_conn *) conn)->txn_depth;
+}
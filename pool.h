@@ -26,9 +26,32 @@ struct mysqlfs_opt {
     unsigned int init_conns;	/**< Number of DB connections to init on startup */
     unsigned int max_idling_conns;	/**< Maximum number of idling DB connections */
     char *logfile;		/**< filename to which local debug/log information will be written */
+    unsigned int dcache_timeout;	/**< seconds a cached (parent, name) => inode lookup stays valid; 0 disables the dentry cache */
+    unsigned int dcache_entries;	/**< maximum number of cached directory entries */
+    unsigned int attr_timeout;	/**< seconds cached inode attributes stay valid; 0 disables the attribute cache */
+    unsigned int attr_entries;	/**< number of slots in the inode attribute cache */
+    unsigned int block_size;	/**< bytes per data block of a filesystem created by this mount (0 => DEFAULT_BLOCK_SIZE); an existing one keeps its own */
+    unsigned int inline_max;	/**< largest file, in bytes, a filesystem created by this mount keeps in its inode row; 0 => none */
+    unsigned int block_cache;	/**< KiB of data blocks cached in memory; 0 disables the block cache */
+    unsigned int block_cache_timeout;	/**< seconds a cached data block stays valid */
+    unsigned int readahead;	/**< KiB read ahead of a sequential reader, at most; 0 disables read-ahead */
+    unsigned int readahead_threads;	/**< threads (and connections) loading read-ahead into the block cache */
+    unsigned int reap_rows;	/**< data rows the reaper deletes per statement; 0 purges deleted inodes in the foreground */
+    unsigned int reap_delay;	/**< milliseconds the reaper waits between statements */
+    unsigned int lease;		/**< seconds the session of a mount outlives its last renewal; 0 => no session */
+    unsigned int write_buffer;	/**< KiB of writes each open file may buffer before they go to the database; 0 writes through */
+    unsigned int write_buffer_total;	/**< KiB all write buffers together may hold */
+    unsigned int write_batch;	/**< full data blocks stored per INSERT statement */
+    unsigned int parallel;	/**< connections a large read or write is spread over */
+    unsigned char rmw;		/**< boolean: 1 => a write to part of a block merges into a copy of the block on the client, 0 => the server splices it in */
+    unsigned char readdirplus;	/**< boolean: 1 => readdir also reads the attributes of the entries into the caches */
+    unsigned char lowlevel;	/**< boolean: 1 => serve requests by inode through the FUSE lowlevel API (lowlevel.c), 0 => by path */
     int bg;			/**< (used for autotest) whether a term-less execution should background */
 };
 
+/** number of prepared statements each pooled connection can keep, see pool_stmts() */
+#define POOL_STMT_MAX	64
+
 /** Initalize pool and preallocate connections */
 int pool_init(struct mysqlfs_opt *opt);
 
@@ -40,3 +63,9 @@ void *pool_get();
 
 /** Put DB connection back to the pool */
 void pool_put(void *conn);
+
+/** The prepared-statement slots (MYSQL_STMT pointers, POOL_STMT_MAX of them) of a connection from pool_get() */
+void **pool_stmts(void *conn);
+
+/** How deep query_begin() calls are nested on a connection from pool_get() */
+int *pool_txn_depth(void *conn);
@@ -15,35 +15,645 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <time.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <fuse/fuse.h>
 #ifdef HAVE_MYSQL_MYSQL_H
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #endif
 #ifdef HAVE_MYSQL_H
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
 #endif
 
 #include "mysqlfs.h"
 #include "query.h"
+#include "pool.h"
+#include "dcache.h"
+#include "icache.h"
+#include "bcache.h"
+#include "ilock.h"
+#include "file.h"
 #include "log.h"
 
 #define SQL_MAX 10240
 #define INODE_CACHE_MAX 4096
+/** rows fetched per query when listing a directory */
+#define READDIR_BATCH 128
+/** rows query_fsck() deletes per statement when purging, as mysqlfs_opt::reap_rows does by default */
+#define FSCK_PURGE_ROWS 1000
+/** upper limit of mysqlfs_opt::write_batch, so that the statement fits in SQL_MAX */
+#define WRITE_BATCH_MAX 256
+
+/** at most this many bytes of full data blocks go in one INSERT, whatever the block size */
+#define WRITE_BATCH_BYTES (2 * 1024 * 1024)
+
+/** full data blocks written per INSERT, from mysqlfs_opt::write_batch */
+static unsigned int write_batch = 64;
+
+unsigned int data_block_size = DEFAULT_BLOCK_SIZE;
+
+/** data an extent of a new filesystem holds; see write_extents() */
+#define EXTENT_BYTES (1024 * 1024)
+/** blocks per extent, from the superblock; 0 if the filesystem keeps no extents */
+static unsigned int extent_blocks = 0;
+
+/** room for data in inodes.inline_data, and so the most inline_max can be */
+#define INLINE_MAX 4096
+/** files up to this many bytes keep their data in their inode row, from the superblock; 0 if none do */
+static unsigned int inline_max = 0;
+
+/** slots of spilled; a power of two */
+#define SPILLED_SLOTS 4096
+/**
+ * Inodes known to keep no data in their inode row, so that a write past
+ * inline_max skips inline_spill().  Inline data never comes back once
+ * spilled; a new inode clears its slot.  Direct-mapped: a colliding inode
+ * only costs one spill that finds nothing.
+ */
+static long spilled[SPILLED_SLOTS];
+static pthread_mutex_t spilled_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** upper limit of mysqlfs_opt::parallel */
+#define PARALLEL_MAX 16
+/** fewest blocks a part of a split read gets, see query_read() */
+#define PARALLEL_READ_BLOCKS 8
+/** connections a large read or write is spread over, from mysqlfs_opt::parallel */
+static unsigned int parallel = 1;
+
+/** stripes of merge_locks; a power of two */
+#define MERGE_LOCKS 64
+/** whether partial blocks are merged on the client, from mysqlfs_opt::rmw */
+static int merge = 0;
+/** writers of the same block take turns merging it, see merge_one_block() */
+static pthread_mutex_t merge_locks[MERGE_LOCKS];
+
+/** whether the tables take transactions (InnoDB), see query_engine() */
+static int transactions = 0;
+/** sessions.id of this mount, 0 before query_session_begin() */
+static long session_id = 0;
+
+/** Result columns of the inode attributes, see getattr_row() and getattr_fetched() */
+#define ATTR_COLUMNS 9
+
+/**
+ * Statements that every pooled connection prepares once, the first time it
+ * needs them, and keeps in its pool_stmts() slots; see stmt_execute().
+ * Values go in and out through binary binds, so these never need escaping
+ * or a round of text formatting and parsing.
+ */
+enum query_stmt {
+    STMT_GETATTR,		/**< inode => attributes */
+    STMT_LOOKUP,		/**< parent, name => attributes */
+    STMT_NLINKS,		/**< inode => nlink */
+    STMT_SIZE,			/**< inode => size */
+    STMT_SIZE_BLOCK,		/**< inode, seq => length of the block */
+    STMT_SIZE_SET,		/**< size, inode */
+    STMT_SIZE_GROW,		/**< size, inode: raise the size to at least this */
+    STMT_READ,			/**< first seq, last seq, inode => seq, data, size of the file, inline data */
+    STMT_READ_EXTENTS,		/**< STMT_READ, then first, first, last, first, inode, first extent, last: also from extents */
+    STMT_PREFETCH,		/**< inode, first seq, last seq => seq, data */
+    STMT_PREFETCH_EXTENTS,	/**< STMT_PREFETCH, then as STMT_READ_EXTENTS: also from extents */
+    STMT_BLOCK_INSERT,		/**< inode, seq: new empty block */
+    STMT_BLOCK_UPDATE,		/**< offset, data, offset + size + 1, inode, seq */
+    STMT_BLOCK_UPSERT,		/**< (inode, seq, data) * write_batch */
+    STMT_BLOCK_GET,		/**< inode, seq => data */
+    STMT_BLOCK_PUT,		/**< inode, seq, data: store a whole block */
+    STMT_BLOCK_CLEAR,		/**< inode, first seq, end seq: drop a run of blocks */
+    STMT_EXTENT_FIND,		/**< inode, seq, seq => seq of the extents among the two */
+    STMT_EXTENT_GET,		/**< inode, seq => data */
+    STMT_EXTENT_PUT,		/**< inode, seq, data: store a whole extent */
+    STMT_EXTENT_DELETE,		/**< inode, seq */
+    STMT_TRUNCATE_EXTENTS,	/**< inode, seq: drop extents from seq */
+    STMT_INLINE_WRITE,		/**< offset, data, offset + size + 1, end, inode: if the data is inline */
+    STMT_INLINE_TRUNCATE,	/**< length, length, inode: if the data is inline */
+    STMT_INLINE_SPILL,		/**< inode: copy the inline data to block 0 */
+    STMT_INLINE_CLEAR,		/**< inode: the data is no longer inline */
+    STMT_TRUNCATE_BLOCKS,	/**< inode, seq: drop blocks past seq */
+    STMT_TRUNCATE_LAST,		/**< length, inode, seq: cut the last block */
+    STMT_DIRENTRY_INSERT,	/**< name, parent, inode */
+    STMT_DIRENTRY_DELETE,	/**< name, parent */
+    STMT_NLINK_INC,		/**< inode */
+    STMT_NLINK_DEC,		/**< name, parent: the inode an entry refers to */
+    STMT_MKNOD_ENTRY,		/**< name, parent */
+    STMT_MKNOD_INODE,		/**< inode, mode, uid, gid, inline data or NULL */
+    STMT_CHMOD,			/**< mode, inode */
+    STMT_CHOWN,			/**< uid or NULL, gid or NULL, inode */
+    STMT_UTIME,			/**< atime, mtime, inode */
+    STMT_SUPERBLOCK_INIT,	/**< name, value: recorded unless there is one */
+    STMT_SUPERBLOCK_GET,	/**< name => value */
+    STMT_PURGE_DELETED,		/**< inode */
+    STMT_PURGE_DATA,		/**< inode: blocks of a purged inode */
+    STMT_PURGE_DATA_EXTENTS,	/**< inode: extents of a purged inode */
+    STMT_PURGE_CHECK,		/**< inode => 1 if the inode is deleted and not in use */
+    STMT_PURGE_BLOCKS,		/**< inode, rows: a chunk of the blocks of such an inode */
+    STMT_PURGE_EXTENTS,		/**< inode, rows: a chunk of its extents */
+    STMT_NEXT_DELETED,		/**< inode => the next inode that is deleted and not in use */
+    STMT_SESSION_INSERT,	/**< host, pid, lease: a new session */
+    STMT_SESSION_BEAT,		/**< lease, session */
+    STMT_SESSION_EXPIRE,	/**< drop sessions whose lease ran out */
+    STMT_SESSION_ORPHANS,	/**< open inodes of sessions that are gone */
+    STMT_SESSION_CLEAR,		/**< session: its open inodes */
+    STMT_SESSION_DELETE,	/**< session */
+    STMT_SET_DELETED,		/**< inode */
+    STMT_MAX
+};
+
+/**
+ * Condition that another live mount has inode open, see session.c; takes
+ * this mount's session as a parameter, after the inode if that is one.
+ */
+#define SESSION_OPEN_SQL(inode) \
+    "SELECT 1 FROM session_inodes AS o, sessions AS s " \
+    "WHERE o.inode = " inode " AND s.id = o.session AND s.id <> ? " \
+    "AND s.expires >= UNIX_TIMESTAMP(NOW())"
+
+/** SQL of the statements; STMT_BLOCK_UPSERT is built by query_init() */
+static const char *stmt_sql[STMT_MAX] = {
+    [STMT_GETATTR] =
+        "SELECT inode, mode, uid, gid, atime, mtime, ctime, size, nlink "
+        "FROM inodes WHERE inode=?",
+    [STMT_LOOKUP] =
+        "SELECT t.inode, i.mode, i.uid, i.gid, i.atime, i.mtime, i.ctime, i.size, i.nlink "
+        "FROM tree AS t LEFT JOIN inodes AS i ON i.inode = t.inode "
+        "WHERE t.parent=? AND t.name=?",
+    [STMT_NLINKS] = "SELECT nlink FROM inodes WHERE inode=?",
+    [STMT_SIZE] = "SELECT size FROM inodes WHERE inode=?",
+    [STMT_SIZE_BLOCK] = "SELECT LENGTH(data) FROM data_blocks WHERE inode=? AND seq=?",
+    [STMT_SIZE_SET] = "UPDATE inodes SET size=? WHERE inode=?",
+    [STMT_SIZE_GROW] = "UPDATE inodes SET size=GREATEST(size, ?) WHERE inode=?",
+    [STMT_READ] =
+        "SELECT d.seq, d.data, i.size, i.inline_data FROM inodes AS i "
+        "LEFT JOIN data_blocks AS d ON d.inode = i.inode AND d.seq>=? AND d.seq<=? "
+        "WHERE i.inode=? ORDER BY d.seq ASC",
+    [STMT_PREFETCH] =
+        "SELECT seq, data FROM data_blocks WHERE inode=? AND seq>=? AND seq<=? "
+        "ORDER BY seq ASC",
+    [STMT_BLOCK_INSERT] = "INSERT INTO data_blocks SET inode=?, seq=?, data=''",
+    [STMT_BLOCK_UPDATE] =
+        "UPDATE data_blocks SET data=CONCAT("
+            "RPAD(IF(ISNULL(data), '', data), ?, '\\0'), ?, SUBSTRING(data FROM ?)"
+        ") WHERE inode=? AND seq=?",
+    [STMT_BLOCK_GET] = "SELECT data FROM data_blocks WHERE inode=? AND seq=?",
+    [STMT_BLOCK_PUT] =
+        "INSERT INTO data_blocks (inode, seq, data) VALUES (?, ?, ?) "
+        "ON DUPLICATE KEY UPDATE data=VALUES(data)",
+    [STMT_BLOCK_CLEAR] = "DELETE FROM data_blocks WHERE inode=? AND seq>=? AND seq<?",
+    [STMT_EXTENT_FIND] = "SELECT seq FROM extents WHERE inode=? AND seq IN (?, ?)",
+    [STMT_EXTENT_GET] = "SELECT data FROM extents WHERE inode=? AND seq=?",
+    [STMT_EXTENT_PUT] =
+        "INSERT INTO extents (inode, seq, data) VALUES (?, ?, ?) "
+        "ON DUPLICATE KEY UPDATE data=VALUES(data)",
+    [STMT_EXTENT_DELETE] = "DELETE FROM extents WHERE inode=? AND seq=?",
+    [STMT_TRUNCATE_EXTENTS] = "DELETE FROM extents WHERE inode=? AND seq>=?",
+    [STMT_INLINE_WRITE] =
+        "UPDATE inodes SET inline_data=CONCAT("
+            "RPAD(inline_data, ?, '\\0'), ?, SUBSTRING(inline_data FROM ?)"
+        "), size=GREATEST(size, ?) WHERE inode=? AND inline_data IS NOT NULL",
+    [STMT_INLINE_TRUNCATE] =
+        "UPDATE inodes SET inline_data=RPAD(inline_data, ?, '\\0'), size=? "
+        "WHERE inode=? AND inline_data IS NOT NULL",
+    [STMT_INLINE_SPILL] =
+        "INSERT INTO data_blocks (inode, seq, data) "
+        "SELECT inode, 0, inline_data FROM inodes WHERE inode=? AND OCTET_LENGTH(inline_data) > 0 "
+        "ON DUPLICATE KEY UPDATE data=VALUES(data)",
+    [STMT_INLINE_CLEAR] = "UPDATE inodes SET inline_data=NULL WHERE inode=? AND inline_data IS NOT NULL",
+    [STMT_TRUNCATE_BLOCKS] = "DELETE FROM data_blocks WHERE inode=? AND seq > ?",
+    [STMT_TRUNCATE_LAST] =
+        "UPDATE data_blocks SET data=RPAD(data, ?, '\\0') WHERE inode=? AND seq=?",
+    [STMT_DIRENTRY_INSERT] = "INSERT INTO tree (name, parent, inode) VALUES (?, ?, ?)",
+    [STMT_DIRENTRY_DELETE] = "DELETE FROM tree WHERE name=? AND parent=?",
+    [STMT_NLINK_INC] = "UPDATE inodes SET nlink = nlink + 1 WHERE inode=?",
+    [STMT_NLINK_DEC] =
+        "UPDATE inodes, tree SET inodes.nlink = inodes.nlink - 1 "
+        "WHERE tree.name=? AND tree.parent=? AND inodes.inode = tree.inode",
+    [STMT_MKNOD_ENTRY] = "INSERT INTO tree (name, parent) VALUES (?, ?)",
+    [STMT_MKNOD_INODE] =
+        "INSERT INTO inodes(inode, mode, uid, gid, inline_data, nlink, atime, ctime, mtime) "
+        "VALUES(?, ?, ?, ?, ?, 1, UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()))",
+    [STMT_CHMOD] = "UPDATE inodes SET mode=? WHERE inode=?",
+    [STMT_CHOWN] = "UPDATE inodes SET uid=IFNULL(?, uid), gid=IFNULL(?, gid) WHERE inode=?",
+    [STMT_UTIME] = "UPDATE inodes SET atime=?, mtime=? WHERE inode=?",
+    [STMT_SUPERBLOCK_INIT] = "INSERT IGNORE INTO superblock (name, value) VALUES (?, ?)",
+    [STMT_SUPERBLOCK_GET] = "SELECT value FROM superblock WHERE name=?",
+    [STMT_PURGE_DELETED] =
+        "DELETE FROM inodes WHERE inode=? AND inuse=0 AND deleted=1 AND NOT EXISTS ("
+        SESSION_OPEN_SQL("?") ")",
+    [STMT_PURGE_DATA] = "DELETE FROM data_blocks WHERE inode=?",
+    [STMT_PURGE_DATA_EXTENTS] = "DELETE FROM extents WHERE inode=?",
+    [STMT_PURGE_CHECK] =
+        "SELECT i.inuse=0 AND i.deleted=1 AND NOT EXISTS (" SESSION_OPEN_SQL("i.inode") ") "
+        "FROM inodes AS i WHERE i.inode=?",
+    [STMT_PURGE_BLOCKS] = "DELETE FROM data_blocks WHERE inode=? LIMIT ?",
+    [STMT_PURGE_EXTENTS] = "DELETE FROM extents WHERE inode=? LIMIT ?",
+    [STMT_NEXT_DELETED] = "SELECT MIN(inode) FROM inodes WHERE inode > ? AND inuse=0 AND deleted=1",
+    [STMT_SESSION_INSERT] =
+        "INSERT INTO sessions (host, pid, expires) VALUES (?, ?, UNIX_TIMESTAMP(NOW()) + ?)",
+    [STMT_SESSION_BEAT] = "UPDATE sessions SET expires=UNIX_TIMESTAMP(NOW()) + ? WHERE id=?",
+    [STMT_SESSION_EXPIRE] = "DELETE FROM sessions WHERE expires < UNIX_TIMESTAMP(NOW())",
+    [STMT_SESSION_ORPHANS] =
+        "DELETE o FROM session_inodes AS o LEFT JOIN sessions AS s ON s.id = o.session "
+        "WHERE s.id IS NULL",
+    [STMT_SESSION_CLEAR] = "DELETE FROM session_inodes WHERE session=?",
+    [STMT_SESSION_DELETE] = "DELETE FROM sessions WHERE id=?",
+    [STMT_SET_DELETED] = "UPDATE inodes SET deleted=1 WHERE inode=? AND nlink = 0",
+};
+
+/** SQL of STMT_BLOCK_UPSERT, for write_batch rows */
+static char upsert_sql[SQL_MAX];
+/** SQL of STMT_READ_EXTENTS and STMT_PREFETCH_EXTENTS, for the block and extent size */
+static char read_extents_sql[SQL_MAX], prefetch_extents_sql[SQL_MAX];
+
+static int unpack_extent(MYSQL *mysql, long inode, unsigned long seq);
+
+/**
+ * Build the SQL of an "INSERT ... ON DUPLICATE KEY UPDATE" storing a number
+ * of data blocks, each with an (inode, seq, data) triple of parameters.
+ *
+ * @param sql buffer of SQL_MAX bytes
+ * @param rows number of blocks, at most WRITE_BATCH_MAX
+ */
+static void upsert_sql_build(char *sql, unsigned long rows)
+{
+    size_t pos;
+    unsigned long i;
+
+    pos = snprintf(sql, SQL_MAX, "INSERT INTO data_blocks (inode, seq, data) VALUES ");
+    for (i = 0; i < rows; i++)
+        pos += snprintf(sql + pos, SQL_MAX - pos, "(?, ?, ?),");
+    sql[--pos] = '\0';	/* Remove the trailing comma. */
+    snprintf(sql + pos, SQL_MAX - pos, " ON DUPLICATE KEY UPDATE data=VALUES(data)");
+}
+
+/**
+ * Build the SQL of the reads that also look in the extents table: the
+ * statement for data_blocks (STMT_READ or STMT_PREFETCH), then, from each
+ * extent that overlaps the range, the blocks in range as one row starting
+ * at the first of them (so the row looks like a run of blocks), and for
+ * the further columns of STMT_READ -1 as the size and NULL as the inline
+ * data.  Rows come in no particular order.
+ *
+ * @param sql buffer of SQL_MAX bytes
+ * @param blocks_sql SQL of the statement for data_blocks
+ * @param columns number of columns of that statement
+ */
+static void extents_sql_build(char *sql, const char *blocks_sql, int columns)
+{
+    snprintf(sql, SQL_MAX,
+             "(%s) UNION ALL ("
+                "SELECT GREATEST(e.seq, ?), "
+                "SUBSTRING(e.data, (GREATEST(e.seq, ?) - e.seq) * %u + 1, "
+                          "(LEAST(e.seq + %u, ?) - GREATEST(e.seq, ?) + 1) * %u)%s "
+                "FROM extents AS e WHERE e.inode=? AND e.seq>=? AND e.seq<=?"
+             ")",
+             blocks_sql, DATA_BLOCK_SIZE, extent_blocks - 1, DATA_BLOCK_SIZE,
+             columns > 2 ? ", -1, NULL" : "");
+}
+
+/**
+ * Take the settings of the query layer from the options.  Called once
+ * before the first query.
+ *
+ * @return 0
+ * @param opt options of this mount
+ */
+int query_init(struct mysqlfs_opt *opt)
+{
+    int i;
+
+    write_batch = opt->write_batch;
+    if (write_batch < 1)
+        write_batch = 1;
+    if (write_batch > WRITE_BATCH_MAX)
+        write_batch = WRITE_BATCH_MAX;
+
+    merge = opt->rmw;
+    for (i = 0; i < MERGE_LOCKS; i++)
+        pthread_mutex_init(&merge_locks[i], NULL);
+
+    parallel = opt->parallel;
+    if (parallel < 1)
+        parallel = 1;
+    if (parallel > PARALLEL_MAX)
+        parallel = PARALLEL_MAX;
+
+    upsert_sql_build(upsert_sql, write_batch);
+    stmt_sql[STMT_BLOCK_UPSERT] = upsert_sql;
+
+    return 0;
+}
+
+/** Point a parameter or result at an integer */
+static inline void bind_int(MYSQL_BIND *bind, long long *value, my_bool *is_null)
+{
+    memset(bind, 0, sizeof(MYSQL_BIND));
+    bind->buffer_type = MYSQL_TYPE_LONGLONG;
+    bind->buffer = value;
+    bind->is_null = is_null;
+}
+
+/** Point a parameter at a string, or a result at a buffer of max bytes */
+static inline void bind_str(MYSQL_BIND *bind, const char *str, unsigned long *length,
+                            unsigned long max)
+{
+    memset(bind, 0, sizeof(MYSQL_BIND));
+    bind->buffer_type = MYSQL_TYPE_STRING;
+    bind->buffer = (char *) str;
+    bind->buffer_length = max;
+    bind->length = length;
+}
+
+/** Point a parameter or result at a data block */
+static inline void bind_blob(MYSQL_BIND *bind, const char *data, unsigned long *length,
+                             unsigned long max)
+{
+    bind_str(bind, data, length, max);
+    bind->buffer_type = MYSQL_TYPE_BLOB;
+}
+
+/**
+ * Whether a statement failed because the connection was lost (and, with
+ * MYSQL_OPT_RECONNECT, comes back without the statements prepared on it),
+ * or because the server forgot the statement.  Either way it is worth
+ * preparing it again.
+ */
+static int stmt_lost(unsigned int err)
+{
+    switch (err) {
+    case CR_SERVER_GONE_ERROR:
+    case CR_SERVER_LOST:
+    case ER_UNKNOWN_STMT_HANDLER:
+#ifdef ER_NEED_REPREPARE
+    case ER_NEED_REPREPARE:
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+/** Prepare a statement into an empty slot, then bind and execute it: 0 or the MySQL error number */
+static unsigned int stmt_try(MYSQL *mysql, MYSQL_STMT **slot, const char *sql,
+                             MYSQL_BIND *params)
+{
+    if (!*slot) {
+        if ((*slot = mysql_stmt_init(mysql)) == NULL)
+            return CR_OUT_OF_MEMORY;
+        if (mysql_stmt_prepare(*slot, sql, strlen(sql)))
+            return mysql_stmt_errno(*slot);
+    }
+
+    if (params && mysql_stmt_bind_param(*slot, params))
+        return mysql_stmt_errno(*slot);
+
+    if (mysql_stmt_execute(*slot))
+        return mysql_stmt_errno(*slot);
+
+    return 0;
+}
+
+/**
+ * Execute the statement in a slot, preparing it first if the slot is
+ * empty.  A statement that fails is closed and its slot emptied; if it
+ * failed because the connection or the prepared statement went away, it is
+ * prepared once more and retried.
+ *
+ * @return the executed statement; free its result with
+ *         mysql_stmt_free_result() when done with it
+ * @return NULL on failure (the error is logged)
+ * @param mysql handle to connection to the database
+ * @param slot where the statement is kept
+ * @param sql SQL to prepare the statement from
+ * @param params parameters to bind, or NULL if it has none
+ */
+static MYSQL_STMT *stmt_run(MYSQL *mysql, MYSQL_STMT **slot, const char *sql,
+                            MYSQL_BIND *params)
+{
+    unsigned int err;
+    int retried = 0;
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+
+    while ((err = stmt_try(mysql, slot, sql, params)) != 0) {
+        if (*slot) {
+            log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(*slot));
+            mysql_stmt_close(*slot);
+            *slot = NULL;
+        } else {
+            log_printf(LOG_ERROR, "mysql_stmt_init(), out of memory\n");
+        }
+        if (retried++ || !stmt_lost(err))
+            return NULL;
+    }
+
+    return *slot;
+}
+
+/**
+ * Execute one of the statements a connection keeps prepared, see
+ * stmt_run().
+ *
+ * @return the executed statement, or NULL on failure
+ * @param mysql handle to connection to the database (from pool_get())
+ * @param id which statement
+ * @param params parameters to bind, or NULL if it has none
+ */
+static MYSQL_STMT *stmt_execute(MYSQL *mysql, enum query_stmt id, MYSQL_BIND *params)
+{
+    MYSQL_STMT **slots = (MYSQL_STMT **) pool_stmts(mysql);
+
+    return stmt_run(mysql, &slots[id], stmt_sql[id], params);
+}
+
+/**
+ * Execute a statement that modifies rows.
+ *
+ * @return 0 on success; -EIO on failure (the error is logged)
+ * @param mysql handle to connection to the database
+ * @param id which statement
+ * @param params parameters to bind
+ */
+static int stmt_update(MYSQL *mysql, enum query_stmt id, MYSQL_BIND *params)
+{
+    return stmt_execute(mysql, id, params) ? 0 : -EIO;
+}
+
+/**
+ * Execute a statement that returns at most one row.
+ *
+ * @return 0 if there is a row
+ * @return -ENOENT if there is none
+ * @return -EIO on failure (the error is logged)
+ * @param mysql handle to connection to the database
+ * @param id which statement
+ * @param params parameters to bind
+ * @param result where to store the columns
+ */
+static int stmt_fetch_one(MYSQL *mysql, enum query_stmt id, MYSQL_BIND *params,
+                          MYSQL_BIND *result)
+{
+    MYSQL_STMT *stmt;
+    int ret;
+
+    if ((stmt = stmt_execute(mysql, id, params)) == NULL)
+        return -EIO;
+
+    if (mysql_stmt_bind_result(stmt, result)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        ret = -EIO;
+    } else {
+        switch (mysql_stmt_fetch(stmt)) {
+        case 0:
+            ret = 0;
+            break;
+        case MYSQL_NO_DATA:
+            ret = -ENOENT;
+            break;
+        default:
+            log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+            ret = -EIO;
+        }
+    }
+
+    mysql_stmt_free_result(stmt);
+    return ret;
+}
+
+/**
+ * Execute a statement that returns at most one row of one integer column,
+ * see stmt_fetch_one().
+ *
+ * @param value where to store the column
+ * @param is_null where to store whether the column is NULL
+ */
+static int stmt_fetch_int(MYSQL *mysql, enum query_stmt id, MYSQL_BIND *params,
+                          long long *value, my_bool *is_null)
+{
+    MYSQL_BIND result[1];
+
+    bind_int(&result[0], value, is_null);
+    return stmt_fetch_one(mysql, id, params, result);
+}
+
+/**
+ * Start a transaction on a connection, so that the statements of an
+ * operation that takes several of them are applied all together or not at
+ * all.  Calls nest: only the outermost starts and ends the transaction, so
+ * an operation made of others is one transaction too.  On tables that take
+ * no transactions (MyISAM, see query_engine()) this and query_commit() and
+ * query_rollback() cost nothing and each statement stands on its own, as
+ * before.
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ */
+int query_begin(MYSQL *mysql)
+{
+    int *depth;
+
+    if (!transactions)
+        return 0;
+
+    depth = pool_txn_depth(mysql);
+    if ((*depth)++)
+        return 0;
+
+    if (mysql_query(mysql, "START TRANSACTION")) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        (*depth)--;
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * End a transaction of query_begin(), applying its changes.
+ *
+ * @return 0 on success; -EIO on failure (the changes are lost)
+ * @param mysql handle to connection to the database
+ */
+int query_commit(MYSQL *mysql)
+{
+    int *depth;
+
+    if (!transactions)
+        return 0;
+
+    depth = pool_txn_depth(mysql);
+    if (--(*depth))
+        return 0;
+
+    if (mysql_commit(mysql)) {
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/**
+ * End a transaction of query_begin() after a failure, dropping its changes.
+ * Inside another one, the outer transaction is left to roll back.
+ *
+ * @param mysql handle to connection to the database
+ */
+void query_rollback(MYSQL *mysql)
+{
+    int *depth;
 
+    if (!transactions)
+        return;
+
+    depth = pool_txn_depth(mysql);
+    if (--(*depth))
+        return;
+
+    if (mysql_rollback(mysql))
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+}
+
+/**
+ * Keep other writers and readers of this mount away from an inode while its
+ * blocks and size change (see ilock.c).  Other mounts of the database are
+ * not excluded.
+ */
 static inline int lock_inode(MYSQL *mysql, long inode)
 {
-    // TODO
+    ilock_lock(inode, 1);
     return 0;
 }
 
 static inline int unlock_inode(MYSQL *mysql, long inode)
 {
-    // TODO
+    ilock_unlock(inode, 1);
+    return 0;
+}
+
+/** Like lock_inode(), but for a reader: readers of an inode do not keep each other out */
+static inline int lock_inode_shared(MYSQL *mysql, long inode)
+{
+    ilock_lock(inode, 0);
+    return 0;
+}
+
+static inline int unlock_inode_shared(MYSQL *mysql, long inode)
+{
+    ilock_unlock(inode, 0);
     return 0;
 }
 
@@ -65,33 +675,273 @@ fill_data_blocks_info(struct data_blocks_info *info, size_t size, off_t offset)
 }
 
 /**
- * Get the attributes of an inode, filling in a struct stat.  This function
- * uses query_inode_full() to get the inode and nlinks of the given path, then
- * reads the inode data from the database, storing this data into the provided
- * structure.
+ * Where a path got to in the dentry cache.  Filled by path_walk(); when the
+ * path is not fully cached, path_walk_sql() and path_walk_row() resolve the
+ * rest with one query and feed the cache with the result.
+ */
+struct path_walk {
+    char	buf[PATH_MAX];			/**< copy of the path, split in place */
+    char	*names[PATH_MAX / 2];		/**< path components */
+    long	chain[PATH_MAX / 2 + 1];	/**< chain[i] is the inode of names[i-1], chain[0] is "/" */
+    int		depth;				/**< number of components */
+    int		known;				/**< deepest component in chain[], -1 if not even "/" */
+};
+
+/**
+ * Split a path into components and look them up in the dentry cache, as far
+ * down as the cache allows.
+ *
+ * @return 0 if successful (check path_walk::known against path_walk::depth)
+ * @return -ENOENT if a component is cached as not existing
+ * @return -ENAMETOOLONG if the path does not fit into PATH_MAX
+ * @param w walk to fill
+ * @param path (absolute) pathname to walk
+ */
+static int path_walk(struct path_walk *w, const char *path)
+{
+    char *nameptr, *pathptr = w->buf, *saveptr = NULL;
+    long ret;
+
+    if (strlen(path) >= sizeof(w->buf))
+        return -ENAMETOOLONG;
+    strcpy(w->buf, path);
+
+    w->depth = 0;
+    while ((nameptr = strtok_r(pathptr, "/", &saveptr)) != NULL) {
+        pathptr = NULL;
+        w->names[w->depth++] = nameptr;
+    }
+
+    w->known = -1;
+    w->chain[0] = dcache_lookup(0, "/");
+    if (w->chain[0] <= 0)
+        return 0;
+
+    for (w->known = 0; w->known < w->depth; w->known++) {
+        ret = dcache_lookup(w->chain[w->known], w->names[w->known]);
+        if (ret == -ENOENT)
+            return -ENOENT;
+        if (ret == DCACHE_MISS)
+            break;
+        w->chain[w->known + 1] = ret;
+    }
+
+    return 0;
+}
+
+/**
+ * Build the parts of a query that resolve the uncached suffix of a walk.
+ * The join starts at the deepest cached directory (or at the root row) and
+ * names one column per resolved component, t<known>.inode up to
+ * t<depth>.inode, followed by whatever the caller appends to @c select.
+ * The name conditions go into the ON clauses, so that a missing component
+ * shows up as a NULL column instead of an empty result.
+ *
+ * @param mysql handle to connection to the database (for escaping)
+ * @param w walk from path_walk(), with known < depth
+ * @param select buffer of SQL_MAX bytes for the column list
+ * @param from buffer of SQL_MAX bytes for the FROM clause
+ * @param where buffer of SQL_MAX bytes for the WHERE clause
+ */
+static void path_walk_sql(MYSQL *mysql, struct path_walk *w,
+                          char *select, char *from, char *where)
+{
+    char esc_name[PATH_MAX * 2];
+    size_t sel_len, from_len;
+    int i;
+
+    // TODO: Handle too long or too nested paths that don't fit in SQL_MAX!!!
+    if (w->known < 0) {
+        from_len = snprintf(from, SQL_MAX, "tree AS t0");
+        snprintf(where, SQL_MAX, "t0.parent IS NULL");
+        w->known = 0;
+        w->chain[0] = 0;
+    } else {
+        from_len = snprintf(from, SQL_MAX, "tree AS t%d", w->known);
+        snprintf(where, SQL_MAX, "t%d.inode = %ld", w->known, w->chain[w->known]);
+    }
+    sel_len = snprintf(select, SQL_MAX, "t%d.inode", w->known);
+
+    for (i = w->known + 1; i <= w->depth; i++) {
+        mysql_real_escape_string(mysql, esc_name, w->names[i - 1], strlen(w->names[i - 1]));
+        from_len += snprintf(from + from_len, SQL_MAX - from_len,
+                             " LEFT JOIN tree AS t%d ON t%d.parent = t%d.inode AND t%d.name = '%s'",
+                             i, i, i - 1, i, esc_name);
+        sel_len += snprintf(select + sel_len, SQL_MAX - sel_len, ", t%d.inode", i);
+    }
+}
+
+/**
+ * Feed the dentry cache with the inode columns of a row produced by a
+ * path_walk_sql() query.  The first missing component is cached as a
+ * negative entry.
+ *
+ * @return number of inode columns consumed from the row
+ * @return -ENOENT if a component of the path does not exist
+ * @param w walk the query was built from
+ * @param row result row
+ */
+static int path_walk_row(struct path_walk *w, MYSQL_ROW row)
+{
+    int i;
+
+    for (i = w->known; i <= w->depth; i++) {
+        char *col = row[i - w->known];
+
+        if (i == 0) {
+            dcache_add(0, "/", atol(col));
+        } else if (!col) {
+            dcache_add(w->chain[i - 1], w->names[i - 1], 0);
+            return -ENOENT;
+        } else {
+            dcache_add(w->chain[i - 1], w->names[i - 1], atol(col));
+        }
+        w->chain[i] = atol(col);
+    }
+
+    return w->depth - w->known + 1;
+}
+
+/**
+ * Fill in a struct stat from the columns inode, mode, uid, gid, atime, mtime,
+ * ctime, size and nlinks of a result row, and add it to the attribute cache.
+ * The size takes in what open handles still buffer (see file_size_buffered()).
  *
  * @return 0 if successful
- * @return -EIO if the result of mysql_query() is non-zero
- * @return -ENOENT if the inode at the give path is not found (actually, if the number of results is not exactly 1)
+ * @return -ENOENT if the inode columns are NULL
+ * @param row row whose first nine columns hold the attributes
+ * @param stbuf struct stat to fill
+ */
+static int getattr_row(MYSQL_ROW row, struct stat *stbuf)
+{
+    /* The inode may have been purged while its direntry survived */
+    if (!row[0] || !row[1])
+        return -ENOENT;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = atol(row[0]);
+    stbuf->st_mode = atoi(row[1]);
+    stbuf->st_uid = atol(row[2]);
+    stbuf->st_gid = atol(row[3]);
+    stbuf->st_atime = atol(row[4]);
+    stbuf->st_mtime = atol(row[5]);
+    stbuf->st_ctime = atol(row[6]);
+    stbuf->st_size = atoll(row[7]);
+    stbuf->st_nlink = atol(row[8]);
+
+    /* Bytes still in write buffers count, or the kernel would cache the old size */
+    file_size_buffered(stbuf);
+    icache_put(stbuf->st_ino, stbuf);
+
+    return 0;
+}
+
+/** Result buffers for the attribute columns of a prepared statement */
+struct getattr_bind {
+    long long	value[ATTR_COLUMNS];	/**< inode, mode, uid, gid, atime, mtime, ctime, size, nlink */
+    my_bool	is_null[ATTR_COLUMNS];	/**< whether each column is NULL */
+};
+
+/**
+ * Fill in a struct stat from the attribute columns fetched by a prepared
+ * statement, like getattr_row(), and add it to the attribute cache.
+ *
+ * @return 0 if successful
+ * @return -ENOENT if the inode columns are NULL
+ * @param a columns fetched
+ * @param stbuf struct stat to fill
+ */
+static int getattr_fetched(struct getattr_bind *a, struct stat *stbuf)
+{
+    /* The inode may have been purged while its direntry survived */
+    if (a->is_null[0] || a->is_null[1])
+        return -ENOENT;
+
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = a->value[0];
+    stbuf->st_mode = a->value[1];
+    stbuf->st_uid = a->value[2];
+    stbuf->st_gid = a->value[3];
+    stbuf->st_atime = a->value[4];
+    stbuf->st_mtime = a->value[5];
+    stbuf->st_ctime = a->value[6];
+    stbuf->st_size = a->value[7];
+    stbuf->st_nlink = a->value[8];
+
+    file_size_buffered(stbuf);
+    icache_put(stbuf->st_ino, stbuf);
+
+    return 0;
+}
+
+/**
+ * Execute a prepared statement for inode attributes (STMT_GETATTR or
+ * STMT_LOOKUP) and fill in a struct stat from its only row.  The
+ * attributes are added to the attribute cache.
+ *
+ * @return 0 if successful
+ * @return -EIO if the statement fails
+ * @return -ENOENT if there is no such inode
  * @param mysql handle to connection to the database
- * @param path pathname to check
+ * @param id which statement
+ * @param params parameters to bind
+ * @param stbuf struct stat to fill with the inode contents
+ */
+static int getattr_stmt(MYSQL *mysql, enum query_stmt id, MYSQL_BIND *params,
+                        struct stat *stbuf)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND result[ATTR_COLUMNS];
+    struct getattr_bind a;
+    int i, ret;
+
+    if ((stmt = stmt_execute(mysql, id, params)) == NULL)
+        return -EIO;
+
+    for (i = 0; i < ATTR_COLUMNS; i++)
+        bind_int(&result[i], &a.value[i], &a.is_null[i]);
+
+    if (mysql_stmt_bind_result(stmt, result)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        ret = -EIO;
+    } else {
+        switch (mysql_stmt_fetch(stmt)) {
+        case 0:
+            ret = getattr_fetched(&a, stbuf);
+            break;
+        case MYSQL_NO_DATA:
+            ret = -ENOENT;
+            break;
+        default:
+            log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+            ret = -EIO;
+        }
+    }
+
+    mysql_stmt_free_result(stmt);
+    return ret;
+}
+
+/**
+ * Run a query for inode attributes and fill in a struct stat from its only
+ * row.  The row holds the columns inode, mode, uid, gid, atime, mtime, ctime,
+ * size and nlinks, preceded by the inode columns of a path_walk_sql() join if
+ * a walk is given.  The attributes are added to the attribute cache.
+ *
+ * @return 0 if successful
+ * @return -EIO if the query fails
+ * @return -ENOENT if there is no such inode
+ * @param mysql handle to connection to the database
+ * @param sql query to run
+ * @param w walk the query was built from, or NULL if it has no path columns
  * @param stbuf struct stat to fill with the inode contents
  */
-int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
+static int getattr_query(MYSQL *mysql, const char *sql, struct path_walk *w,
+                         struct stat *stbuf)
 {
     int ret;
-    long inode, nlinks;
-    char sql[SQL_MAX];
     MYSQL_RES* result;
     MYSQL_ROW row;
-    ret = query_inode_full(mysql, path, NULL, 0, &inode, NULL, &nlinks);
-    if (ret < 0)
-      return ret;
-
-    snprintf(sql, SQL_MAX,
-             "SELECT inode, mode, uid, gid, atime, mtime "
-             "FROM inodes WHERE inode=%ld",
-             inode);
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
@@ -115,20 +965,122 @@ int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
     }
     row = mysql_fetch_row(result);
     if(!row){
+        mysql_free_result(result);
         return -EIO;
     }
 
-    stbuf->st_ino = inode;
-    stbuf->st_mode = atoi(row[1]);
-    stbuf->st_uid = atol(row[2]);
-    stbuf->st_gid = atol(row[3]);
-    stbuf->st_atime = atol(row[4]);
-    stbuf->st_mtime = atol(row[5]);
-    stbuf->st_nlink = nlinks;
+    if (w) {
+        ret = path_walk_row(w, row);
+        if (ret < 0) {
+            mysql_free_result(result);
+            return ret;
+        }
+        row += ret - 1;
+    }
 
+    ret = getattr_row(row, stbuf);
     mysql_free_result(result);
 
-    return 0;
+    return ret;
+}
+
+/**
+ * Get the attributes of an inode, filling in a struct stat, from the
+ * attribute cache if possible.
+ *
+ * @return 0 if successful
+ * @return -EIO if the query fails
+ * @return -ENOENT if there is no such inode
+ * @param mysql handle to connection to the database
+ * @param inode inode to get the attributes of
+ * @param stbuf struct stat to fill with the inode contents
+ */
+int query_getattr_inode(MYSQL *mysql, long inode, struct stat *stbuf)
+{
+    MYSQL_BIND params[1];
+    long long id = inode;
+
+    if (icache_get(inode, stbuf) == 0)
+        return 0;
+
+    bind_int(&params[0], &id, NULL);
+
+    return getattr_stmt(mysql, STMT_GETATTR, params, stbuf);
+}
+
+/**
+ * Get the attributes of the inode at a path, filling in a struct stat:
+ * inode, mode, owner, times, size and number of links.  The path is resolved
+ * through the dentry cache; if it is cached all the way down the attributes
+ * may come straight from the attribute cache.  Otherwise a single statement
+ * resolves the uncached part of the path and reads the inode row with it.
+ *
+ * @return 0 if successful
+ * @return -EIO if the result of mysql_query() is non-zero
+ * @return -ENOENT if the inode at the give path is not found (actually, if the number of results is not exactly 1)
+ * @param mysql handle to connection to the database
+ * @param path pathname to check
+ * @param stbuf struct stat to fill with the inode contents
+ */
+int query_getattr_full(MYSQL *mysql, const char *path, struct stat *stbuf)
+{
+    int ret;
+    struct path_walk w;
+    char sql[SQL_MAX], sql_select[SQL_MAX], sql_from[SQL_MAX], sql_where[SQL_MAX];
+
+    ret = path_walk(&w, path);
+    if (ret < 0)
+        return ret;
+
+    if (w.known == w.depth)
+        return query_getattr_inode(mysql, w.chain[w.depth], stbuf);
+
+    path_walk_sql(mysql, &w, sql_select, sql_from, sql_where);
+    snprintf(sql, SQL_MAX,
+             "SELECT %s, i.mode, i.uid, i.gid, i.atime, i.mtime, i.ctime, i.size, i.nlink "
+             "FROM %s LEFT JOIN inodes AS i ON i.inode = t%d.inode WHERE %s",
+             sql_select, sql_from, w.depth, sql_where);
+
+    return getattr_query(mysql, sql, &w, stbuf);
+}
+
+/**
+ * Look up a name in a directory and get the attributes of the inode it
+ * refers to.  This is the inode-addressed counterpart of
+ * query_getattr_full(), used by the low-level FUSE frontend.
+ *
+ * @return 0 if successful
+ * @return -EIO if the query fails
+ * @return -ENOENT if there is no such name in the directory
+ * @param mysql handle to connection to the database
+ * @param parent inode of the directory
+ * @param name name (relative) of the entry to look up
+ * @param stbuf struct stat to fill with the inode contents
+ */
+int query_lookup(MYSQL *mysql, long parent, const char *name, struct stat *stbuf)
+{
+    int ret;
+    long inode;
+    MYSQL_BIND params[2];
+    long long dir = parent;
+    unsigned long name_len = strlen(name);
+
+    inode = dcache_lookup(parent, name);
+    if (inode == -ENOENT)
+        return -ENOENT;
+    if (inode != DCACHE_MISS)
+        return query_getattr_inode(mysql, inode, stbuf);
+
+    bind_int(&params[0], &dir, NULL);
+    bind_str(&params[1], name, &name_len, name_len);
+
+    ret = getattr_stmt(mysql, STMT_LOOKUP, params, stbuf);
+    if (ret == 0)
+        dcache_add(parent, name, stbuf->st_ino);
+    else if (ret == -ENOENT)
+        dcache_add(parent, name, 0);
+
+    return ret;
 }
 
 /**
@@ -137,6 +1089,12 @@ int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf)
  * this function indicates that the pathname may overflow -- sounds like a
  * good testcase :)
  *
+ * The path is first walked component by component through the dentry cache
+ * (see dcache.c); only the suffix that is not cached is resolved with a
+ * single LEFT JOIN query that starts at the deepest cached directory.  Every
+ * component resolved by that query is added to the cache, and the first
+ * component that does not exist is cached as a negative entry.
+ *
  * If any of the name, inode, parent, or nlinks are given, those values will be
  * recorded form the inode data to the given buffers.  The name is written to
  * the given name_len.
@@ -159,38 +1117,45 @@ int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len
     char sql[SQL_MAX];
     MYSQL_RES* result;
     MYSQL_ROW row;
+    struct path_walk w;
+    char sql_select[SQL_MAX], sql_from[SQL_MAX], sql_where[SQL_MAX];
+    int depth;
 
-    int depth = 0;
-    char *pathptr = strdup(path), *pathptr_saved = pathptr;
-    char *nameptr, *saveptr = NULL;
-    char sql_from[SQL_MAX], sql_where[SQL_MAX];
-    char *sql_from_end = sql_from, *sql_where_end = sql_where;
-    char esc_name[PATH_MAX * 2];
+    ret = path_walk(&w, path);
+    if (ret < 0)
+        return ret;
+    depth = w.depth;
+
+    if (w.known == depth) {
+        if (inode)
+            *inode = w.chain[depth];
+        if (name)
+            snprintf(name, name_len, "%s", depth ? w.names[depth - 1] : "/");
+        if (parent)
+            *parent = depth ? w.chain[depth - 1] : -1;
+        if (nlinks) {
+            ret = query_nlinks(mysql, w.chain[depth]);
+            if (ret < 0)
+                return ret;
+            *nlinks = ret;
+        }
+        return 0;
+    }
 
-    // TODO: Handle too long or too nested paths that don't fit in SQL_MAX!!!
-    sql_from_end += snprintf(sql_from_end, SQL_MAX, "tree AS t0");
-    sql_where_end += snprintf(sql_where_end, SQL_MAX, "t0.parent IS NULL");
-    while ((nameptr = strtok_r(pathptr, "/", &saveptr)) != NULL) {
-        if (depth++ == 0) {
-	  pathptr = NULL;
-	}
-
-        mysql_real_escape_string(mysql, esc_name, nameptr, strlen(nameptr));
-	sql_from_end += snprintf(sql_from_end, SQL_MAX, " LEFT JOIN tree AS t%d ON t%d.inode = t%d.parent",
-		 depth, depth-1, depth);
-	sql_where_end += snprintf(sql_where_end, SQL_MAX, " AND t%d.name = '%s'",
-		 depth, esc_name);
-    }
-    free(pathptr_saved);
-
-    // TODO: Only run subquery when pointer to nlinks != NULL, otherwise we don't need it.
-    snprintf(sql, SQL_MAX, "SELECT t%d.inode, t%d.name, t%d.parent, "
-	     		   "       (SELECT COUNT(inode) FROM tree AS t%d WHERE t%d.inode=t%d.inode) "
-			   "               AS nlinks "
-	     		   "FROM %s WHERE %s",
-	     depth, depth, depth,
-	     depth+1, depth+1, depth,
-	     sql_from, sql_where);
+    path_walk_sql(mysql, &w, sql_select, sql_from, sql_where);
+
+    /* Only join the inode row when the link count is asked for */
+    if (nlinks)
+        snprintf(sql, SQL_MAX, "SELECT %s, t%d.name, t%d.parent, i.nlink "
+                               "FROM %s LEFT JOIN inodes AS i ON i.inode = t%d.inode "
+                               "WHERE %s",
+                 sql_select, depth, depth,
+                 sql_from, depth, sql_where);
+    else
+        snprintf(sql, SQL_MAX, "SELECT %s, t%d.name, t%d.parent, NULL "
+                               "FROM %s WHERE %s",
+                 sql_select, depth, depth,
+                 sql_from, sql_where);
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
     ret = mysql_query(mysql, sql);
     if(ret){
@@ -214,8 +1179,17 @@ int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len
     row = mysql_fetch_row(result);
     if(!row){
         log_printf(LOG_ERROR, "ERROR: mysql_fetch_row()\n");
+        mysql_free_result(result);
         return -EIO;
     }
+
+    ret = path_walk_row(&w, row);
+    if (ret < 0) {
+        mysql_free_result(result);
+        return ret;
+    }
+    row += ret - 1;
+
     log_printf(LOG_D_OTHER, "query_inode(path='%s') => %s, %s, %s, %s\n",
 	       path, row[0], row[1], row[2], row[3]);
 
@@ -226,7 +1200,7 @@ int query_inode_full(MYSQL *mysql, const char *path, char *name, size_t name_len
     if (parent)
         *parent = row[2] ? atol(row[2]) : -1;	/* parent may be NULL */
     if (nlinks)
-        *nlinks = atol(row[3]);
+        *nlinks = row[3] ? atol(row[3]) : 0;	/* inode may have been purged */
 
     mysql_free_result(result);
 
@@ -253,61 +1227,228 @@ long query_inode(MYSQL *mysql, const char *path)
     return inode;
 }
 
+/**
+ * Get the number of directory entries that refer to an inode, ie its number
+ * of (hard) links, as kept in inodes.nlink.
+ *
+ * @return number of links
+ * @return -EIO if the query fails
+ * @param mysql handle to connection to the database
+ * @param inode inode to count the links of
+ */
+long query_nlinks(MYSQL *mysql, long inode)
+{
+    int ret;
+    MYSQL_BIND params[1];
+    long long id = inode, nlink;
+    my_bool is_null;
+
+    bind_int(&params[0], &id, NULL);
+
+    ret = stmt_fetch_int(mysql, STMT_NLINKS, params, &nlink, &is_null);
+    if (ret == -ENOENT)
+        return 0;
+    if (ret < 0)
+        return ret;
+
+    return is_null ? -EIO : nlink;
+}
+
+/** whether the inode is known to keep no inline data, see spilled */
+static int spilled_get(long inode)
+{
+    int ret;
+
+    pthread_mutex_lock(&spilled_lock);
+    ret = spilled[inode & (SPILLED_SLOTS - 1)] == inode;
+    pthread_mutex_unlock(&spilled_lock);
+
+    return ret;
+}
+
+/** record that the inode keeps no inline data (known), or forget it */
+static void spilled_set(long inode, int known)
+{
+    long *slot = &spilled[inode & (SPILLED_SLOTS - 1)];
+
+    pthread_mutex_lock(&spilled_lock);
+    if (known)
+        *slot = inode;
+    else if (*slot == inode)
+        *slot = 0;
+    pthread_mutex_unlock(&spilled_lock);
+}
+
+/**
+ * Move the data a file keeps in its inode row to block 0, ahead of a write
+ * or truncate that takes it past inline_max, in one transaction (see
+ * query_begin()).  An inode this mount has spilled before costs no query
+ * (see spilled).  The cached size is no guide here: a buffered write
+ * raises it before the data reaches the database (see file_write()).
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ */
+static int inline_spill(MYSQL *mysql, long inode)
+{
+    MYSQL_BIND params[1];
+    long long id = inode;
+
+    if (spilled_get(inode))
+        return 0;
+
+    if (query_begin(mysql) < 0)
+        return -EIO;
+
+    bind_int(&params[0], &id, NULL);
+    if (stmt_update(mysql, STMT_INLINE_SPILL, params) ||
+        stmt_update(mysql, STMT_INLINE_CLEAR, params)) {
+        query_rollback(mysql);
+        return -EIO;
+    }
+
+    if (query_commit(mysql) < 0)
+        return -EIO;
+    spilled_set(inode, 1);
+    return 0;
+}
+
+/**
+ * Write to a file that keeps its data in its inode row, in one statement
+ * that also raises the size.  The end of the write must not be past
+ * inline_max.
+ *
+ * @return number of bytes written on success
+ * @return -ENOENT if the file keeps its data in blocks
+ * @return -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param data the buffer of data to write
+ * @param size number of bytes to write
+ * @param offset offset within the file to write to
+ */
+static int write_inline(MYSQL *mysql, long inode, const char *data, size_t size,
+                        off_t offset)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[5];
+    long long id = inode, pad = offset, rest = offset + size + 1, end = offset + size;
+    unsigned long data_len = size;
+
+    bind_int(&params[0], &pad, NULL);
+    bind_blob(&params[1], data, &data_len, data_len);
+    bind_int(&params[2], &rest, NULL);
+    bind_int(&params[3], &end, NULL);
+    bind_int(&params[4], &id, NULL);
+    if ((stmt = stmt_execute(mysql, STMT_INLINE_WRITE, params)) == NULL)
+        return -EIO;
+    if (mysql_stmt_affected_rows(stmt) < 1)
+        return -ENOENT;
+
+    bcache_invalidate(inode, 0, 0);
+    return size;
+}
+
 /**
  * Change the length of a file, truncating any additional data blocks and
  * immediately deleting the data blocks past the truncation length.  Function
  * works by deleting whole blocks past the truncation point, limiting the
  * partially-cleared block, and zeroing the extra part of the buffer.
+ * Extents past the truncation point go too; one it cuts through is first
+ * turned back into blocks (see unpack_extent()).  A file that keeps its
+ * data in its inode row is cut or padded there, with one statement, unless
+ * the new length is past inline_max (see inline_spill()).  All of it is
+ * one transaction, see query_begin().
  * Called by mysqlfs_truncate().
  *
  * @see http://linux.die.net/man/2/truncate
  *
- * @return 0 on success; non-zero return of mysql_query() on error
+ * @return 0 on success; -EIO if a mysql_query() fails
  * @param mysql handle to connection to the database
- * @param path pathname of file to truncate
+ * @param inode inode of file to truncate
  * @param length new length of file
  */
-int query_truncate(MYSQL *mysql, const char *path, off_t length)
+int query_truncate(MYSQL *mysql, long inode, off_t length)
 {
-    int ret;
-    char sql[SQL_MAX];
+    MYSQL_BIND params[3];
+    long long id = inode, seq, len;
     struct data_blocks_info info;
+    struct stat st;
 
     fill_data_blocks_info(&info, length, 0);
-
-    long inode = query_inode(mysql, path);
-    if (inode < 0)
-      return inode;
+    seq = info.seq_last;
 
     lock_inode(mysql, inode);
+    if (query_begin(mysql) < 0) {
+        unlock_inode(mysql, inode);
+        return -EIO;
+    }
 
-    snprintf(sql, SQL_MAX,
-             "DELETE FROM data_blocks WHERE inode=%ld AND seq > %ld",
-	     inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    if (inline_max && length <= inline_max) {
+        MYSQL_STMT *stmt;
+
+        len = length;
+        bind_int(&params[0], &len, NULL);
+        bind_int(&params[1], &len, NULL);
+        bind_int(&params[2], &id, NULL);
+        if ((stmt = stmt_execute(mysql, STMT_INLINE_TRUNCATE, params)) == NULL) goto err_out;
+        if (mysql_stmt_affected_rows(stmt) > 0) {
+            bcache_invalidate(inode, 0, BCACHE_END);
+            goto out;
+        }
+    } else if (inline_max) {
+        if (inline_spill(mysql, inode) < 0) goto err_out;
+    }
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE data_blocks SET data=RPAD(data, %zu, '\\0') "
-	     "WHERE inode=%ld AND seq=%ld",
-             info.length_last, inode, info.seq_last);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    if (extent_blocks) {
+        seq -= seq % extent_blocks;
+        if ((off_t) seq * DATA_BLOCK_SIZE < length) {
+            if (unpack_extent(mysql, inode, seq) < 0) goto err_out;
+            seq += extent_blocks;
+        }
+        bind_int(&params[0], &id, NULL);
+        bind_int(&params[1], &seq, NULL);
+        if (stmt_update(mysql, STMT_TRUNCATE_EXTENTS, params)) goto err_out;
+        seq = info.seq_last;
+    }
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes SET size=%" PRIdMAX " WHERE inode=%ld",
-             length, inode);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if ((ret = mysql_query(mysql, sql))) goto err_out;
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &seq, NULL);
+    if (stmt_update(mysql, STMT_TRUNCATE_BLOCKS, params)) goto err_out;
+
+    len = info.length_last;
+    bind_int(&params[0], &len, NULL);
+    bind_int(&params[1], &id, NULL);
+    bind_int(&params[2], &seq, NULL);
+    if (stmt_update(mysql, STMT_TRUNCATE_LAST, params)) goto err_out;
+
+    bcache_invalidate(inode, info.seq_last, BCACHE_END);
+
+    len = length;
+    bind_int(&params[0], &len, NULL);
+    bind_int(&params[1], &id, NULL);
+    if (stmt_update(mysql, STMT_SIZE_SET, params)) goto err_out;
+
+out:
+    if (query_commit(mysql) < 0) goto err_cache;
+
+    st.st_size = length;
+    icache_update(inode, ICACHE_SIZE, &st);
 
     unlock_inode(mysql, inode);
 
     return 0;
 
 err_out:
+    query_rollback(mysql);
+err_cache:
+    /* a spill in the transaction went with it */
+    spilled_set(inode, 0);
+    icache_invalidate(inode);
+    bcache_invalidate(inode, info.seq_last, BCACHE_END);
     unlock_inode(mysql, inode);
-    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-    return ret;
+    return -EIO;
 }
 
 /**
@@ -323,21 +1464,22 @@ err_out:
  */
 int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent)
 {
-    int ret;
-    char sql[SQL_MAX];
-    char esc_name[PATH_MAX * 2];
+    MYSQL_BIND params[3];
+    long long id = inode, dir = parent;
+    unsigned long name_len = strlen(name);
+
+    bind_str(&params[0], name, &name_len, name_len);
+    bind_int(&params[1], &dir, NULL);
+    bind_int(&params[2], &id, NULL);
+    if (stmt_update(mysql, STMT_DIRENTRY_INSERT, params))
+      return -EIO;
 
-    mysql_real_escape_string(mysql, esc_name, name, strlen(name));
-    snprintf(sql, SQL_MAX,
-             "INSERT INTO tree (name, parent, inode) VALUES ('%s', %ld, %ld)",
-             esc_name, parent, inode);
+    dcache_add(parent, name, inode);
+    icache_invalidate(inode);
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret) {
-      log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    bind_int(&params[0], &id, NULL);
+    if (stmt_update(mysql, STMT_NLINK_INC, params))
       return -EIO;
-    }
 
     return 0;
 }
@@ -353,22 +1495,25 @@ int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent)
  */
 int query_rmdirentry(MYSQL *mysql, const char *name, long parent)
 {
-    int ret;
-    char sql[SQL_MAX];
-    char esc_name[PATH_MAX * 2];
+    MYSQL_BIND params[2];
+    long long dir = parent;
+    unsigned long name_len = strlen(name);
 
-    mysql_real_escape_string(mysql, esc_name, name, strlen(name));
-    snprintf(sql, SQL_MAX,
-             "DELETE FROM tree WHERE name='%s' AND parent=%ld",
-             esc_name, parent);
+    bind_str(&params[0], name, &name_len, name_len);
+    bind_int(&params[1], &dir, NULL);
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret) {
-      log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    if (stmt_update(mysql, STMT_NLINK_DEC, params)) {
+      dcache_remove(parent, name);
       return -EIO;
     }
 
+    if (stmt_update(mysql, STMT_DIRENTRY_DELETE, params)) {
+      dcache_remove(parent, name);
+      return -EIO;
+    }
+
+    dcache_add(parent, name, 0);
+
     return 0;
 }
 
@@ -376,71 +1521,80 @@ int query_rmdirentry(MYSQL *mysql, const char *name, long parent)
  * Create an inode.  This function creates a child entry of the specified dev_t
  * type and mode in the "parent" directory given as the "parent".  Any parent
  * directory information (ie "dirname(path)") is stripped out, leaving only
- * the base pathname, but it has to be there (perhaps a bug?) since this
- * function wants to strip out the path information that might conflict with
- * the parent node's pathname.
+ * the base pathname, so either a full path or a bare name may be given.
+ * The entry and the inode are created in one transaction, see query_begin().
  *
  * @see http://linux.die.net/man/2/mknod
  *
- * @return ID of new inode, or -ENOENT if the path contains no parent directory "/"
+ * @return ID of new inode, or -ENOENT if the path ends in "/"
  * @param mysql handle to connection to the database
  * @param path name of directory to create
  * @param mode access mode of new directory
  * @param rdev type of inode to create
  * @param parent inode of directory holding files (parent inode)
- * @param alloc_data (unused)
+ * @param alloc_data whether the inode holds data (a file or a symlink); if
+ * inline_max allows, it starts out with its data in its row
+ * @param uid owner of the new inode
+ * @param gid group of the new inode
  */
 long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
-                long parent, int alloc_data)
+                long parent, int alloc_data, uid_t uid, gid_t gid)
 {
-    int ret;
-    char sql[SQL_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[5];
+    long long id, dir = parent, mode_val = mode, uid_val = uid, gid_val = gid;
+    my_bool root = (path[0] == '/' && path[1] == '\0');
+    my_bool no_inline = !(alloc_data && inline_max);
+    unsigned long name_len, inline_len = 0;
     long new_inode_number = 0;
-    char *name, esc_name[PATH_MAX * 2];
-
-    if (path[0] == '/' && path[1] == '\0')  {
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO tree (name, parent) VALUES ('/', NULL)");
+    const char *name;
 
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret = mysql_query(mysql, sql);
-        if(ret)
-          goto err_out;
+    if (root) {
+        name = "/";
     } else {
         name = strrchr(path, '/');
-        if (!name || *++name == '\0')
+        name = name ? name + 1 : path;
+        if (*name == '\0')
             return -ENOENT;
+    }
+    name_len = strlen(name);
 
-        mysql_real_escape_string(mysql, esc_name, name, strlen(name));
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO tree (name, parent) VALUES ('%s', %ld)",
-                 esc_name, parent);
+    if (query_begin(mysql) < 0)
+        return -EIO;
 
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        ret = mysql_query(mysql, sql);
-        if(ret)
-          goto err_out;
-    }
+    /* The root is the one entry without a parent */
+    bind_str(&params[0], name, &name_len, name_len);
+    bind_int(&params[1], &dir, &root);
+    stmt = stmt_execute(mysql, STMT_MKNOD_ENTRY, params);
+    if (!stmt)
+        goto err_out;
 
-    new_inode_number = mysql_insert_id(mysql);
+    new_inode_number = mysql_stmt_insert_id(stmt);
 
-    snprintf(sql, SQL_MAX,
-             "INSERT INTO inodes(inode, mode, uid, gid, atime, ctime, mtime)"
-             "VALUES(%ld, %d, %d, %d, UNIX_TIMESTAMP(NOW()), "
-	            "UNIX_TIMESTAMP(NOW()), UNIX_TIMESTAMP(NOW()))",
-             new_inode_number, mode,
-	     fuse_get_context()->uid, fuse_get_context()->gid);
+    id = new_inode_number;
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &mode_val, NULL);
+    bind_int(&params[2], &uid_val, NULL);
+    bind_int(&params[3], &gid_val, NULL);
+    bind_blob(&params[4], "", &inline_len, 0);
+    params[4].is_null = &no_inline;
+    if (stmt_update(mysql, STMT_MKNOD_INODE, params))
+        goto err_out;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    ret = mysql_query(mysql, sql);
-    if(ret)
-      goto err_out;
+    if (query_commit(mysql) < 0)
+        return -EIO;
+    spilled_set(new_inode_number, 0);
+
+    if (root)
+        dcache_add(0, "/", new_inode_number);
+    else
+        dcache_add(parent, name, new_inode_number);
 
     return new_inode_number;
 
 err_out:
-    log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-    return ret;
+    query_rollback(mysql);
+    return -EIO;
 }
 
 /**
@@ -448,63 +1602,114 @@ err_out:
  *
  * @see http://linux.die.net/man/2/mkdir
  *
- * @return ID of new inode, or -ENOENT if the path contains no parent directory "/"
+ * @return ID of new inode, or -ENOENT if the path ends in "/"
  * @param mysql handle to connection to the database
  * @param path name of directory to create
  * @param mode access mode of new directory
  * @param parent inode of directory holding files (parent inode)
+ * @param uid owner of the new directory
+ * @param gid group of the new directory
  */
-long query_mkdir(MYSQL *mysql, const char *path, mode_t mode, long parent)
+long query_mkdir(MYSQL *mysql, const char *path, mode_t mode, long parent,
+                 uid_t uid, gid_t gid)
 {
-    return query_mknod(mysql, path, S_IFDIR | mode, 0, parent, 0);
+    return query_mknod(mysql, path, S_IFDIR | mode, 0, parent, 0, uid, gid);
 }
 
 /**
  * Read a directory.  This is done by listing the nodes with a given node as
- * parent, calling the filler parameter (pointer-to-function) for each item.
- * The set of results is not ordered, so results would be in the "natural order"
- * of the database.
+ * parent, calling the filler parameter (pointer-to-function) for each item,
+ * until the filler reports its buffer full or the directory is exhausted.
  *
- * for the kernel's implementation of a chmod() call in an inode on the FUSE
- * filesystem.
+ * The listing continues from the cursor: entries come in name order, a
+ * batch at a time, each batch starting after the last name returned
+ * (keyset pagination on the (parent, name) index), so neither the server
+ * nor the client ever holds more than a batch of a large directory.  A
+ * cursor whose name is unknown, ie after a seekdir(), starts by counting
+ * rows from the beginning instead.
+ *
+ * With plus set, the inodes are joined in and each entry is passed to the
+ * filler with its attributes (readdirplus), which also go into the
+ * attribute and dentry caches: the getattr the kernel does for each entry
+ * after an "ls -l" then costs no query.
  *
  * @see http://linux.die.net/man/2/readdir
  *
  * @return 0 on success; -EIO on failure (non-zero return from mysql_query() function)
  * @param mysql handle to connection to the database
- * @param inode inode of directory holding files (parent inode)
+ * @param cur position in the directory, advanced past the entries returned
  * @param buf buffer to pass to filler function
  * @param filler fuse_fill_dir_t function-pointer used to process each directory entry
+ * @param plus boolean: 1 => read the attributes of the entries as well
  */
-int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler)
+int query_readdir(MYSQL *mysql, struct dir_cursor *cur, void *buf,
+                  fuse_fill_dir_t filler, int plus)
 {
     int ret;
-    char sql[SQL_MAX];
+    char sql[SQL_MAX], sql_where[SQL_MAX], sql_limit[64];
+    char esc_name[NAME_MAX * 2 + 1];
     MYSQL_RES* result;
     MYSQL_ROW row;
+    struct stat st;
+    my_ulonglong rows;
+    int full = 0;
+
+    do {
+        if (cur->name[0]) {
+            mysql_real_escape_string(mysql, esc_name, cur->name, strlen(cur->name));
+            snprintf(sql_where, sizeof(sql_where), "t.parent = '%ld' AND t.name > '%s'",
+                     cur->inode, esc_name);
+            snprintf(sql_limit, sizeof(sql_limit), "%d", READDIR_BATCH);
+        } else {
+            snprintf(sql_where, sizeof(sql_where), "t.parent = '%ld'", cur->inode);
+            snprintf(sql_limit, sizeof(sql_limit), "%lld, %d",
+                     (long long) (cur->offset - cur->base), READDIR_BATCH);
+        }
 
-    snprintf(sql, sizeof(sql), "SELECT name FROM tree WHERE parent = '%ld'",
-             inode);
+        if (plus)
+            snprintf(sql, sizeof(sql),
+                     "SELECT t.name, i.inode, i.mode, i.uid, i.gid, i.atime, i.mtime, i.ctime, i.size, i.nlink "
+                     "FROM tree AS t LEFT JOIN inodes AS i ON i.inode = t.inode "
+                     "WHERE %s ORDER BY t.name LIMIT %s",
+                     sql_where, sql_limit);
+        else
+            snprintf(sql, sizeof(sql),
+                     "SELECT t.name FROM tree AS t WHERE %s ORDER BY t.name LIMIT %s",
+                     sql_where, sql_limit);
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
+        ret = mysql_query(mysql, sql);
+        if(ret){
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
 
-    while((row = mysql_fetch_row(result)) != NULL){
-        filler(buf, (char*)basename(row[0]), NULL, 0);
-    }
+        result = mysql_store_result(mysql);
+        if(!result){
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+        rows = mysql_num_rows(result);
+
+        while(!full && (row = mysql_fetch_row(result)) != NULL){
+            if (plus && getattr_row(row + 1, &st) == 0) {
+                /* the lookup and getattr of each entry that usually follow now hit the caches */
+                dcache_add(cur->inode, row[0], st.st_ino);
+                full = filler(buf, row[0], &st, cur->offset + 1);
+            } else {
+                full = filler(buf, row[0], NULL, cur->offset + 1);
+            }
+            if (!full) {
+                cur->offset++;
+                snprintf(cur->name, sizeof(cur->name), "%s", row[0]);
+            }
+        }
 
-    mysql_free_result(result);
+        mysql_free_result(result);
+    } while (!full && rows == READDIR_BATCH);
 
-    return ret;
+    return 0;
 }
 
 /**
@@ -521,22 +1726,20 @@ int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler)
  */
 int query_chmod(MYSQL *mysql, long inode, mode_t mode)
 {
-    int ret;
-    char sql[SQL_MAX];
-
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes SET mode=%d WHERE inode=%ld",
-             mode, inode);
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    MYSQL_BIND params[2];
+    long long id = inode, mode_val = mode;
+    struct stat st;
+
+    bind_int(&params[0], &mode_val, NULL);
+    bind_int(&params[1], &id, NULL);
+    if (stmt_update(mysql, STMT_CHMOD, params)) {
+        icache_invalidate(inode);
         return -EIO;
     }
 
+    st.st_mode = mode;
+    icache_update(inode, ICACHE_MODE, &st);
+
     return 0;
 }
 
@@ -555,30 +1758,25 @@ int query_chmod(MYSQL *mysql, long inode, mode_t mode)
  */
 int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid)
 {
-    int ret;
-    char sql[SQL_MAX];
-    size_t index;
-
-    index = snprintf(sql, SQL_MAX, "UPDATE inodes SET ");
-    if (uid != (uid_t)-1)
-    	index += snprintf(sql + index, SQL_MAX - index,
-			  "uid=%d ", uid);
-    if (gid != (gid_t)-1)
-    	index += snprintf(sql + index, SQL_MAX - index,
-			  "%s gid=%d ",
-			  /* Insert comma if this is a second argument */
-			  (uid != (uid_t)-1) ? "," : "",
-			  gid);
-    snprintf(sql + index, SQL_MAX - index, "WHERE inode=%ld", inode);
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    MYSQL_BIND params[3];
+    long long id = inode, uid_val = uid, gid_val = gid;
+    /* A NULL leaves the column as it is */
+    my_bool no_uid = (uid == (uid_t)-1), no_gid = (gid == (gid_t)-1);
+    struct stat st;
+
+    bind_int(&params[0], &uid_val, &no_uid);
+    bind_int(&params[1], &gid_val, &no_gid);
+    bind_int(&params[2], &id, NULL);
+    if (stmt_update(mysql, STMT_CHOWN, params)) {
+        icache_invalidate(inode);
         return -EIO;
     }
 
+    st.st_uid = uid;
+    st.st_gid = gid;
+    icache_update(inode, ((uid != (uid_t)-1) ? ICACHE_UID : 0) |
+                         ((gid != (gid_t)-1) ? ICACHE_GID : 0), &st);
+
     return 0;
 }
 
@@ -596,36 +1794,394 @@ int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid)
  * @param time utimbuf with new actime, modtime, to set into access and modification times
  */
 int query_utime(MYSQL *mysql, long inode, struct utimbuf *time)
+{
+    MYSQL_BIND params[3];
+    long long id = inode, atime = time->actime, mtime = time->modtime;
+    struct stat st;
+
+    bind_int(&params[0], &atime, NULL);
+    bind_int(&params[1], &mtime, NULL);
+    bind_int(&params[2], &id, NULL);
+    if (stmt_update(mysql, STMT_UTIME, params)) {
+        icache_invalidate(inode);
+        return -EIO;
+    }
+
+    st.st_atime = time->actime;
+    st.st_mtime = time->modtime;
+    icache_update(inode, ICACHE_ATIME | ICACHE_MTIME, &st);
+
+    return 0;
+}
+
+/**
+ * Serve a read entirely from the block cache, if every block it covers is
+ * cached.  The file size (from the attribute cache if possible) decides
+ * where the read ends; anything below it that a block does not cover reads
+ * as \0.
+ *
+ * @return >= 0 number of bytes read
+ * @return -ENOENT if a block is not cached (buf may have been written to)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param dst the buffer to copy read bytes
+ * @param size number of bytes to read
+ * @param offset offset within the file to read from
+ */
+static int read_cached(MYSQL *mysql, long inode, char *dst, size_t size, off_t offset)
+{
+    struct data_blocks_info info;
+    struct stat st;
+    unsigned long seq;
+    size_t pos, skip, want, length;
+    ssize_t got;
+
+    fill_data_blocks_info(&info, size, offset);
+
+    for (seq = info.seq_first, pos = 0; pos < size; seq++) {
+        skip = (seq == info.seq_first) ? info.offset_first : 0;
+        want = MIN(DATA_BLOCK_SIZE - skip, size - pos);
+        got = bcache_read(inode, seq, skip, dst + pos, want);
+        if (got < 0)
+            return -ENOENT;
+        if (got < want)
+            memset(dst + pos + got, 0, want - got);
+        pos += want;
+    }
+
+    if (query_getattr_inode(mysql, inode, &st) < 0)
+        return -ENOENT;
+    length = st.st_size > offset ? MIN(size, (size_t) (st.st_size - offset)) : 0;
+
+    return length;
+}
+
+/**
+ * Read a range of a file on one connection.  If the block cache holds all
+ * of the range, that is all it takes (see read_cached()).  Otherwise the
+ * blocks in range come from a prepared statement, along with the size of
+ * the file, and, when the filesystem keeps extents, the parts of the
+ * extents in range come with them as rows of several blocks each (see
+ * extents_sql_build()); rows come in no particular order.  Each row is
+ * fetched for its length only; the part of it that is wanted is then
+ * fetched with mysql_stmt_fetch_column() straight to where it belongs in
+ * the buffer, so the data is copied once and no result set is staged.
+ * Blocks read that way, and the holes between them, go into the block
+ * cache; a block only partly wanted is fetched whole for that.  A small
+ * file that keeps its data in its inode row (see write_inline()) gets it
+ * from the same row as its size, so it costs one lookup by primary key.
+ *
+ * This is a bit tricky as we support 'sparse' files now.  It means not all
+ * requested blocks must exist in the database, nor be full: whatever is
+ * below the end of the file but not in a block reads as \0.
+ *
+ * @return < 0 in case of errors
+ * @return >= 0 number of bytes read (size, unless the file ends earlier)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param buf the buffer to copy read bytes
+ * @param size number of bytes to read
+ * @param offset offset within the file to read from
+ */
+static int read_range(MYSQL *mysql, long inode, char *buf, size_t size,
+                      off_t offset)
 {
     int ret;
-    char sql[SQL_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[10], result[4], column;
+    long long id = inode, seq_first, seq_last, extent_first, row_seq, row_size;
+    long long file_size = -1;
+    my_bool no_block, no_inline;
+    unsigned long data_len, inline_len, column_len, gen, seq;
+    struct data_blocks_info info;
+    char *dst = buf;
+    char *block = NULL, *seen = NULL;
+    size_t length, pos, skip, want, start, end;
+    off_t row_start;
+
+    if (bcache_enabled()) {
+        ret = read_cached(mysql, inode, dst, size, offset);
+        if (ret >= 0)
+            return ret;
+    }
+    gen = bcache_generation(inode);
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes "
-             "SET atime=%ld, mtime=%ld "
-             "WHERE inode=%lu",
-             time->actime, time->modtime, inode);
+    fill_data_blocks_info(&info, size, offset);
+    seq_first = info.seq_first;
+    seq_last = info.seq_last;
+    /* Blocks may be large, and this may run on a thread of libfuse: not on the stack */
+    if (bcache_enabled()) {
+        block = malloc(DATA_BLOCK_SIZE);
+        seen = calloc(info.seq_last - info.seq_first + 1, 1);
+        if (!block || !seen) {
+            free(block);
+            free(seen);
+            return -ENOMEM;
+        }
+    }
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    /* Whatever no row covers is a hole */
+    memset(dst, 0, size);
+
+    bind_int(&params[0], &seq_first, NULL);
+    bind_int(&params[1], &seq_last, NULL);
+    bind_int(&params[2], &id, NULL);
+    if (extent_blocks) {
+        extent_first = seq_first - seq_first % extent_blocks;
+        bind_int(&params[3], &seq_first, NULL);
+        bind_int(&params[4], &seq_first, NULL);
+        bind_int(&params[5], &seq_last, NULL);
+        bind_int(&params[6], &seq_first, NULL);
+        bind_int(&params[7], &id, NULL);
+        bind_int(&params[8], &extent_first, NULL);
+        bind_int(&params[9], &seq_last, NULL);
+    }
+    stmt = stmt_execute(mysql, extent_blocks ? STMT_READ_EXTENTS : STMT_READ, params);
+    if (!stmt) {
+        ret = -EIO;
+        goto out;
+    }
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    /* No buffer for the data: the fetch only reports its length */
+    bind_int(&result[0], &row_seq, &no_block);
+    bind_blob(&result[1], NULL, &data_len, 0);
+    bind_int(&result[2], &row_size, NULL);
+    bind_blob(&result[3], NULL, &inline_len, 0);
+    result[3].is_null = &no_inline;
+    if (mysql_stmt_bind_result(stmt, result)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        ret = -EIO;
+        goto out;
     }
 
-    return 0;
+    while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+        /* rows of extents have no size */
+        if (row_size >= 0)
+            file_size = row_size;
+
+        /* Blocks next to inline data mean a spill went wrong: the blocks win */
+        if (!no_inline && !no_block) {
+            log_printf(LOG_ERROR, "%s(inode=%ld): both inline data and blocks\n",
+                       __func__, inode);
+            no_inline = 1;
+        }
+
+        /* The data in the inode row is block 0, and all there is */
+        if (!no_inline) {
+            if (offset < inline_len) {
+                bind_blob(&column, dst, &column_len, MIN(inline_len - offset, size));
+                if (mysql_stmt_fetch_column(stmt, &column, 3, offset)) {
+                    ret = 1;
+                    break;
+                }
+            }
+            if (block && inline_len <= DATA_BLOCK_SIZE) {
+                bind_blob(&column, block, &column_len, inline_len);
+                if (inline_len && mysql_stmt_fetch_column(stmt, &column, 3, 0)) {
+                    ret = 1;
+                    break;
+                }
+                bcache_put(inode, 0, block, inline_len, gen);
+                if (info.seq_first == 0)
+                    seen[0] = 1;
+            }
+            continue;
+        }
+        if (no_block)
+            continue;
+
+        /* Where the row goes in buf, and how much of its head to skip */
+        row_start = (off_t) row_seq * DATA_BLOCK_SIZE;
+        if (row_start < offset) {
+            pos = 0;
+            skip = offset - row_start;
+        } else {
+            pos = row_start - offset;
+            skip = 0;
+        }
+        if (pos >= size || data_len <= skip)
+            continue;
+        want = MIN(data_len - skip, size - pos);
+
+        bind_blob(&column, dst + pos, &column_len, want);
+        if (mysql_stmt_fetch_column(stmt, &column, 1, skip)) {
+            ret = 1;
+            break;
+        }
+        if (!block)
+            continue;
+
+        /* Cache each block of the row: from buf if it is all there, else fetched whole */
+        for (start = 0, seq = row_seq; start < data_len; start = end, seq++) {
+            end = MIN(start + DATA_BLOCK_SIZE, data_len);
+            if (seq >= info.seq_first && seq <= info.seq_last)
+                seen[seq - info.seq_first] = 1;
+            if (start >= skip && end <= skip + want) {
+                bcache_put(inode, seq, dst + pos + (start - skip), end - start, gen);
+                continue;
+            }
+            bind_blob(&column, block, &column_len, end - start);
+            if (mysql_stmt_fetch_column(stmt, &column, 1, start)) {
+                ret = 1;
+                break;
+            }
+            bcache_put(inode, seq, block, end - start, gen);
+        }
+        if (ret == 1)
+            break;
+    }
+
+    if (ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        ret = -EIO;
+        goto out;
+    }
+    mysql_stmt_free_result(stmt);
+
+    /* The inode exists: blocks in range that no row had are holes */
+    if (block && file_size >= 0)
+        for (seq = info.seq_first; seq <= info.seq_last; seq++)
+            if (!seen[seq - info.seq_first])
+                bcache_put(inode, seq, NULL, 0, gen);
+
+    length = file_size > offset ? MIN(size, (size_t) (file_size - offset)) : 0;
+    ret = length;
+
+out:
+    free(block);
+    free(seen);
+    return ret;
+}
+
+/** What fan_out() runs on each part: bytes done or -errno */
+typedef int (*fan_fn)(MYSQL *mysql, long inode, char *buf, size_t size, off_t offset);
+
+/** One part of a request spread over several connections by fan_out() */
+struct fan_part {
+    pthread_t	thread;
+    MYSQL	*mysql;		/**< connection of the part, NULL if the caller's */
+    fan_fn	fn;
+    long	inode;
+    char	*buf;		/**< where the part starts in the caller's buffer */
+    size_t	size;
+    off_t	offset;
+    int		ret;		/**< result of fn */
+};
+
+static void *fan_thread(void *arg)
+{
+    struct fan_part *part = arg;
+
+    part->ret = part->fn(part->mysql, part->inode, part->buf, part->size, part->offset);
+    return NULL;
+}
+
+/**
+ * Split size bytes at offset into at most n parts and run fn on all of
+ * them at once: the first on the caller's connection, the others in
+ * threads on connections of their own from the pool.  Parts are made of
+ * whole multiples of unit blocks, apart from the edges of the range.  A
+ * part that gets no connection or thread runs on the caller's connection
+ * after the first one.
+ *
+ * @return number of parts, each with its result in parts[i].ret
+ * @param mysql the caller's connection
+ * @param parts room for n parts
+ * @param n most parts to make, at most PARALLEL_MAX
+ * @param unit blocks a part is a multiple of
+ */
+static unsigned int fan_out(MYSQL *mysql, fan_fn fn, long inode, char *buf, size_t size,
+                            off_t offset, struct fan_part *parts, unsigned int n,
+                            unsigned long unit)
+{
+    unsigned long first = offset / DATA_BLOCK_SIZE;
+    unsigned long blocks = (offset + size - 1) / DATA_BLOCK_SIZE - first + 1;
+    unsigned long per;
+    off_t start, end;
+    unsigned int i;
+
+    per = (blocks + n - 1) / n;
+    per = (per + unit - 1) / unit * unit;
+    n = (blocks + per - 1) / per;
+
+    for (i = 0; i < n; i++) {
+        start = i ? (off_t) (first + i * per) * DATA_BLOCK_SIZE : offset;
+        end = MIN((off_t) (offset + size), (off_t) (first + (i + 1) * per) * DATA_BLOCK_SIZE);
+
+        parts[i].mysql = NULL;
+        parts[i].fn = fn;
+        parts[i].inode = inode;
+        parts[i].buf = buf + (start - offset);
+        parts[i].size = end - start;
+        parts[i].offset = start;
+
+        if (i && (parts[i].mysql = pool_get()) != NULL &&
+            pthread_create(&parts[i].thread, NULL, fan_thread, &parts[i])) {
+            pool_put(parts[i].mysql);
+            parts[i].mysql = NULL;
+        }
+    }
+
+    parts[0].ret = fn(mysql, inode, parts[0].buf, parts[0].size, parts[0].offset);
+
+    for (i = 1; i < n; i++) {
+        if (parts[i].mysql) {
+            pthread_join(parts[i].thread, NULL);
+            pool_put(parts[i].mysql);
+        } else
+            parts[i].ret = fn(mysql, inode, parts[i].buf, parts[i].size, parts[i].offset);
+    }
+
+    log_printf(LOG_D_OTHER, "%s(inode=%ld): %zu@%lld in %u parts\n", __func__,
+               inode, size, (long long) offset, n);
+    return n;
+}
+
+/** query_read() with the inode already locked shared */
+static int read_locked(MYSQL *mysql, long inode, const char *buf, size_t size,
+                       off_t offset)
+{
+    struct fan_part parts[PARALLEL_MAX];
+    char *dst = (char *)buf;
+    unsigned long blocks;
+    unsigned int i, n;
+    int ret = 0;
+
+    blocks = size ? (offset + size - 1) / DATA_BLOCK_SIZE - offset / DATA_BLOCK_SIZE + 1 : 0;
+    n = MIN(parallel, blocks / PARALLEL_READ_BLOCKS);
+    if (n < 2)
+        return read_range(mysql, inode, dst, size, offset);
+
+    if (bcache_enabled() && (ret = read_cached(mysql, inode, dst, size, offset)) >= 0)
+        return ret;
+
+    n = fan_out(mysql, read_range, inode, dst, size, offset, parts, n, 1);
+
+    for (i = 0, ret = 0; i < n; i++)
+        if (parts[i].ret < 0)
+            return parts[i].ret;
+    for (i = 0; i < n; i++) {
+        ret += parts[i].ret;
+        if ((size_t) parts[i].ret < parts[i].size)
+            break;
+    }
+
+    return ret;
 }
 
 /**
  * Read a number of bytes (perhaps larger than BLOCK_SIZE) at an offset from
- * a file.  The function does this by reading each block in succession, copying
- * the block contents into the target buffer.  The (offset % DATA_BLOCK_SIZE)
- * issue is handled by shifting the copy slightly.
+ * a file.  A read of many blocks not all in the block cache is split, by
+ * mysqlfs_opt::parallel, into parts of at least PARALLEL_READ_BLOCKS blocks
+ * that are read at the same time on several connections (see fan_out()),
+ * straight into their place in buf; the read then ends where the first
+ * part that came up short ends.  Otherwise it is one read_range().
+ * Writers of the inode on this mount wait for the read to finish.
  *
- * @return < 0 in case of errors (propagating result of write_one_block() )
- * @return > 0 number of bytes read (should equal size parameter)
+ * @return < 0 in case of errors
+ * @return >= 0 number of bytes read (size, unless the file ends earlier)
  * @param mysql handle to connection to the database
  * @param inode inode of the file in question
  * @param buf the buffer to copy read bytes
@@ -636,81 +2192,249 @@ int query_read(MYSQL *mysql, long inode, const char *buf, size_t size,
                off_t offset)
 {
     int ret;
-    char sql[SQL_MAX];
-    MYSQL_RES* result;
-    MYSQL_ROW row;
-    unsigned long length = 0L, copy_len, seq;
-    struct data_blocks_info info;
-    char *dst = (char *)buf;
-    char *src, *zeroes = alloca(DATA_BLOCK_SIZE);
 
-    fill_data_blocks_info(&info, size, offset);
-
-    /* Read all required blocks */
-    snprintf(sql, SQL_MAX,
-             "SELECT seq, data, LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq>=%lu AND seq <=%lu ORDER BY seq ASC",
-             inode, info.seq_first, info.seq_last);
+    /* The parts of a split read run in threads of their own, under this one lock */
+    lock_inode_shared(mysql, inode);
+    ret = read_locked(mysql, inode, buf, size, offset);
+    unlock_inode_shared(mysql, inode);
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    return ret;
+}
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+/**
+ * Load blocks of a file into the block cache ahead of the reads that will
+ * want them (see readahead.c).  Every block of every row in range, blocks
+ * and the parts of extents alike, is fetched through one bounce block and
+ * put in the cache; once all rows are in, so are the holes between them.
+ * The size of the file is not known here, so nothing past the last row is
+ * cached.
+ *
+ * @return >= 0 number of blocks put in the cache
+ * @return < 0 in case of errors
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param first sequence number of the first block to load
+ * @param last sequence number of the last block to load
+ */
+int query_prefetch(MYSQL *mysql, long inode, unsigned long first, unsigned long last)
+{
+    int ret, count = 0;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[10], result[2], column;
+    long long id = inode, seq_first = first, seq_last = last, extent_first, row_seq;
+    unsigned long data_len, column_len, gen, seq, top = first;
+    size_t start, end;
+    char *block, *seen;
+
+    if (!bcache_enabled())
+        return 0;
+    if ((seen = calloc(last - first + 1, 1)) == NULL)
+        return -ENOMEM;
+    if ((block = malloc(DATA_BLOCK_SIZE)) == NULL) {
+        free(seen);
+        return -ENOMEM;
+    }
+    gen = bcache_generation(inode);
+
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &seq_first, NULL);
+    bind_int(&params[2], &seq_last, NULL);
+    if (extent_blocks) {
+        extent_first = seq_first - seq_first % extent_blocks;
+        bind_int(&params[3], &seq_first, NULL);
+        bind_int(&params[4], &seq_first, NULL);
+        bind_int(&params[5], &seq_last, NULL);
+        bind_int(&params[6], &seq_first, NULL);
+        bind_int(&params[7], &id, NULL);
+        bind_int(&params[8], &extent_first, NULL);
+        bind_int(&params[9], &seq_last, NULL);
+    }
+    stmt = stmt_execute(mysql, extent_blocks ? STMT_PREFETCH_EXTENTS : STMT_PREFETCH, params);
+    if (!stmt) {
+        free(block);
+        free(seen);
         return -EIO;
     }
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    bind_int(&result[0], &row_seq, NULL);
+    bind_blob(&result[1], NULL, &data_len, 0);
+    if (mysql_stmt_bind_result(stmt, result)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        goto err_out;
+    }
+
+    while ((ret = mysql_stmt_fetch(stmt)) == 0 || ret == MYSQL_DATA_TRUNCATED) {
+        for (start = 0, seq = row_seq; start < data_len; start = end, seq++) {
+            end = MIN(start + DATA_BLOCK_SIZE, data_len);
+            bind_blob(&column, block, &column_len, end - start);
+            if (mysql_stmt_fetch_column(stmt, &column, 1, start)) {
+                log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+                goto err_out;
+            }
+            bcache_put(inode, seq, block, end - start, gen);
+            count++;
+            if (seq >= first && seq <= last)
+                seen[seq - first] = 1;
+        }
+        if (data_len)
+            top = MAX(top, seq);
+        else if ((unsigned long) row_seq >= first && (unsigned long) row_seq <= last) {
+            /* an empty block */
+            bcache_put(inode, row_seq, NULL, 0, gen);
+            seen[row_seq - first] = 1;
+            top = MAX(top, (unsigned long) row_seq + 1);
+            count++;
+        }
+    }
+
+    if (ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        goto err_out;
+    }
+    mysql_stmt_free_result(stmt);
+
+    /* Holes below the last row */
+    for (seq = first; seq < top && seq <= last; seq++)
+        if (!seen[seq - first]) {
+            bcache_put(inode, seq, NULL, 0, gen);
+            count++;
+        }
+
+    free(block);
+    free(seen);
+    return count;
+
+err_out:
+    mysql_stmt_free_result(stmt);
+    free(block);
+    free(seen);
+    return -EIO;
+}
+
+/**
+ * Whether a buffer holds nothing but \0, as blocks of preallocated or
+ * sparse-copied files do; those are not worth a row, since a hole reads
+ * the same.  The check runs a stride of 128 bytes at a time, with AVX2 or
+ * SSE2 where the compiler targets them (the tail and other CPUs go a byte
+ * at a time), and stops at the first stride that is not all zero, so data
+ * costs next to nothing to tell from zeroes.
+ *
+ * @return 1 if all len bytes are zero, else 0
+ * @param data the buffer
+ * @param len its length
+ */
+static int data_is_zero(const char *data, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    __m256i acc;
+
+    for (; i + 128 <= len; i += 128) {
+        acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (data + i)),
+                            _mm256_loadu_si256((const __m256i *) (data + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (data + i + 64)),
+                            _mm256_loadu_si256((const __m256i *) (data + i + 96))));
+        if (!_mm256_testz_si256(acc, acc))
+            return 0;
+    }
+#elif defined(__SSE2__)
+    __m128i acc;
+    int j;
+
+    for (; i + 128 <= len; i += 128) {
+        acc = _mm_loadu_si128((const __m128i *) (data + i));
+        for (j = 16; j < 128; j += 16)
+            acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *) (data + i + j)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+            return 0;
+    }
+#endif
+
+    for (; i < len; i++)
+        if (data[i])
+            return 0;
+
+    return 1;
+}
+
+/**
+ * Write part of a block by read-modify-write on the client: the block comes
+ * from the database, never the block cache, whose copy may be stale by
+ * another mount's write and would then revert it; the data is copied into
+ * it (past a stretch of \0 if it starts beyond the end of the block), and
+ * the whole image goes back with one upsert, which the block cache then
+ * holds; a block that ends up all zero is dropped instead, leaving a hole.
+ * So neither the server nor the network carries more than one block and
+ * no string functions are evaluated, but writers of the same block must take turns: those of this
+ * mount do, on a stripe of merge_locks; other mounts of the database are
+ * not excluded, as they are by the splice in write_one_block().
+ *
+ * @return number of bytes written on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data block on
+ * @param seq sequence number of datablock to write
+ * @param data buffer of content to write
+ * @param size size_t length of data
+ * @param offset what offset within the datablock to write the data
+ */
+static int merge_one_block(MYSQL *mysql, long inode, unsigned long seq,
+                           const char *data, size_t size, off_t offset)
+{
+    MYSQL_BIND params[3], result[1];
+    long long id = inode, block = seq, end;
+    unsigned long len = 0;
+    my_bool is_null = 0;
+    pthread_mutex_t *lock;
+    char *buf;
+    int ret;
+
+    if ((buf = malloc(DATA_BLOCK_SIZE)) == NULL)
+        return -ENOMEM;
+
+    lock = &merge_locks[((unsigned long) inode * 31 + seq) & (MERGE_LOCKS - 1)];
+    pthread_mutex_lock(lock);
+
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &block, NULL);
+    bind_blob(&result[0], buf, &len, DATA_BLOCK_SIZE);
+    result[0].is_null = &is_null;
+    ret = stmt_fetch_one(mysql, STMT_BLOCK_GET, params, result);
+    if (ret == -ENOENT || is_null)
+        len = 0;
+    else if (ret < 0)
+        goto out;
+
+    if (offset > len)
+        memset(buf + len, 0, offset - len);
+    memcpy(buf + offset, data, size);
+    len = MAX(len, offset + size);
+
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &block, NULL);
+    if (data_is_zero(buf, len)) {
+        /* nothing but zeroes: a hole reads the same */
+        end = seq + 1;
+        bind_int(&params[2], &end, NULL);
+        ret = stmt_update(mysql, STMT_BLOCK_CLEAR, params);
+        len = 0;
+    } else {
+        bind_blob(&params[2], buf, &len, len);
+        ret = stmt_update(mysql, STMT_BLOCK_PUT, params);
     }
+    if (ret < 0)
+        bcache_invalidate(inode, seq, seq);
+    else
+        bcache_replace(inode, seq, len ? buf : NULL, len);
 
-    /* This is a bit tricky as we support 'sparse' files now.
-     * It means not all requested blocks must exist in the
-     * database. For those that don't exist we'll return
-     * a block of \0 instead.  */
-    row = mysql_fetch_row(result);
-    memset(zeroes, 0L, DATA_BLOCK_SIZE);
-    for (seq = info.seq_first; seq<=info.seq_last; seq++) {
-        off_t row_seq = -1;
-	size_t row_len = DATA_BLOCK_SIZE;
-	char *data = zeroes;
-
-	if (row && (row_seq = atoll(row[0])) == seq) {
-	    data = row[1];
-	    row_len = atoll(row[2]);
-	}
-
-	if (seq == info.seq_first) {
-	    if (row_len < info.offset_first)
-	        goto go_away;
-
-	    copy_len = MIN(row_len - info.offset_first, info.length_first);
-	    src = data + info.offset_first;
-	} else if (seq == info.seq_last) {
-	    copy_len = MIN(info.length_last, row_len);
-	    src = data;
-	} else {
-	    copy_len = MIN(DATA_BLOCK_SIZE, row_len);
-	    src = data;
-	}
-
-	memcpy(dst, src, copy_len);
-	dst += copy_len;
-	length += copy_len;
-
-	if (row && row_seq == seq)
-	    row = mysql_fetch_row(result);
-    }
-
-go_away:
-    /* Read all remaining rows */
-    while (mysql_fetch_row(result));
-    mysql_free_result(result);
+out:
+    pthread_mutex_unlock(lock);
+    free(buf);
+    if (ret < 0)
+        return ret;
 
-    return length;
+    return size;
 }
 
 /**
@@ -719,14 +2443,16 @@ go_away:
  * This function takes an early bail-out if the size to write is zero, or if the total size to write exceeds the block size.
  *
  * This function checks to see if the previous block didn't exist -- in such
- * case, it then writes out a zero-length block.  The function then creates a
- * statement that has a '?' token representing the new data.  If the previous
- * data didn't exist, the function uses a "SET x == y" format; otherwise, a
- * "CONCAT (data, ?)".  The statement is snprintf'd, prepared, and executed; the
- * result produces either a 0 on success, or a -EIO on failure (with an error
- * message logged).
+ * case, it then writes out a zero-length block, unless the data is all zero
+ * and the hole can stay.  The new data is then
+ * spliced into the block with one prepared statement: the old contents are
+ * padded up to the offset, followed by the data and whatever the block held
+ * past it.  The size of the file is left to the caller, query_write().
+ * With mysqlfs_opt::rmw the block is merged on the client instead, see
+ * merge_one_block().  The result is either the number of bytes written, or
+ * a -EIO on failure (with an error message logged).
  *
- * @return 0 on success; -EIO on failure
+ * @return number of bytes written on success; -EIO on failure
  * @param mysql handle to connection to the database
  * @param inode inode to write out the data block on
  * @param seq sequence number of datablock to write
@@ -739,135 +2465,429 @@ static int write_one_block(MYSQL *mysql, long inode,
 				 const char *data, size_t size,
 				 off_t offset)
 {
-    MYSQL_STMT *stmt;
-    MYSQL_BIND bind[1];
-    char sql[SQL_MAX];
-    size_t current_block_size = query_size_block(mysql, inode, seq);
+    MYSQL_BIND params[5];
+    long long id = inode, block = seq, pad = offset, rest = offset + size + 1;
+    unsigned long data_len = size;
+    ssize_t current_block_size;
+    int ret;
 
     /* Shortcut */
     if (size == 0) return 0;
 
     if (offset + size > DATA_BLOCK_SIZE) {
-        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%d)\n",
+        log_printf(LOG_ERROR, "%s(): offset(%zu)+size(%zu)>max_block(%u)\n",
 		   __func__, offset, size, DATA_BLOCK_SIZE);
 	return -EIO;
     }
 
+    if (merge)
+        return merge_one_block(mysql, inode, seq, data, size, offset);
+
     /* We expect the inode is already locked for this thread by caller! */
 
-    if (current_block_size == -ENXIO) {
+    current_block_size = query_size_block(mysql, inode, seq);
+    if (current_block_size == -ENXIO && data_is_zero(data, size)) {
+        /* Zeroes into a hole: it reads the same without a block */
+        return size;
+    } else if (current_block_size == -ENXIO) {
         /* This data block has not yet been allocated */
-        snprintf(sql, SQL_MAX,
-                 "INSERT INTO data_blocks SET inode=%ld, seq=%lu, data=''", inode, seq);
-        log_printf(LOG_D_SQL, "sql=%s\n", sql);
-        if(mysql_query(mysql, sql)){
-            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        bind_int(&params[0], &id, NULL);
+        bind_int(&params[1], &block, NULL);
+        if (stmt_update(mysql, STMT_BLOCK_INSERT, params))
             return -EIO;
+    } else if (current_block_size < 0) {
+        return current_block_size;
+    }
+
+    bind_int(&params[0], &pad, NULL);
+    bind_blob(&params[1], data, &data_len, data_len);
+    bind_int(&params[2], &rest, NULL);
+    bind_int(&params[3], &id, NULL);
+    bind_int(&params[4], &block, NULL);
+    ret = stmt_update(mysql, STMT_BLOCK_UPDATE, params);
+    bcache_invalidate(inode, seq, seq);
+    if (ret < 0)
+        return ret;
+
+    return size;
+}
+
+/**
+ * Writes a run of full data blocks into the database.  Instead of probing
+ * and updating each block like write_one_block(), up to
+ * mysqlfs_opt::write_batch blocks at a time are stored with one multi-row
+ * "INSERT ... ON DUPLICATE KEY UPDATE", which replaces blocks that exist
+ * and creates those that don't.  Full batches use the statement every
+ * connection keeps prepared (STMT_BLOCK_UPSERT); a shorter batch at the
+ * end of the run is prepared for the occasion.  Blocks that are all zero
+ * (see data_is_zero()) are left out of the batch, and whatever the batch
+ * would have replaced over their span is deleted first, so that they read
+ * as holes.  The whole run is one transaction, see query_begin().  The
+ * size of the file is left to the caller, query_write().
+ *
+ * @return number of bytes written on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data blocks on
+ * @param seq sequence number of the first datablock to write
+ * @param data buffer of content to write, count * DATA_BLOCK_SIZE bytes
+ * @param count number of blocks to write
+ */
+static int write_full_blocks(MYSQL *mysql, long inode, unsigned long seq,
+                             const char *data, unsigned long count)
+{
+    MYSQL_STMT *stmt, *once;
+    MYSQL_BIND bind[3 * WRITE_BATCH_MAX], params[3];
+    long long id = inode, seqs[WRITE_BATCH_MAX], zero_first, zero_end;
+    unsigned long length = DATA_BLOCK_SIZE;
+    char sql[SQL_MAX];
+    unsigned long first, n;
+    int ret, written = 0;
+
+    /* We expect the inode is already locked for this thread by caller! */
+
+    if (query_begin(mysql) < 0)
+        return -EIO;
+
+    while (count) {
+        first = seq;
+        zero_first = zero_end = 0;
+
+        for (n = 0; count && n < write_batch; seq++, count--, data += DATA_BLOCK_SIZE) {
+            if (data_is_zero(data, DATA_BLOCK_SIZE)) {
+                if (zero_end == 0)
+                    zero_first = seq;
+                zero_end = seq + 1;
+                continue;
+            }
+            seqs[n] = seq;
+            bind_int(&bind[3 * n], &id, NULL);
+            bind_int(&bind[3 * n + 1], &seqs[n], NULL);
+            bind_blob(&bind[3 * n + 2], data, &length, length);
+            n++;
         }
+        written += (seq - first) * DATA_BLOCK_SIZE;
 
-        current_block_size = query_size_block(mysql, inode, seq);
-    }
+        ret = 0;
+        if (zero_end) {
+            bind_int(&params[0], &id, NULL);
+            bind_int(&params[1], &zero_first, NULL);
+            bind_int(&params[2], &zero_end, NULL);
+            ret = stmt_update(mysql, STMT_BLOCK_CLEAR, params);
+        }
 
-    stmt = mysql_stmt_init(mysql);
-    if (!stmt)
-    {
-        log_printf(LOG_ERROR, "mysql_stmt_init(), out of memory\n");
-	return -EIO;
+        if (ret == 0 && n == write_batch) {
+            if (!stmt_execute(mysql, STMT_BLOCK_UPSERT, bind))
+                ret = -EIO;
+        } else if (ret == 0 && n) {
+            upsert_sql_build(sql, n);
+            once = NULL;
+            stmt = stmt_run(mysql, &once, sql, bind);
+            if (once && mysql_stmt_close(once))
+                log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(once));
+            if (!stmt)
+                ret = -EIO;
+        }
+        bcache_invalidate(inode, first, seq - 1);
+        if (ret < 0) {
+            query_rollback(mysql);
+            return ret;
+        }
     }
 
-    memset(bind, 0, sizeof(bind));
-    if (offset == 0 && current_block_size == 0) {
-        snprintf(sql, SQL_MAX,
-                 "UPDATE data_blocks "
-		 "SET data=? "
-		 "WHERE inode=%ld AND seq=%lu",
-		 inode, seq);
-    } else if (offset == current_block_size) {
-        snprintf(sql, sizeof(sql),
-                 "UPDATE data_blocks "
-		 "SET data=CONCAT(data, ?) "
-		 "WHERE inode=%ld AND seq=%lu",
-		 inode, seq);
-    } else {
-        size_t pos, new_size;
-        pos = snprintf(sql, sizeof(sql),
-		 "UPDATE data_blocks SET data=CONCAT(");
-	if (offset > 0)
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "RPAD(IF(ISNULL(data),'', data), %" PRIuMAX ", '\\0'),", offset);
-	pos += snprintf(sql + pos, sizeof(sql) - pos, "?,");
-	new_size = offset + size;
-	if (offset + size < current_block_size) {
-	    pos += snprintf(sql + pos, sizeof(sql) - pos, "SUBSTRING(data FROM %" PRIuMAX "),", offset + size + 1);
-	    new_size = current_block_size;
-	}
-	sql[--pos] = '\0';	/* Remove the trailing comma. */
-	pos += snprintf(sql + pos, sizeof(sql) - pos, ") WHERE inode=%ld AND seq=%lu",
-			inode, seq);
-    }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (query_commit(mysql) < 0)
+        return -EIO;
 
-    if (mysql_stmt_prepare(stmt, sql, strlen(sql))) {
-	log_printf(LOG_ERROR, "mysql_stmt_prepare() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
-    }
+    return written;
+}
 
-    if (mysql_stmt_param_count(stmt) != 1) {
-      log_printf(LOG_ERROR, "%s(): stmt_param_count=%d, expected 1\n", __func__, mysql_stmt_param_count(stmt));
-      return -EIO;
+/**
+ * Raise the size of a file to the end of what a write stored, with one
+ * statement; the block writers leave it alone.
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param offset where the write started
+ * @param written number of bytes it stored, 0 if none
+ */
+static int size_grow(MYSQL *mysql, long inode, off_t offset, size_t written)
+{
+    MYSQL_BIND params[2];
+    long long id = inode, end = offset + written;
+
+    if (!written)
+        return 0;
+
+    bind_int(&params[0], &end, NULL);
+    bind_int(&params[1], &id, NULL);
+    return stmt_update(mysql, STMT_SIZE_GROW, params);
+}
+
+/** write_full_blocks() in the shape of a fan_fn, for the parts of a large query_write() */
+static int write_full_part(MYSQL *mysql, long inode, char *buf, size_t size, off_t offset)
+{
+    return write_full_blocks(mysql, inode, offset / DATA_BLOCK_SIZE, buf, size / DATA_BLOCK_SIZE);
+}
+
+/**
+ * Store aligned runs of extent_blocks full blocks as extents, one row each,
+ * and drop the blocks of data_blocks they replace.  A run that is all zero
+ * is stored as nothing at all.  It is all one transaction, see
+ * query_begin().  The size of the file is
+ * left to the caller, query_write().
+ *
+ * @return number of bytes written on success; -EIO on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the extents on
+ * @param seq sequence number of the first block, a multiple of extent_blocks
+ * @param data buffer of content to write, count * extent_blocks * DATA_BLOCK_SIZE bytes
+ * @param count number of extents to write
+ */
+static int write_extents(MYSQL *mysql, long inode, unsigned long seq,
+                         const char *data, unsigned long count)
+{
+    MYSQL_BIND params[3];
+    long long id = inode, first, end;
+    unsigned long length = (unsigned long) extent_blocks * DATA_BLOCK_SIZE;
+    int written = 0, ret;
+
+    if (query_begin(mysql) < 0)
+        return -EIO;
+
+    for (; count; count--, seq += extent_blocks, data += length) {
+        first = seq;
+        end = seq + extent_blocks;
+        bind_int(&params[0], &id, NULL);
+        bind_int(&params[1], &first, NULL);
+        if (data_is_zero(data, length)) {
+            /* all holes: neither an extent nor blocks */
+            ret = stmt_update(mysql, STMT_EXTENT_DELETE, params);
+        } else {
+            bind_blob(&params[2], data, &length, length);
+            ret = stmt_update(mysql, STMT_EXTENT_PUT, params);
+        }
+        if (ret == 0) {
+            bind_int(&params[2], &end, NULL);
+            ret = stmt_update(mysql, STMT_BLOCK_CLEAR, params);
+        }
+        bcache_invalidate(inode, seq, seq + extent_blocks - 1);
+        if (ret < 0) {
+            query_rollback(mysql);
+            return ret;
+        }
+        written += length;
     }
-    bind[0].buffer_type= MYSQL_TYPE_LONG_BLOB;
-    bind[0].buffer= (char *)data;
-    bind[0].is_null= 0;
-    bind[0].length= (unsigned long *)(void *)&size;
 
-    if (mysql_stmt_bind_param(stmt, bind)) {
-	log_printf(LOG_ERROR, "mysql_stmt_bind_param() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
+    if (query_commit(mysql) < 0)
+        return -EIO;
+
+    return written;
+}
+
+/** write_extents() in the shape of a fan_fn, for the parts of a large query_write() */
+static int write_extents_part(MYSQL *mysql, long inode, char *buf, size_t size, off_t offset)
+{
+    return write_extents(mysql, inode, offset / DATA_BLOCK_SIZE, buf,
+                         size / DATA_BLOCK_SIZE / extent_blocks);
+}
+
+/**
+ * Run a writer of full blocks on a run of them, spread over up to
+ * mysqlfs_opt::parallel connections in parts of whole multiples of unit
+ * blocks (see fan_out()) if there is more than one such unit.
+ *
+ * @return number of bytes written on success; < 0 on failure
+ * @param fn write_full_part() or write_extents_part()
+ * @param unit blocks a part is a multiple of
+ */
+static int write_spread(MYSQL *mysql, fan_fn fn, long inode, const char *data,
+                        unsigned long seq, unsigned long count, unsigned long unit)
+{
+    struct fan_part parts[PARALLEL_MAX];
+    size_t size = count * DATA_BLOCK_SIZE;
+    off_t offset = (off_t) seq * DATA_BLOCK_SIZE;
+    unsigned int i, n;
+    int ret;
+
+    n = MIN(parallel, (count + unit - 1) / unit);
+    if (n < 2)
+        return fn(mysql, inode, (char *) data, size, offset);
+
+    n = fan_out(mysql, fn, inode, (char *) data, size, offset, parts, n, unit);
+    for (i = 0, ret = 0; i < n && ret >= 0; i++)
+        ret = parts[i].ret < 0 ? parts[i].ret : ret + parts[i].ret;
+    return ret;
+}
+
+/**
+ * Write a run of full blocks.  When the filesystem keeps extents, the
+ * aligned runs of extent_blocks in it go to write_extents(), and only the
+ * blocks before and after them to write_full_blocks().
+ *
+ * @return number of bytes written on success; < 0 on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode to write out the data on
+ * @param seq sequence number of the first block
+ * @param data buffer of content to write, count * DATA_BLOCK_SIZE bytes
+ * @param count number of blocks to write
+ */
+static int write_full_run(MYSQL *mysql, long inode, unsigned long seq,
+                          const char *data, unsigned long count)
+{
+    unsigned long head = count, extents = 0;
+    int ret, written = 0;
+
+    if (extent_blocks) {
+        head = MIN(count, (extent_blocks - seq % extent_blocks) % extent_blocks);
+        extents = (count - head) / extent_blocks * extent_blocks;
     }
 
-    /*
-    if (!mysql_stmt_send_long_data(stmt, 0, data, size))
-    {
-        log_printf(" send_long_data failed");
-	goto err_out;
+    if (head) {
+        ret = write_spread(mysql, write_full_part, inode, data, seq, head, write_batch);
+        if (ret < 0)
+            return ret;
+        written += ret;
     }
-    */
-    if (mysql_stmt_execute(stmt)) {
-	log_printf(LOG_ERROR, "mysql_stmt_execute() failed: %s\n", mysql_stmt_error(stmt));
-	goto err_out;
+    if (extents) {
+        ret = write_spread(mysql, write_extents_part, inode, data + written, seq + head,
+                           extents, extent_blocks);
+        if (ret < 0)
+            return ret;
+        written += ret;
+    }
+    if (count > head + extents) {
+        ret = write_spread(mysql, write_full_part, inode, data + written, seq + head + extents,
+                           count - head - extents, write_batch);
+        if (ret < 0)
+            return ret;
+        written += ret;
     }
 
-    if (mysql_stmt_close(stmt))
-	log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
+    return written;
+}
 
-    /* Update file size */
-    snprintf(sql, SQL_MAX,
-	     "UPDATE inodes SET size=("
-	     	"SELECT seq*%d + LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq=("
-			"SELECT MAX(seq) FROM data_blocks WHERE inode=%ld"
-		")"
-	     ") "
-	     "WHERE inode=%ld",
-	     DATA_BLOCK_SIZE, inode, inode, inode);
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-    if(mysql_query(mysql, sql)) {
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+/**
+ * Move an extent back into data_blocks, as blocks of its own, before part
+ * of it is overwritten or cut off, in one transaction (see query_begin()).
+ *
+ * @return 0 on success (or if there is no such extent); < 0 on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of the first block of the extent
+ */
+static int unpack_extent(MYSQL *mysql, long inode, unsigned long seq)
+{
+    MYSQL_BIND params[2], result[1];
+    long long id = inode, first = seq;
+    unsigned long len = 0, bytes = (unsigned long) extent_blocks * DATA_BLOCK_SIZE;
+    my_bool is_null = 0;
+    char *data;
+    int ret;
+
+    if ((data = malloc(bytes)) == NULL)
+        return -ENOMEM;
+    if (query_begin(mysql) < 0) {
+        free(data);
         return -EIO;
     }
 
-    return size;
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &first, NULL);
+    bind_blob(&result[0], data, &len, bytes);
+    result[0].is_null = &is_null;
+    ret = stmt_fetch_one(mysql, STMT_EXTENT_GET, params, result);
+    if (ret == 0 && !is_null)
+        ret = write_full_blocks(mysql, inode, seq, data, MIN(len, bytes) / DATA_BLOCK_SIZE);
+    if (ret >= 0)
+        ret = stmt_update(mysql, STMT_EXTENT_DELETE, params);
+    else if (ret == -ENOENT)
+        ret = 0;
+    free(data);
 
-err_out:
-	log_printf(LOG_ERROR, " %s\n", mysql_stmt_error(stmt));
-	if (mysql_stmt_close(stmt))
-	    log_printf(LOG_ERROR, "failed closing the statement: %s\n", mysql_stmt_error(stmt));
-	return -EIO;
+    if (ret < 0)
+        query_rollback(mysql);
+    else
+        ret = query_commit(mysql);
+
+    log_printf(LOG_D_OTHER, "%s(inode=%ld, seq=%lu): %d\n", __func__, inode, seq, ret);
+    return ret;
+}
+
+/**
+ * Before a write of blocks first to last, move the extents it only partly
+ * covers back into data_blocks, see unpack_extent().  Those can only be
+ * the extents of the first and the last block; one query finds whether
+ * there are any.
+ *
+ * @return 0 on success; < 0 on failure
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param first sequence number of the first block written
+ * @param last sequence number of the last block written
+ * @param full_first first block the write covers in full
+ * @param full_end block after the last one it covers in full
+ */
+static int unpack_extents(MYSQL *mysql, long inode, unsigned long first, unsigned long last,
+                          unsigned long full_first, unsigned long full_end)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[3], result[1];
+    long long id = inode, seqs[2], row_seq;
+    unsigned long found[2];
+    unsigned int i, n = 0;
+    int ret;
+
+    seqs[0] = first - first % extent_blocks;
+    seqs[1] = last - last % extent_blocks;
+    for (i = 0; i < 2; i++)
+        if (seqs[i] >= full_first && seqs[i] + extent_blocks <= full_end)
+            seqs[i] = -1;
+    if (seqs[0] < 0 && seqs[1] < 0)
+        return 0;
+
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &seqs[0], NULL);
+    bind_int(&params[2], &seqs[1], NULL);
+    if ((stmt = stmt_execute(mysql, STMT_EXTENT_FIND, params)) == NULL)
+        return -EIO;
+    bind_int(&result[0], &row_seq, NULL);
+    if (mysql_stmt_bind_result(stmt, result)) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+    while ((ret = mysql_stmt_fetch(stmt)) == 0)
+        if (n < 2)
+            found[n++] = row_seq;
+    if (ret != MYSQL_NO_DATA) {
+        log_printf(LOG_ERROR, "mysql_stmt_error: %s\n", mysql_stmt_error(stmt));
+        mysql_stmt_free_result(stmt);
+        return -EIO;
+    }
+    mysql_stmt_free_result(stmt);
+
+    for (i = 0; i < n; i++)
+        if ((ret = unpack_extent(mysql, inode, found[i])) < 0)
+            return ret;
+
+    return 0;
 }
 
 /**
  * Write a number of bytes (perhaps larger than BLOCK_SIZE) at an offset into
  * a file.  The function does this by writing the first partial block, then
- * writing successive blocks until the full @c size is written.
+ * the full blocks that follow in batches (write_full_blocks()) or, where
+ * they fill aligned runs of extent_blocks, as extents (write_extents()),
+ * then the partial last block, until the full @c size is written.  Extents
+ * the write only partly covers are first turned back into blocks (see
+ * unpack_extents()).  Several batches or extents are spread over up to
+ * mysqlfs_opt::parallel connections (see write_spread()).  A file up to
+ * inline_max bytes keeps its data in its inode row instead (see
+ * write_inline()) until a write takes it further (see inline_spill()).
+ * The size of the file is then raised to the end of the write once, with
+ * size_grow(), and the attribute cache follows.  The whole write holds the
+ * exclusive inode lock, so that no other writer of this mount re-packs or
+ * overwrites a run halfway through.
  *
  * @return < 0 in case of errors (propagating result of write_one_block() )
  * @return > 0 number of bytes written (should equal size parameter)
@@ -884,250 +2904,574 @@ int query_write(MYSQL *mysql, long inode, const char *data, size_t size,
     unsigned long seq;
     const char *ptr;
     int ret, ret_size = 0;
+    struct stat st;
 
     fill_data_blocks_info(&info, size, offset);
 
-    /* Handle first block */
+    seq = info.seq_first;
+    ptr = data;
+
+    /* One writer at a time, from the first statement to the new size */
     lock_inode(mysql, inode);
-    ret = write_one_block(mysql, inode, info.seq_first, data,
-			  info.length_first, info.offset_first);
-    unlock_inode(mysql, inode);
-    if (ret < 0)
-        return ret;
-    ret_size = ret;
 
-    /* Shortcut - if last block seq is the same as first block
-     * seq simply go away as it's the same block */
-    if (info.seq_first == info.seq_last)
-        return ret_size;
+    /* A small file keeps its data in its inode row until a write takes it past inline_max */
+    if (inline_max && size) {
+        if (offset + size <= inline_max)
+            ret = write_inline(mysql, inode, data, size, offset);
+        else
+            ret = inline_spill(mysql, inode);
+        if (ret > 0) {
+            unlock_inode(mysql, inode);
+            st.st_size = offset + size;
+            icache_update(inode, ICACHE_GROW, &st);
+            return ret;
+        }
+        if (ret < 0 && ret != -ENOENT)
+            goto err_out;
+    }
+
+    /* Extents that the write only partly covers go back to blocks first */
+    if (extent_blocks && size) {
+        ret = unpack_extents(mysql, inode, info.seq_first,
+                             info.length_last ? info.seq_last : info.seq_last - 1,
+                             info.seq_first + (info.offset_first != 0 ||
+                                               info.length_first != DATA_BLOCK_SIZE),
+                             info.seq_last);
+        if (ret < 0)
+            goto err_out;
+    }
+
+    /* Handle first block, unless it is a full one */
+    if (info.offset_first != 0 || info.length_first != DATA_BLOCK_SIZE) {
+        ret = write_one_block(mysql, inode, info.seq_first, data,
+                              info.length_first, info.offset_first);
+        if (ret < 0)
+            goto err_out;
+        ret_size = ret;
 
-    ptr = data + info.length_first;
+        /* Shortcut - if last block seq is the same as first block
+         * seq simply go away as it's the same block */
+        if (info.seq_first == info.seq_last)
+            goto out;
 
-    /* Handle all full-sized intermediate blocks */
-    for (seq = info.seq_first + 1; seq < info.seq_last; seq++) {
-        lock_inode(mysql, inode);
-        ret = write_one_block(mysql, inode, seq, ptr, DATA_BLOCK_SIZE, 0);
-        unlock_inode(mysql, inode);
+        ptr += info.length_first;
+        seq++;
+    }
+
+    /* Handle all full-sized blocks, in batches and extents */
+    if (seq < info.seq_last) {
+        ret = write_full_run(mysql, inode, seq, ptr, info.seq_last - seq);
         if (ret < 0)
-            return ret;
-	ptr += DATA_BLOCK_SIZE;
-	ret_size += ret;
+            goto err_out;
+        ptr += ret;
+        ret_size += ret;
     }
 
     /* Handle last block */
-    lock_inode(mysql, inode);
     ret = write_one_block(mysql, inode, info.seq_last, ptr,
 			  info.length_last, 0);
+    if (ret < 0)
+        goto err_out;
+    ret_size += ret;
+
+out:
+    ret = size_grow(mysql, inode, offset, ret_size);
+    unlock_inode(mysql, inode);
+    if (ret < 0) {
+        icache_invalidate(inode);
+        return ret;
+    }
+    st.st_size = offset + ret_size;
+    icache_update(inode, ICACHE_GROW, &st);
+    return ret_size;
+
+err_out:
+    /* What did get written still counts */
+    size_grow(mysql, inode, offset, ret_size);
     unlock_inode(mysql, inode);
+    icache_invalidate(inode);
+    return ret;
+}
+
+/**
+ * Check the size of a file.  Check the value by reading the attribute stored
+ * in the inode table itself.  The function does not summarize the size "live"
+ * by summing the size of each data block; rather this value is updated in
+ * query_fsck(), query_truncate(), query_write().  This trust in the
+ * various write functions optimizes this function's response time and
+ * reduces DB load.
+ *
+ * @return total size of the file at the inode as represented in the inode block
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ */
+ssize_t query_size(MYSQL *mysql, long inode)
+{
+    int ret;
+    MYSQL_BIND params[1];
+    long long id = inode, size;
+    my_bool is_null;
+
+    bind_int(&params[0], &id, NULL);
+
+    ret = stmt_fetch_int(mysql, STMT_SIZE, params, &size, &is_null);
+    if (ret < 0)
+        return -EIO;
+
+    return is_null ? 0 : size;
+}
+
+/**
+ * Returns the size of the given block (inode and sequence number).  Used only by write_one_block(), which is static, so this one can/should be static?
+ *
+ * @return -ENXIO if the inode/seq pair is not found (zero rows returned, implying that block doesn't exist)
+ * @return -EIO if no row is returned (implying an error in the query response, signaled by mysql_fetch_row() returning NULL)
+ * @return 0 if the rown is NULL (implying no result?)
+ * @return 1 - DATA_BLOCK_SIZE (size of the actual block)
+ * @param mysql handle to connection to the database
+ * @param inode inode of the file in question
+ * @param seq sequence number of datablock to check
+ */
+ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
+{
+    int ret;
+    MYSQL_BIND params[2];
+    long long id = inode, block = seq, size;
+    my_bool is_null;
+
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &block, NULL);
+
+    ret = stmt_fetch_int(mysql, STMT_SIZE_BLOCK, params, &size, &is_null);
+    if (ret == -ENOENT)
+        return -ENXIO;
     if (ret < 0)
         return ret;
-    ret_size += ret;
 
-    return ret_size;
+    return is_null ? 0 : size;
+}
+
+/** inode of the directory holding path, with the last component of path in *name */
+static long query_parent(MYSQL *mysql, const char *path, const char **name)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (!slash || !slash[1])
+        return -EINVAL;
+    *name = slash + 1;
+
+    snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int) (slash - path), path);
+    return query_inode(mysql, dir);
+}
+
+/**
+ * Rename a file, replacing the target if it exists.  Called by
+ * mysqlfs_rename(); the parent directories usually come from the dentry
+ * cache, so that all that goes to the server is query_rename_replace().
+ *
+ * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @return -ENOENT if either parent or the file itself is not found
+ *
+ * @see http://linux.die.net/man/2/rename
+ *
+ * @param mysql handle to the database
+ * @param from name of file before the rename
+ * @param to name of file after the rename
+ * @param replaced where to write the inode of the replaced target, 0 if none
+ */
+int query_rename(MYSQL *mysql, const char *from, const char *to, long *replaced)
+{
+    long parent_from, parent_to;
+    const char *old_name, *new_name;
+
+    parent_from = query_parent(mysql, from, &old_name);
+    if (parent_from < 0)
+        return parent_from;
+
+    parent_to = query_parent(mysql, to, &new_name);
+    if (parent_to < 0)
+        return parent_to;
+
+    return query_rename_replace(mysql, parent_from, old_name, parent_to, new_name,
+                                replaced);
 }
 
 /**
- * Check the size of a file.  Check the value by reading the attribute stored
- * in the inode table itself.  The function does not summarize the size "live"
- * by summing the size of each data block; rather this value is updated in
- * query_fsck(), query_truncate(), write_one_block().  This trust in the
- * various write functions optimizes this function's response time and
- * reduces DB load.
+ * Move a directory entry to a new name and/or parent directory, replacing
+ * the entry of that name if there is one, in one call of the mysqlfs_rename
+ * procedure (see schema.sql).  The procedure is a transaction of its own,
+ * so this must not be called between query_begin() and query_commit().  A
+ * replaced inode left without names is only marked deleted: purging its
+ * data is up to the caller, once it is no longer in use.
  *
- * @return total size of the file at the inode as represented in the inode block
- * @param mysql handle to connection to the database
- * @param inode inode of the file in question
+ * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @return -ENOENT if there is no entry old_name in parent_from
+ *
+ * @param mysql handle to the database
+ * @param parent_from inode of the directory currently holding the entry
+ * @param old_name current (relative) name of the entry
+ * @param parent_to inode of the directory to move the entry to
+ * @param new_name new (relative) name of the entry
+ * @param replaced where to write the inode of the replaced target, 0 if none
  */
-ssize_t query_size(MYSQL *mysql, long inode)
+int query_rename_replace(MYSQL *mysql, long parent_from, const char *old_name,
+                         long parent_to, const char *new_name, long *replaced)
 {
-    size_t ret;
     char sql[SQL_MAX];
+    char esc_old[NAME_MAX * 2 + 1], esc_new[NAME_MAX * 2 + 1];
     MYSQL_RES *result;
     MYSQL_ROW row;
+    long inode = -1, target = 0;
+    int ret = 0, status;
 
-    snprintf(sql, SQL_MAX, "SELECT size FROM inodes WHERE inode=%ld",
-             inode);
+    *replaced = 0;
+    if (strlen(old_name) > NAME_MAX || strlen(new_name) > NAME_MAX)
+        return -ENAMETOOLONG;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
+    mysql_real_escape_string(mysql, esc_old, old_name, strlen(old_name));
+    mysql_real_escape_string(mysql, esc_new, new_name, strlen(new_name));
+    snprintf(sql, sizeof(sql), "CALL mysqlfs_rename(%ld, '%s', %ld, '%s')",
+             parent_from, esc_old, parent_to, esc_new);
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (mysql_query(mysql, sql)) {
+        log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
     result = mysql_store_result(mysql);
-    if(!result){
+    if (!result) {
         log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
-    }
-
-    if(mysql_num_rows(result) != 1 || mysql_num_fields(result) != 1){
+        ret = -EIO;
+    } else {
+        row = mysql_fetch_row(result);
+        if (row && row[0]) {
+            inode = atol(row[0]);
+            target = row[1] ? atol(row[1]) : 0;
+        }
         mysql_free_result(result);
-        return -EIO;
     }
 
-    row = mysql_fetch_row(result);
-    if(!row){
-        return -EIO;
+    /* A CALL ends with a status of its own, which must be read before the next query */
+    while ((status = mysql_next_result(mysql)) == 0) {
+        if ((result = mysql_store_result(mysql)) != NULL)
+            mysql_free_result(result);
+    }
+    if (status > 0) {
+        log_printf(LOG_ERROR, "ERROR: mysql_next_result()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        ret = -EIO;
     }
+    if (ret < 0)
+        return ret;
 
-    if(row[0]){
-        ret = atoll(row[0]);
-    }else{
-        ret = 0;
+    if (inode < 0)
+        return -ENOENT;
+
+    /* Both names were links to the same file: rename() does nothing */
+    if (target == inode)
+        return 0;
+
+    if (target) {
+        icache_invalidate(target);
+        *replaced = target;
     }
-    mysql_free_result(result);
+    dcache_add(parent_from, old_name, 0);
+    dcache_add(parent_to, new_name, inode);
 
-    return ret;
+    return 0;
 }
 
 /**
- * Returns the size of the given block (inode and sequence number).  Used only by write_one_block(), which is static, so this one can/should be static?
+ * Start the session of this mount: a row of the sessions table, kept alive
+ * by query_session_beat(), under which query_session_publish() records the
+ * inodes the mount has open.  Sessions whose lease ran out, such as those
+ * of mounts that crashed, are dropped on the way, along with their open
+ * inodes.  See session.c.
  *
- * @return -ENXIO if the inode/seq pair is not found (zero rows returned, implying that block doesn't exist)
- * @return -EIO if no row is returned (implying an error in the query response, signaled by mysql_fetch_row() returning NULL)
- * @return 0 if the rown is NULL (implying no result?)
- * @return 1 - DATA_BLOCK_SIZE (size of the actual block)
- * @param mysql handle to connection to the database
- * @param inode inode of the file in question
- * @param seq sequence number of datablock to check
+ * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @param mysql handle to the database
+ * @param lease seconds the session lives without a query_session_beat()
  */
-ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq)
+int query_session_begin(MYSQL *mysql, unsigned int lease)
 {
-    size_t ret;
-    char sql[SQL_MAX];
-    MYSQL_RES *result;
-    MYSQL_ROW row;
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[3];
+    char host[256];
+    unsigned long host_len;
+    long long pid = getpid(), expires = lease;
 
-    snprintf(sql, SQL_MAX, "SELECT LENGTH(data) FROM data_blocks WHERE inode=%ld AND seq=%lu",
-             inode, seq);
+    if (stmt_update(mysql, STMT_SESSION_EXPIRE, NULL))
+        return -EIO;
+    if (stmt_update(mysql, STMT_SESSION_ORPHANS, NULL))
+        return -EIO;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    if (gethostname(host, sizeof(host)) < 0)
+        host[0] = '\0';
+    host[sizeof(host) - 1] = '\0';
+    host_len = strlen(host);
+
+    bind_str(&params[0], host, &host_len, host_len);
+    bind_int(&params[1], &pid, NULL);
+    bind_int(&params[2], &expires, NULL);
+    if ((stmt = stmt_execute(mysql, STMT_SESSION_INSERT, params)) == NULL)
         return -EIO;
-    }
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    session_id = mysql_stmt_insert_id(stmt);
 
-    result = mysql_store_result(mysql);
-    if(!result){
-        log_printf(LOG_ERROR, "ERROR: mysql_store_result()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    log_printf(LOG_D_OTHER, "%s(): session %ld, host %s, pid %lld\n", __func__,
+               session_id, host, pid);
+    return 0;
+}
+
+/**
+ * Renew the lease of this mount's session.  If the session is gone, because
+ * the lease ran out and another mount dropped it, a new one is started.
+ *
+ * @return 0 if the session was renewed, 1 if it is a new one (whose open
+ *         inodes are still to be published), -EIO on database errors
+ * @param mysql handle to the database
+ * @param lease seconds the session lives from now
+ */
+int query_session_beat(MYSQL *mysql, unsigned int lease)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[2];
+    long long id = session_id, expires = lease;
+    int ret;
+
+    bind_int(&params[0], &expires, NULL);
+    bind_int(&params[1], &id, NULL);
+    if ((stmt = stmt_execute(mysql, STMT_SESSION_BEAT, params)) == NULL)
         return -EIO;
-    }
+    if (mysql_stmt_affected_rows(stmt) > 0)
+        return 0;
 
-    if(mysql_num_rows(result) == 0) {
-        mysql_free_result(result);
-        return -ENXIO;
-    }
+    log_printf(LOG_ERROR, "%s(): session %ld expired\n", __func__, session_id);
+    ret = query_session_begin(mysql, lease);
+    return ret < 0 ? ret : 1;
+}
 
-    row = mysql_fetch_row(result);
-    if(!row){
+/**
+ * Record the inodes open on this mount under its session, in place of
+ * those recorded before, so that other mounts do not purge them.
+ *
+ * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @param mysql handle to the database
+ * @param inodes the open inodes
+ * @param count number of inodes
+ */
+int query_session_publish(MYSQL *mysql, const long *inodes, size_t count)
+{
+    MYSQL_BIND params[1];
+    long long id = session_id;
+    char sql[SQL_MAX];
+    size_t i = 0, first;
+    int len;
+
+    bind_int(&params[0], &id, NULL);
+    if (stmt_update(mysql, STMT_SESSION_CLEAR, params))
         return -EIO;
-    }
 
-    if(row[0]){
-        ret = atoll(row[0]);
-    }else{
-        ret = 0;
+    while (i < count) {
+        len = snprintf(sql, sizeof(sql), "INSERT IGNORE INTO session_inodes (session, inode) VALUES ");
+        for (first = i; i < count && len < SQL_MAX - 64; i++)
+            len += snprintf(sql + len, sizeof(sql) - len, "%s(%ld, %ld)",
+                            i > first ? ", " : "", session_id, inodes[i]);
+
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
+        if (mysql_query(mysql, sql)) {
+            log_printf(LOG_ERROR, "ERROR: mysql_query()\n");
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
     }
-    mysql_free_result(result);
 
-    return ret;
+    return 0;
 }
 
 /**
- * Rename a file.  Called by mysqlfs_rename()
+ * End the session of this mount, with the open inodes recorded under it.
  *
  * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
+ * @param mysql handle to the database
+ */
+int query_session_end(MYSQL *mysql)
+{
+    MYSQL_BIND params[1];
+    long long id = session_id;
+
+    if (!session_id)
+        return 0;
+
+    bind_int(&params[0], &id, NULL);
+    if (stmt_update(mysql, STMT_SESSION_CLEAR, params))
+        return -EIO;
+    if (stmt_update(mysql, STMT_SESSION_DELETE, params))
+        return -EIO;
+
+    session_id = 0;
+    return 0;
+}
+
+/**
+ * Purge inodes from files previously marked deleted (ie query_set_deleted() )
+ * and are no longer in use, here or (see query_session_publish()) on other
+ * mounts, all at once.  Called through reaper_purge(),
+ * when the reaper does not take the inode.  The data goes with the inode
+ * row here, so the drop_data trigger of older schemas has nothing left to
+ * do and may be dropped.
  *
- * @see http://linux.die.net/man/2/rename
- *
+ * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
  * @param mysql handle to the database
- * @param from name of file before the rename
- * @param to name of file after the rename
+ * @param inode inode of the file that is to be marked deleted
  */
-int query_rename(MYSQL *mysql, const char *from, const char *to)
+int query_purge_deleted(MYSQL *mysql, long inode)
 {
-    int ret;
-    long inode, parent_to, parent_from;
-    char *tmp, *new_name, *old_name;
-    char esc_new_name[PATH_MAX * 2], esc_old_name[PATH_MAX * 2];
-    char sql[SQL_MAX];
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[3];
+    long long id = inode, session = session_id;
 
-    inode = query_inode(mysql, from);
+    icache_invalidate(inode);
 
-    /* Lots of strdup()s follow because dirname() & basename()
-     * may modify the original string. */
-    tmp = strdup(from);
-    parent_from = query_inode(mysql, dirname(tmp));
-    free(tmp);
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &id, NULL);
+    bind_int(&params[2], &session, NULL);
 
-    tmp = strdup(from);
-    old_name = basename(tmp);
-    mysql_real_escape_string(mysql, esc_old_name, old_name, strlen(old_name));
-    free(tmp);
+    stmt = stmt_execute(mysql, STMT_PURGE_DELETED, params);
+    if (!stmt)
+        return -EIO;
+    if (mysql_stmt_affected_rows(stmt) < 1)
+        return 0;
 
-    tmp = strdup(to);
-    parent_to = query_inode(mysql, dirname(tmp));
-    free(tmp);
+    /* Its blocks are gone with it */
+    bcache_invalidate(inode, 0, BCACHE_END);
+    if (stmt_update(mysql, STMT_PURGE_DATA, params))
+        return -EIO;
+    if (stmt_update(mysql, STMT_PURGE_DATA_EXTENTS, params))
+        return -EIO;
 
-    tmp = strdup(to);
-    new_name = basename(tmp);
-    mysql_real_escape_string(mysql, esc_new_name, new_name, strlen(new_name));
-    free(tmp);
+    return 0;
+}
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE tree "
-	     "SET name='%s', parent=%ld "
-	     "WHERE inode=%ld AND name='%s' AND parent=%ld ",
-             esc_new_name, parent_to,
-	     inode, esc_old_name, parent_from);
+/**
+ * Purge an inode marked deleted and no longer in use a chunk at a time, so
+ * that the deletion of a large file never holds the tables for long: each
+ * call deletes up to rows of its blocks and extents, and the call that
+ * finds none left drops the inode row.  Called by the reaper thread.
+ *
+ * @return number of rows deleted, 0 once the inode is gone
+ * @return -ENOENT if the inode is not one to purge (any more)
+ * @return -EIO on database errors
+ * @param mysql handle to the database
+ * @param inode inode to purge
+ * @param rows most rows to delete
+ */
+int query_purge_chunk(MYSQL *mysql, long inode, unsigned int rows)
+{
+    MYSQL_STMT *stmt;
+    MYSQL_BIND params[2];
+    long long id = inode, limit = rows, session = session_id, purge;
+    my_bool is_null;
+    my_ulonglong done;
+    int ret;
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    /* A file another mount has open stays */
+    bind_int(&params[0], &session, NULL);
+    bind_int(&params[1], &id, NULL);
+    ret = stmt_fetch_int(mysql, STMT_PURGE_CHECK, params, &purge, &is_null);
+    if (ret < 0)
+        return ret;
+    if (is_null || !purge)
+        return -ENOENT;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    bind_int(&params[0], &id, NULL);
+    bind_int(&params[1], &limit, NULL);
+    if ((stmt = stmt_execute(mysql, STMT_PURGE_BLOCKS, params)) == NULL)
         return -EIO;
+    done = mysql_stmt_affected_rows(stmt);
+
+    if (done < rows) {
+        limit = rows - done;
+        if ((stmt = stmt_execute(mysql, STMT_PURGE_EXTENTS, params)) == NULL)
+            return -EIO;
+        done += mysql_stmt_affected_rows(stmt);
     }
 
-    /*
-    if (mysql_affected_rows(mysql) < 1)
-      return -ETHIS_IS_STRANGE;	/ * Someone deleted the direntry? Do we care? * /
-    */
+    if (done) {
+        bcache_invalidate(inode, 0, BCACHE_END);
+        return done;
+    }
 
-    return 0;
+    return query_purge_deleted(mysql, inode);
+}
+
+/**
+ * Find the inodes left to purge, in order: for the reaper thread to pick up
+ * what an earlier mount left behind.
+ *
+ * @return the first inode above after that is deleted and not in use, 0 if none
+ * @return -EIO on database errors
+ * @param mysql handle to the database
+ * @param after inode to start after
+ */
+long query_next_deleted(MYSQL *mysql, long after)
+{
+    MYSQL_BIND params[1];
+    long long id = after, next;
+    my_bool is_null;
+    int ret;
+
+    bind_int(&params[0], &id, NULL);
+
+    ret = stmt_fetch_int(mysql, STMT_NEXT_DELETED, params, &next, &is_null);
+    if (ret < 0)
+        return ret;
+
+    return is_null ? 0 : next;
 }
 
 /**
- * Mark the file in-use: like a lock-manager, increment the count of users of
- * this file so that deletions at the inode level cannot result in purged data
- * while the file is in-use.
+ * Mark the inode deleted once no directory entry refers to it any more
+ * (inodes.nlink is 0).  This allows files that are still in use to be
+ * deleted without wiping out their underlying data.
  *
  * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
  * @param mysql handle to the database
  * @param inode inode of the file that is to be marked deleted
- * @param increment how many additional "uses" to increment in the file's inode
  */
-int query_inuse_inc(MYSQL *mysql, long inode, int increment)
+int query_set_deleted(MYSQL *mysql, long inode)
 {
-    int ret;
-    char sql[SQL_MAX];
+    MYSQL_BIND params[1];
+    long long id = inode;
 
-    snprintf(sql, SQL_MAX,
-             "UPDATE inodes SET inuse = inuse + %d "
-             "WHERE inode=%lu",
-             increment, inode);
+    bind_int(&params[0], &id, NULL);
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    return stmt_update(mysql, STMT_SET_DELETED, params);
+}
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+/**
+ * Look up a value in the superblock, recording it first if it is not there.
+ *
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to database connection
+ * @param name name of the value
+ * @param value value to record, replaced by the recorded one
+ */
+static int superblock_value(MYSQL *mysql, const char *name, long long *value)
+{
+    MYSQL_BIND params[2];
+    unsigned long name_len = strlen(name);
+    my_bool is_null = 0;
+
+    bind_str(&params[0], name, &name_len, name_len);
+    bind_int(&params[1], value, NULL);
+    if (stmt_update(mysql, STMT_SUPERBLOCK_INIT, params) ||
+        stmt_fetch_int(mysql, STMT_SUPERBLOCK_GET, params, value, &is_null) || is_null) {
+        log_printf(LOG_ERROR, "%s(): cannot read %s from the superblock table; see upgrade.sql\n",
+                   __func__, name);
         return -EIO;
     }
 
@@ -1135,73 +3479,119 @@ int query_inuse_inc(MYSQL *mysql, long inode, int increment)
 }
 
 /**
- * Purge inodes from files previously marked deleted (ie query_set_deleted() )
- * and are no longer in-use.  Called by mysqlfs_unlink() and mysqlfs_release()
+ * Read the layout of the filesystem from its superblock.  A filesystem
+ * without one gets one first: if it was just created, @c block_size (or
+ * DEFAULT_BLOCK_SIZE if 0), extents of EXTENT_BYTES and small files inline
+ * up to @c inline_size (at most a block); if it predates the superblock,
+ * DEFAULT_BLOCK_SIZE, no extents and no inline data.  The block size goes into
+ * DATA_BLOCK_SIZE, and full-block INSERTs are cut down to WRITE_BATCH_BYTES.
+ * Run once at mount time, before any data is read or written.
  *
- * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
- * @param mysql handle to the database
- * @param inode inode of the file that is to be marked deleted
+ * @return 0 on success
+ * @return -EINVAL if the block size is out of range
+ * @return -EIO on failure (eg no superblock table: apply upgrade.sql)
+ * @param mysql handle to database connection
+ * @param block_size block size for a new filesystem, 0 for the default
+ * @param inline_size largest file a new filesystem keeps inline, 0 for none
+ * @param created whether the filesystem was just created
  */
-int query_purge_deleted(MYSQL *mysql, long inode)
+int query_superblock(MYSQL *mysql, unsigned int block_size, unsigned int inline_size,
+                     int created)
 {
-    int ret;
-    char sql[SQL_MAX];
+    long long value = created && block_size ? block_size : DEFAULT_BLOCK_SIZE;
+    unsigned int batch;
 
-    snprintf(sql, SQL_MAX,
-	     "DELETE FROM inodes WHERE inode=%ld AND inuse=0 AND deleted=1",
-             inode);
+    if (value < MIN_BLOCK_SIZE || value > MAX_BLOCK_SIZE || (value & (value - 1))) {
+        log_printf(LOG_ERROR, "%s(): block_size must be a power of two from %u to %u\n",
+                   __func__, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -EINVAL;
+    }
 
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+    if (superblock_value(mysql, "block_size", &value) < 0)
+        return -EIO;
+    if (value < MIN_BLOCK_SIZE || value > MAX_BLOCK_SIZE || (value & (value - 1))) {
+        log_printf(LOG_ERROR, "%s(): bad block size %lld\n", __func__, value);
+        return -EINVAL;
+    }
+    data_block_size = value;
 
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+    if (!created && block_size && block_size != data_block_size)
+        log_printf(LOG_ERROR, "%s(): block_size=%u ignored, the filesystem has %u byte blocks\n",
+                   __func__, block_size, data_block_size);
+
+    value = created && EXTENT_BYTES / data_block_size > 1 ? EXTENT_BYTES / data_block_size : 0;
+    if (superblock_value(mysql, "extent_blocks", &value) < 0)
+        return -EIO;
+    if (value == 1 || value < 0 || value * data_block_size > EXTENT_BYTES) {
+        log_printf(LOG_ERROR, "%s(): bad extent size %lld\n", __func__, value);
+        return -EINVAL;
+    }
+    extent_blocks = value;
+
+    value = created ? MIN(inline_size, MIN(INLINE_MAX, data_block_size)) : 0;
+    if (superblock_value(mysql, "inline_max", &value) < 0)
         return -EIO;
+    if (value < 0 || value > MIN(INLINE_MAX, data_block_size)) {
+        log_printf(LOG_ERROR, "%s(): bad inline size %lld\n", __func__, value);
+        return -EINVAL;
+    }
+    inline_max = value;
+    if (extent_blocks) {
+        extents_sql_build(read_extents_sql, stmt_sql[STMT_READ], 4);
+        stmt_sql[STMT_READ_EXTENTS] = read_extents_sql;
+        extents_sql_build(prefetch_extents_sql, stmt_sql[STMT_PREFETCH], 2);
+        stmt_sql[STMT_PREFETCH_EXTENTS] = prefetch_extents_sql;
+    }
+
+    batch = MAX(1, WRITE_BATCH_BYTES / data_block_size);
+    if (write_batch > batch) {
+        write_batch = batch;
+        upsert_sql_build(upsert_sql, write_batch);
     }
 
+    log_printf(LOG_D_OTHER, "%s(): block size %u, %u blocks per extent, %u bytes inline, %u blocks per INSERT\n",
+               __func__, data_block_size, extent_blocks, inline_max, write_batch);
     return 0;
 }
 
 /**
- * Mark the inode deleted where the name of the tree column is NULL.  This
- * allows files that are still in use to be deleted without wiping out their
- * underlying data.
+ * Find out whether the tables take transactions, ie whether they are
+ * InnoDB (schema-innodb.sql) rather than MyISAM (schema.sql); the data
+ * blocks table speaks for all of them.  Run once at mount time.
  *
- * @return 0 on success; -EIO if the mysql_query() is non-zero (and the error is logged)
- * @param mysql handle to the database
- * @param inode inode of the file that is to be marked deleted
+ * @return 0 on success; -EIO on failure
+ * @param mysql handle to database connection
  */
-int query_set_deleted(MYSQL *mysql, long inode)
+int query_engine(MYSQL *mysql)
 {
-    int ret;
-    char sql[SQL_MAX];
-
-    snprintf(sql, SQL_MAX,
-	     "UPDATE inodes LEFT JOIN tree ON inodes.inode = tree.inode SET inodes.deleted=1 "
-	     "WHERE inodes.inode = %ld AND tree.name IS NULL",
-             inode);
+    const char *sql =
+        "SELECT ENGINE FROM information_schema.TABLES "
+        "WHERE TABLE_SCHEMA=DATABASE() AND TABLE_NAME='data_blocks'";
+    MYSQL_RES *result;
+    MYSQL_ROW row;
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+    if (mysql_query(mysql, sql) || (result = mysql_store_result(mysql)) == NULL) {
         log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
         return -EIO;
     }
 
+    row = mysql_fetch_row(result);
+    transactions = row && row[0] && !strcasecmp(row[0], "InnoDB");
+    mysql_free_result(result);
+
+    log_printf(LOG_D_OTHER, "%s(): transactions %s\n", __func__, transactions ? "on" : "off");
     return 0;
 }
 
 /**
  * Clean filesystem.  Only run in pool_check_mysql_setup() if mysqlfs_opt::fsck == 1
  *
- * -# delete inodes with deleted==1
+ * -# purge inodes with deleted==1 that no other mount has open, data first
  * -# delete direntries without corresponding inode
- * -# set inuse=0 for all inodes
+ * -# set inuse=0 and recount nlink for all inodes
  * -# delete data without existing inode
- * -# synchronize inodes.size=data.LENGTH(data)
+ * -# raise inodes.size to the end of the last data block, or of the inline data
  * -# optimize tables
  *
  * @return return from call to mysql_query()
@@ -1215,23 +3605,22 @@ int query_fsck(MYSQL *mysql)
     */
     printf("Starting fsck\n");
 
-    // 1. delete inodes with deleted==1
+    // 1. purge inodes with deleted==1 a chunk at a time, as the reaper does (see query_purge_chunk())
     int ret;
 //    int ret2;
     int result;
     char sql[SQL_MAX];
+    long deleted = 0;
     printf("Stage 1...\n");
-    snprintf(sql, SQL_MAX,
-             "DELETE from inodes WHERE inodes.deleted = 1");
-
-    log_printf(LOG_D_SQL, "sql=%s\n", sql);
-
-    ret = mysql_query(mysql, sql);
-    if(ret){
-        log_printf(LOG_ERROR, "Error: mysql_query()\n");
-        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
-        return -EIO;
+    while ((deleted = query_next_deleted(mysql, deleted)) > 0) {
+        while ((ret = query_purge_chunk(mysql, deleted, FSCK_PURGE_ROWS)) > 0)
+            ;
+        /* -ENOENT: open on another mount, which purges it on its last close */
+        if (ret < 0 && ret != -ENOENT)
+            return ret;
     }
+    if (deleted < 0)
+        return deleted;
     // 2. - delete direntries without corresponding inode
     printf("Stage 2...\n");
     snprintf(sql, SQL_MAX, "delete from tree where tree.inode not in (select inode from inodes);");
@@ -1247,9 +3636,10 @@ int query_fsck(MYSQL *mysql)
 
 
 
-    // 3. set inuse=0 for all inodes
+    // 3. set inuse=0 and recount nlink for all inodes
     printf("Stage 3...\n");
-    snprintf(sql, SQL_MAX, "UPDATE inodes SET inuse=0;");
+    snprintf(sql, SQL_MAX, "UPDATE inodes SET inuse=0, "
+             "nlink=(SELECT COUNT(inode) FROM tree WHERE tree.inode=inodes.inode);");
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
@@ -1274,13 +3664,45 @@ int query_fsck(MYSQL *mysql)
         return -EIO;
     }
 
+    if (extent_blocks) {
+        snprintf(sql, SQL_MAX, "delete from extents where inode not in (select inode from inodes);");
+
+        log_printf(LOG_D_SQL, "sql=%s\n", sql);
+
+        ret = mysql_query(mysql, sql);
+        if(ret){
+            log_printf(LOG_ERROR, "Error: mysql_query()\n");
+            log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+            return -EIO;
+        }
+    }
+
 
-    // 5. synchronize inodes.size=data.LENGTH(data)
+    // 5. raise inodes.size to the end of the last data block or extent (blocks are no longer than DATA_BLOCK_SIZE, so that is the largest end)
     printf("Stage 5...\n");
     long int inode;
     long int size;
 
-    snprintf(sql, SQL_MAX, "select inode, sum(OCTET_LENGTH(data)) as size from data_blocks group by inode");
+    snprintf(sql, SQL_MAX, "update inodes set size=GREATEST(size, OCTET_LENGTH(inline_data)) where inline_data is not null;");
+
+    log_printf(LOG_D_SQL, "sql=%s\n", sql);
+
+    ret = mysql_query(mysql, sql);
+    if(ret){
+        log_printf(LOG_ERROR, "Error: mysql_query()\n");
+        log_printf(LOG_ERROR, "mysql_error: %s\n", mysql_error(mysql));
+        return -EIO;
+    }
+
+    if (extent_blocks)
+        snprintf(sql, SQL_MAX, "select inode, max(size) from ("
+                 "select inode, seq * %u + OCTET_LENGTH(data) as size from data_blocks union all "
+                 "select inode, seq * %u + OCTET_LENGTH(data) as size from extents"
+                 ") as ends group by inode",
+                 DATA_BLOCK_SIZE, DATA_BLOCK_SIZE);
+    else
+        snprintf(sql, SQL_MAX, "select inode, max(seq * %u + OCTET_LENGTH(data)) as size from data_blocks group by inode",
+                 DATA_BLOCK_SIZE);
 
     log_printf(LOG_D_SQL, "sql=%s\n", sql);
 
@@ -1294,7 +3716,7 @@ int query_fsck(MYSQL *mysql)
      inode = atol(row[0]);
      size = atol(row[1]);
 
-      snprintf(sql, SQL_MAX, "update inodes set size=%ld where inode=%ld;", size, inode);
+      snprintf(sql, SQL_MAX, "update inodes set size=GREATEST(size, %ld) where inode=%ld;", size, inode);
       log_printf(LOG_D_SQL, "sql=%s\n", sql);
       result = mysql_query(mysql, sql);
 
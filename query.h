@@ -25,24 +25,48 @@ struct data_blocks_info {
     off_t		offset_first;	/**< Offset in 1st block.  */
 };
 
+/**
+ * Position of a directory listing, kept in the handle of an open directory
+ * so that a listing continues where the last readdir() stopped instead of
+ * reading the directory from the start again.  Entries come in name order;
+ * each is handed to the filler with the offset that follows it.
+ */
+struct dir_cursor {
+    long		inode;		/**< directory being listed */
+    off_t		base;		/**< filler offset before the first entry from the database */
+    off_t		offset;		/**< filler offset after the last entry returned */
+    char		name[NAME_MAX + 1];	/**< name of that entry, "" if not known */
+};
+
+struct mysqlfs_opt;
+
+int query_init(struct mysqlfs_opt *opt);
 long query_inode(MYSQL *mysql, const char* path);
+long query_nlinks(MYSQL *mysql, long inode);
 int query_inode_full(MYSQL *mysql, const char* path, char *name, size_t name_len,
 		     long *inode, long *parent, long *nlinks);
-int query_getattr(MYSQL *mysql, const char *path, struct stat *stbuf);
+int query_getattr_full(MYSQL *mysql, const char *path, struct stat *stbuf);
+int query_getattr_inode(MYSQL *mysql, long inode, struct stat *stbuf);
+int query_lookup(MYSQL *mysql, long parent, const char *name, struct stat *stbuf);
 int query_mkdirentry(MYSQL *mysql, long inode, const char *name, long parent);
 int query_rmdirentry(MYSQL *mysql, const char *name, long parent);
 long query_mknod(MYSQL *mysql, const char *path, mode_t mode, dev_t rdev,
-                long parent, int alloc_data);
-long query_mkdir(MYSQL *mysql, const char* path, mode_t mode, long parent);
-int query_readdir(MYSQL *mysql, long inode, void *buf, fuse_fill_dir_t filler);
+                long parent, int alloc_data, uid_t uid, gid_t gid);
+long query_mkdir(MYSQL *mysql, const char* path, mode_t mode, long parent,
+                 uid_t uid, gid_t gid);
+int query_readdir(MYSQL *mysql, struct dir_cursor *cur, void *buf,
+                  fuse_fill_dir_t filler, int plus);
 int query_read(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
+int query_prefetch(MYSQL *mysql, long inode, unsigned long first, unsigned long last);
 int query_write(MYSQL *mysql, long inode, const char* buf, size_t size, off_t offset);
-int query_truncate(MYSQL *mysql, const char *path, off_t length);
+int query_truncate(MYSQL *mysql, long inode, off_t length);
 
 int query_symlink(MYSQL *mysql, const char* from, const char* to);	/**< NOT IMPLEMENTED NOR CALLED */
 int query_readlink(MYSQL *mysql, const char* path);			/**< NOT IMPLEMENTED NOR CALLED */
 
-int query_rename(MYSQL *mysql, const char* from, const char* to);
+int query_rename(MYSQL *mysql, const char* from, const char* to, long *replaced);
+int query_rename_replace(MYSQL *mysql, long parent_from, const char *old_name,
+                         long parent_to, const char *new_name, long *replaced);
 
 int query_chmod(MYSQL *mysql, long inode, mode_t mode);
 int query_chown(MYSQL *mysql, long inode, uid_t uid, gid_t gid);
@@ -51,8 +75,20 @@ int query_utime(MYSQL *mysql, long inode, struct utimbuf *time);
 ssize_t query_size(MYSQL *mysql, long inode);
 ssize_t query_size_block(MYSQL *mysql, long inode, unsigned long seq);
 
-int query_inuse_inc(MYSQL *mysql, long inode, int increment);
+int query_session_begin(MYSQL *mysql, unsigned int lease);
+int query_session_beat(MYSQL *mysql, unsigned int lease);
+int query_session_publish(MYSQL *mysql, const long *inodes, size_t count);
+int query_session_end(MYSQL *mysql);
 int query_set_deleted(MYSQL *mysql, long inode);
 int query_purge_deleted(MYSQL *mysql, long inode);
+int query_purge_chunk(MYSQL *mysql, long inode, unsigned int rows);
+long query_next_deleted(MYSQL *mysql, long after);
+
+int query_superblock(MYSQL *mysql, unsigned int block_size, unsigned int inline_size,
+                     int created);
+int query_engine(MYSQL *mysql);
 
+int query_begin(MYSQL *mysql);
+int query_commit(MYSQL *mysql);
+void query_rollback(MYSQL *mysql);
 int query_fsck(MYSQL *mysql);
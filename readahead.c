@@ -0,0 +1,184 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse/fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "log.h"
+
+/** ranges waiting for a thread; past this, new ones are dropped */
+#define READAHEAD_QUEUE	256
+
+/** A range of blocks to load into the block cache */
+struct readahead_req {
+    long		inode;
+    unsigned long	first;		/**< first block */
+    unsigned long	last;		/**< last block, inclusive */
+};
+
+static struct readahead_req queue[READAHEAD_QUEUE];
+static unsigned int queue_head = 0;
+static unsigned int queue_len = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t *threads = NULL;
+static unsigned int nr_threads = 0;
+/** threads are started by the first readahead_queue(), after FUSE has daemonized */
+static unsigned int started = 0;
+static int stopping = 0;
+
+static size_t window_max = 0;
+static unsigned long queued = 0, dropped = 0;
+
+/** a read-ahead thread: load queued ranges on a connection of its own */
+static void *readahead_thread(void *arg)
+{
+    struct readahead_req req;
+    MYSQL *mysql;
+    int ret;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!queue_len && !stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping)
+            break;
+
+        req = queue[queue_head];
+        queue_head = (queue_head + 1) % READAHEAD_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if ((mysql = pool_get()) != NULL) {
+            ret = query_prefetch(mysql, req.inode, req.first, req.last);
+            pool_put(mysql);
+            log_printf(LOG_D_OTHER, "%s(inode=%ld): blocks %lu-%lu: %d\n", __func__,
+                       req.inode, req.first, req.last, ret);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return NULL;
+}
+
+int readahead_init(struct mysqlfs_opt *opt)
+{
+    size_t cache = (size_t) opt->block_cache * 1024;
+
+    window_max = (size_t) opt->readahead * 1024;
+    nr_threads = opt->readahead_threads;
+
+    /* What is read ahead waits in the block cache; leave room for the rest */
+    if (!bcache_enabled() || !nr_threads)
+        window_max = 0;
+    if (window_max > cache / 4)
+        window_max = cache / 4;
+    if (window_max < DATA_BLOCK_SIZE)
+        window_max = 0;
+
+    log_printf(LOG_D_OTHER, "%s(): window=%zu threads=%u\n", __func__,
+               window_max, nr_threads);
+    return 0;
+}
+
+void readahead_cleanup()
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    threads = NULL;
+    started = 0;
+    window_max = 0;
+}
+
+size_t readahead_window()
+{
+    return window_max;
+}
+
+void readahead_queue(long inode, off_t offset, size_t size)
+{
+    struct readahead_req *req;
+
+    if (!window_max || !size)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+
+    if (!threads && !stopping) {
+        if ((threads = calloc(nr_threads, sizeof(pthread_t))) == NULL)
+            window_max = 0;
+        for (; threads && started < nr_threads; started++) {
+            if (pthread_create(&threads[started], NULL, readahead_thread, NULL)) {
+                log_printf(LOG_ERROR, "%s(): pthread_create: %s\n", __func__, strerror(errno));
+                break;
+            }
+        }
+        if (!started)
+            window_max = 0;
+    }
+
+    if (!started || stopping) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+
+    if (queue_len == READAHEAD_QUEUE) {
+        dropped++;
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+
+    req = &queue[(queue_head + queue_len) % READAHEAD_QUEUE];
+    req->inode = inode;
+    req->first = offset / DATA_BLOCK_SIZE;
+    req->last = (offset + size - 1) / DATA_BLOCK_SIZE;
+    queue_len++;
+    queued++;
+    pthread_cond_signal(&queue_cond);
+
+    pthread_mutex_unlock(&queue_lock);
+}
+
+void readahead_stats(unsigned long *q, unsigned long *d)
+{
+    pthread_mutex_lock(&queue_lock);
+    *q = queued;
+    *d = dropped;
+    pthread_mutex_unlock(&queue_lock);
+}
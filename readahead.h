@@ -0,0 +1,26 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+struct mysqlfs_opt;
+
+/** Set up read-ahead; needs the block cache, so call after bcache_init() */
+int readahead_init(struct mysqlfs_opt *opt);
+
+/** Stop the read-ahead threads; call before pool_cleanup() */
+void readahead_cleanup();
+
+/** Largest read-ahead window in bytes, 0 if read-ahead is disabled */
+size_t readahead_window();
+
+/** Have a background thread load size bytes at offset of a file into the block cache */
+void readahead_queue(long inode, off_t offset, size_t size);
+
+/** Ranges queued and dropped (queue full) so far, for the status file */
+void readahead_stats(unsigned long *queued, unsigned long *dropped);
@@ -0,0 +1,245 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse/fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "file.h"
+#include "reaper.h"
+#include "log.h"
+
+/** inodes waiting for the reaper; past this, callers purge on their own */
+#define REAPER_QUEUE	1024
+
+/**
+ * Deleted inodes are purged by one background thread, a chunk of
+ * reap_rows rows at a time with reap_delay milliseconds in between, so
+ * that unlink() and close() return at once and removing a large file
+ * neither blocks its caller nor holds the tables for long.
+ */
+static long queue[REAPER_QUEUE];
+static unsigned int queue_head = 0;
+static unsigned int queue_len = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+/** signalled only to stop the reaper, so that new inodes do not cut a pause short */
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t thread;
+/** the thread is started by reaper_start() or the first reaper_purge(), after FUSE has daemonized */
+static int started = 0;
+static int stopping = 0;
+
+static unsigned int chunk_rows = 0;
+static unsigned int delay_ms = 0;
+/** whether to look for inodes left by earlier mounts, see reaper_init() */
+static int sweep = 0;
+static unsigned long purged = 0, deleted_rows = 0;
+
+static int reaper_stopping()
+{
+    int ret;
+
+    pthread_mutex_lock(&queue_lock);
+    ret = stopping;
+    pthread_mutex_unlock(&queue_lock);
+
+    return ret;
+}
+
+/** sleep between chunks; returns early when the reaper is stopped */
+static void reaper_pause()
+{
+    struct timespec until;
+
+    if (!delay_ms)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += delay_ms / 1000;
+    until.tv_nsec += (delay_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    if (!stopping)
+        pthread_cond_timedwait(&stop_cond, &queue_lock, &until);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/** purge one inode, chunk by chunk; returns 1 if the reaper was stopped before it was done */
+static int reap(MYSQL *mysql, long inode)
+{
+    int ret;
+
+    for (;;) {
+        /* opened here by a call that raced the unlink: its last close brings it back */
+        if (file_mark_deleted(inode))
+            ret = -ENOENT;
+        else
+            ret = query_purge_chunk(mysql, inode, chunk_rows);
+
+        pthread_mutex_lock(&queue_lock);
+        if (ret > 0)
+            deleted_rows += ret;
+        else if (ret == 0)
+            purged++;
+        pthread_mutex_unlock(&queue_lock);
+
+        if (ret <= 0)
+            break;
+        if (reaper_stopping())
+            return 1;
+        reaper_pause();
+    }
+
+    if (ret < 0 && ret != -ENOENT)
+        log_printf(LOG_ERROR, "%s(inode=%ld): %s\n", __func__, inode, strerror(-ret));
+    else
+        log_printf(LOG_D_OTHER, "%s(inode=%ld): %s\n", __func__, inode,
+                   ret ? "not deleted" : "purged");
+    return 0;
+}
+
+/** the reaper thread: first what earlier mounts left behind, then the queue */
+static void *reaper_thread(void *arg)
+{
+    MYSQL *mysql;
+    long inode = 0;
+
+    if (sweep && (mysql = pool_get()) != NULL) {
+        while (!reaper_stopping() && (inode = query_next_deleted(mysql, inode)) > 0)
+            if (reap(mysql, inode))
+                break;
+        pool_put(mysql);
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!queue_len && !stopping)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        if (stopping)
+            break;
+
+        inode = queue[queue_head];
+        queue_head = (queue_head + 1) % REAPER_QUEUE;
+        queue_len--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if ((mysql = pool_get()) != NULL) {
+            reap(mysql, inode);
+            pool_put(mysql);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return NULL;
+}
+
+int reaper_init(struct mysqlfs_opt *opt)
+{
+    chunk_rows = opt->reap_rows;
+    delay_ms = opt->reap_delay;
+
+    /* The kernel may still refer to an unlinked inode of a lowlevel mount
+     * by number; only reaper_purge() knows when it has let go */
+    sweep = !opt->lowlevel;
+
+    log_printf(LOG_D_OTHER, "%s(): rows=%u delay=%u ms\n", __func__,
+               chunk_rows, delay_ms);
+    return 0;
+}
+
+void reaper_cleanup()
+{
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_cond_broadcast(&stop_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    if (started)
+        pthread_join(thread, NULL);
+    started = 0;
+    chunk_rows = 0;
+}
+
+/** start the thread, with queue_lock held, unless it runs already or purging is not in the background */
+static void start_locked()
+{
+    if (!chunk_rows || started || stopping)
+        return;
+
+    if (pthread_create(&thread, NULL, reaper_thread, NULL)) {
+        log_printf(LOG_ERROR, "%s(): pthread_create: %s\n", __func__, strerror(errno));
+        chunk_rows = 0;
+    } else
+        started = 1;
+}
+
+void reaper_start()
+{
+    pthread_mutex_lock(&queue_lock);
+    start_locked();
+    pthread_mutex_unlock(&queue_lock);
+}
+
+int reaper_purge(MYSQL *mysql, long inode)
+{
+    /* Open here: the last close brings it back */
+    if (file_mark_deleted(inode))
+        return 0;
+
+    pthread_mutex_lock(&queue_lock);
+
+    start_locked();
+
+    if (!started || stopping || queue_len == REAPER_QUEUE) {
+        pthread_mutex_unlock(&queue_lock);
+        return query_purge_deleted(mysql, inode);
+    }
+
+    queue[(queue_head + queue_len) % REAPER_QUEUE] = inode;
+    queue_len++;
+    pthread_cond_signal(&queue_cond);
+
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+void reaper_stats(unsigned long *pending, unsigned long *inodes, unsigned long *rows)
+{
+    pthread_mutex_lock(&queue_lock);
+    *pending = queue_len;
+    *inodes = purged;
+    *rows = deleted_rows;
+    pthread_mutex_unlock(&queue_lock);
+}
@@ -0,0 +1,26 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+struct mysqlfs_opt;
+
+/** Set up the reaper; a zero mysqlfs_opt::reap_rows leaves purging to the callers of reaper_purge() */
+int reaper_init(struct mysqlfs_opt *opt);
+
+/** Start the reaper thread, and with it the sweep, once FUSE has daemonized; else the first reaper_purge() does */
+void reaper_start();
+
+/** Stop the reaper thread, leaving what is still queued to the next mount; call before pool_cleanup() */
+void reaper_cleanup();
+
+/** Purge an inode if it is deleted and no longer in use: in the background if the reaper takes it, or right away on mysql; if this mount has it open, its last close does */
+int reaper_purge(MYSQL *mysql, long inode);
+
+/** Inodes waiting for the reaper, inodes it has purged and rows it has deleted so far, for the status file */
+void reaper_stats(unsigned long *pending, unsigned long *inodes, unsigned long *rows);
@@ -0,0 +1,157 @@
+-- The tables of schema.sql as InnoDB: rows are locked instead of whole
+-- tables, so writers of different files do not wait on each other, and
+-- operations of several statements are transactions.
+-- as root: mysql -u root -p mysqlfs < schema-innodb.sql
+--
+-- MySQL dump 10.10
+--
+-- Host: localhost    Database: mysqlfs
+-- ------------------------------------------------------
+-- Server version	5.0.22-Debian_0ubuntu6.06.2
+
+/*!40101 SET @OLD_CHARACTER_SET_CLIENT=@@CHARACTER_SET_CLIENT */;
+/*!40101 SET @OLD_CHARACTER_SET_RESULTS=@@CHARACTER_SET_RESULTS */;
+/*!40101 SET @OLD_COLLATION_CONNECTION=@@COLLATION_CONNECTION */;
+/*!40101 SET NAMES utf8 */;
+/*!40103 SET @OLD_TIME_ZONE=@@TIME_ZONE */;
+/*!40103 SET TIME_ZONE='+00:00' */;
+/*!40014 SET @OLD_UNIQUE_CHECKS=@@UNIQUE_CHECKS, UNIQUE_CHECKS=0 */;
+/*!40014 SET @OLD_FOREIGN_KEY_CHECKS=@@FOREIGN_KEY_CHECKS, FOREIGN_KEY_CHECKS=0 */;
+/*!40101 SET @OLD_SQL_MODE=@@SQL_MODE, SQL_MODE='NO_AUTO_VALUE_ON_ZERO' */;
+/*!40111 SET @OLD_SQL_NOTES=@@SQL_NOTES, SQL_NOTES=0 */;
+
+--
+-- Table structure for table `data`
+--
+
+DROP TABLE IF EXISTS `data_blocks`;
+CREATE TABLE `data_blocks` (
+  `inode` bigint(20) NOT NULL,
+  `seq` int unsigned not null,
+  `data` mediumblob ,
+  PRIMARY KEY  (`inode`, `seq`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `extents`
+--
+
+DROP TABLE IF EXISTS `extents`;
+CREATE TABLE `extents` (
+  `inode` bigint(20) NOT NULL,
+  `seq` int unsigned not null,
+  `data` mediumblob ,
+  PRIMARY KEY  (`inode`, `seq`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `inodes`
+--
+
+DROP TABLE IF EXISTS `inodes`;
+CREATE TABLE `inodes` (
+  `inode` bigint(20) NOT NULL,
+  `inuse` int(11) NOT NULL default '0',
+  `deleted` tinyint(4) NOT NULL default '0',
+  `mode` int(11) NOT NULL default '0',
+  `uid` int(10) unsigned NOT NULL default '0',
+  `gid` int(10) unsigned NOT NULL default '0',
+  `atime` int(10) unsigned NOT NULL default '0',
+  `mtime` int(10) unsigned NOT NULL default '0',
+  `ctime` int(10) unsigned NOT NULL default '0',
+  `size` bigint(20) NOT NULL default '0',
+  `nlink` int(10) unsigned NOT NULL default '0',
+  `inline_data` varbinary(4096) default NULL,
+  PRIMARY KEY  (`inode`),
+  KEY `inode` (`inode`,`inuse`,`deleted`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `tree`
+--
+
+DROP TABLE IF EXISTS `tree`;
+CREATE TABLE `tree` (
+  `inode` int(10) unsigned NOT NULL auto_increment,
+  `parent` int(10) unsigned default NULL,
+  `name` varchar(255) NOT NULL,
+  UNIQUE KEY `name` (`name`,`parent`),
+  KEY `inode` (`inode`),
+  KEY `parent` (`parent`,`name`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+--
+-- Table structure for table `superblock`
+--
+
+DROP TABLE IF EXISTS `superblock`;
+CREATE TABLE `superblock` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `sessions`
+--
+
+DROP TABLE IF EXISTS `sessions`;
+CREATE TABLE `sessions` (
+  `id` bigint(20) NOT NULL auto_increment,
+  `host` varchar(255) NOT NULL default '',
+  `pid` int(10) unsigned NOT NULL default '0',
+  `expires` int(10) unsigned NOT NULL default '0',
+  PRIMARY KEY  (`id`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `session_inodes`
+--
+
+DROP TABLE IF EXISTS `session_inodes`;
+CREATE TABLE `session_inodes` (
+  `session` bigint(20) NOT NULL,
+  `inode` bigint(20) NOT NULL,
+  PRIMARY KEY  (`session`,`inode`),
+  KEY `inode` (`inode`)
+) ENGINE=InnoDB DEFAULT CHARSET=binary;
+
+--
+-- Procedure `mysqlfs_rename`: rename() in one round trip.  Moves an entry,
+-- replacing the target; a replaced inode left without names is marked
+-- deleted for the caller to purge.  Returns the inodes of the source (NULL
+-- if missing) and of the replaced target (NULL if none).
+--
+
+DROP PROCEDURE IF EXISTS `mysqlfs_rename`;
+DELIMITER ;;
+CREATE PROCEDURE `mysqlfs_rename`(IN from_parent bigint, IN from_name varchar(255), IN to_parent bigint, IN to_name varchar(255))
+  MODIFIES SQL DATA
+BEGIN
+  DECLARE src, dst bigint DEFAULT NULL;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  SET src = (SELECT inode FROM tree WHERE parent=from_parent AND name=from_name);
+  SET dst = (SELECT inode FROM tree WHERE parent=to_parent AND name=to_name);
+  IF src IS NOT NULL AND (dst IS NULL OR dst <> src) THEN
+    IF dst IS NOT NULL THEN
+      DELETE FROM tree WHERE parent=to_parent AND name=to_name;
+      UPDATE inodes SET nlink = nlink - 1, deleted = IF(nlink = 0, 1, deleted) WHERE inode=dst;
+    END IF;
+    UPDATE tree SET parent=to_parent, name=to_name WHERE parent=from_parent AND name=from_name;
+  END IF;
+  COMMIT;
+  SELECT src, dst;
+END;;
+DELIMITER ;
+
+/*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;
+
+/*!40101 SET SQL_MODE=@OLD_SQL_MODE */;
+/*!40014 SET FOREIGN_KEY_CHECKS=@OLD_FOREIGN_KEY_CHECKS */;
+/*!40014 SET UNIQUE_CHECKS=@OLD_UNIQUE_CHECKS */;
+/*!40101 SET CHARACTER_SET_CLIENT=@OLD_CHARACTER_SET_CLIENT */;
+/*!40101 SET CHARACTER_SET_RESULTS=@OLD_CHARACTER_SET_RESULTS */;
+/*!40101 SET COLLATION_CONNECTION=@OLD_COLLATION_CONNECTION */;
+/*!40111 SET SQL_NOTES=@OLD_SQL_NOTES */;
+
@@ -23,7 +23,19 @@ DROP TABLE IF EXISTS `data_blocks`;
 CREATE TABLE `data_blocks` (
   `inode` bigint(20) NOT NULL,
   `seq` int unsigned not null,
-  `data` blob ,
+  `data` mediumblob ,
+  PRIMARY KEY  (`inode`, `seq`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `extents`
+--
+
+DROP TABLE IF EXISTS `extents`;
+CREATE TABLE `extents` (
+  `inode` bigint(20) NOT NULL,
+  `seq` int unsigned not null,
+  `data` mediumblob ,
   PRIMARY KEY  (`inode`, `seq`)
 ) ENGINE=MyISAM DEFAULT CHARSET=binary;
 
@@ -43,18 +55,12 @@ CREATE TABLE `inodes` (
   `mtime` int(10) unsigned NOT NULL default '0',
   `ctime` int(10) unsigned NOT NULL default '0',
   `size` bigint(20) NOT NULL default '0',
+  `nlink` int(10) unsigned NOT NULL default '0',
+  `inline_data` varbinary(4096) default NULL,
   PRIMARY KEY  (`inode`),
   KEY `inode` (`inode`,`inuse`,`deleted`)
 ) ENGINE=MyISAM DEFAULT CHARSET=binary;
 
-/*!50003 SET @OLD_SQL_MODE=@@SQL_MODE*/;
-DELIMITER ;;
-/*!50003 SET SESSION SQL_MODE="" */;;
-/*!50003 CREATE */ /*!50017 DEFINER=`root`@`localhost` */ /*!50003 TRIGGER `drop_data` AFTER DELETE ON `inodes` FOR EACH ROW BEGIN DELETE FROM data_blocks WHERE inode=OLD.inode; END */;;
-
-DELIMITER ;
-/*!50003 SET SESSION SQL_MODE=@OLD_SQL_MODE */;
-
 --
 -- Table structure for table `tree`
 --
@@ -66,8 +72,74 @@ CREATE TABLE `tree` (
   `name` varchar(255) NOT NULL,
   UNIQUE KEY `name` (`name`,`parent`),
   KEY `inode` (`inode`),
-  KEY `parent` (`parent`)
+  KEY `parent` (`parent`,`name`)
 ) ENGINE=MyISAM DEFAULT CHARSET=utf8;
+
+--
+-- Table structure for table `superblock`
+--
+
+DROP TABLE IF EXISTS `superblock`;
+CREATE TABLE `superblock` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `sessions`
+--
+
+DROP TABLE IF EXISTS `sessions`;
+CREATE TABLE `sessions` (
+  `id` bigint(20) NOT NULL auto_increment,
+  `host` varchar(255) NOT NULL default '',
+  `pid` int(10) unsigned NOT NULL default '0',
+  `expires` int(10) unsigned NOT NULL default '0',
+  PRIMARY KEY  (`id`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+
+--
+-- Table structure for table `session_inodes`
+--
+
+DROP TABLE IF EXISTS `session_inodes`;
+CREATE TABLE `session_inodes` (
+  `session` bigint(20) NOT NULL,
+  `inode` bigint(20) NOT NULL,
+  PRIMARY KEY  (`session`,`inode`),
+  KEY `inode` (`inode`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+
+--
+-- Procedure `mysqlfs_rename`: rename() in one round trip.  Moves an entry,
+-- replacing the target; a replaced inode left without names is marked
+-- deleted for the caller to purge.  Returns the inodes of the source (NULL
+-- if missing) and of the replaced target (NULL if none).
+--
+
+DROP PROCEDURE IF EXISTS `mysqlfs_rename`;
+DELIMITER ;;
+CREATE PROCEDURE `mysqlfs_rename`(IN from_parent bigint, IN from_name varchar(255), IN to_parent bigint, IN to_name varchar(255))
+  MODIFIES SQL DATA
+BEGIN
+  DECLARE src, dst bigint DEFAULT NULL;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  SET src = (SELECT inode FROM tree WHERE parent=from_parent AND name=from_name);
+  SET dst = (SELECT inode FROM tree WHERE parent=to_parent AND name=to_name);
+  IF src IS NOT NULL AND (dst IS NULL OR dst <> src) THEN
+    IF dst IS NOT NULL THEN
+      DELETE FROM tree WHERE parent=to_parent AND name=to_name;
+      UPDATE inodes SET nlink = nlink - 1, deleted = IF(nlink = 0, 1, deleted) WHERE inode=dst;
+    END IF;
+    UPDATE tree SET parent=to_parent, name=to_name WHERE parent=from_parent AND name=from_name;
+  END IF;
+  COMMIT;
+  SELECT src, dst;
+END;;
+DELIMITER ;
+
 /*!40103 SET TIME_ZONE=@OLD_TIME_ZONE */;
 
 /*!40101 SET SQL_MODE=@OLD_SQL_MODE */;
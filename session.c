@@ -0,0 +1,213 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fuse/fuse.h>
+#ifdef HAVE_MYSQL_MYSQL_H
+#include <mysql/mysql.h>
+#endif
+#ifdef HAVE_MYSQL_H
+#include <mysql.h>
+#endif
+
+#include "mysqlfs.h"
+#include "query.h"
+#include "pool.h"
+#include "file.h"
+#include "reaper.h"
+#include "session.h"
+#include "log.h"
+
+/**
+ * Open files are counted in the open-file table of file.c, not in the
+ * database, so that open() and close() cost no writes.  What other mounts
+ * need to know, that a file deleted there is still open here, is published
+ * by this thread instead: every third of the lease it renews the session
+ * of this mount and, if the set of open inodes has changed, records it
+ * under the session.  A file opened here is protected from the purges of
+ * other mounts from the next round on.  If the mount dies, its session
+ * runs out and the next mount to start drops it.
+ */
+static pthread_mutex_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+/** the thread is started by the first session_opened(), after FUSE has daemonized */
+static int started = 0;
+static int stopping = 0;
+static unsigned int lease = 0;
+/** whether closed inodes are left to forget, see session_init() */
+static int lowlevel = 0;
+
+/** inodes recorded under the session by the last round */
+static long *published = NULL;
+static size_t nr_published = 0;
+
+static int cmp_inode(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** the inodes open now, sorted, in a new array; NULL if out of memory */
+static long *open_inodes(size_t *count)
+{
+    long *inodes = NULL, *p;
+    size_t n = 0, max = 0;
+
+    /* more may have been opened between two looks */
+    while ((n = file_open_inodes(inodes, max)) > max) {
+        max = n + 16;
+        if ((p = realloc(inodes, max * sizeof(long))) == NULL) {
+            free(inodes);
+            return NULL;
+        }
+        inodes = p;
+    }
+    if (!inodes && (inodes = malloc(sizeof(long))) == NULL)
+        return NULL;
+
+    qsort(inodes, n, sizeof(long), cmp_inode);
+    *count = n;
+    return inodes;
+}
+
+/**
+ * Record the open inodes, if they changed; the inodes closed since the last
+ * round go to the reaper, in case another mount deleted them meanwhile.
+ * On a lowlevel mount they are not, as the kernel may still hold them.
+ */
+static void publish(MYSQL *mysql)
+{
+    long *inodes;
+    size_t n, i, j;
+
+    if ((inodes = open_inodes(&n)) == NULL)
+        return;
+
+    if (query_session_publish(mysql, inodes, n) < 0) {
+        free(inodes);
+        return;
+    }
+
+    for (i = j = 0; !lowlevel && i < nr_published; i++) {
+        while (j < n && inodes[j] < published[i])
+            j++;
+        if (j == n || inodes[j] != published[i])
+            reaper_purge(mysql, published[i]);
+    }
+
+    free(published);
+    published = inodes;
+    nr_published = n;
+}
+
+static void *session_thread(void *arg)
+{
+    struct timespec until;
+    unsigned long gen, seen = 0;
+    MYSQL *mysql;
+    int ret;
+
+    pthread_mutex_lock(&session_lock);
+    while (!stopping) {
+        pthread_mutex_unlock(&session_lock);
+
+        gen = file_open_generation();
+        if ((mysql = pool_get()) != NULL) {
+            /* a mount with nothing open has nothing to protect, and writes nothing */
+            ret = (nr_published || gen != seen) ? query_session_beat(mysql, lease) : 0;
+            if (ret > 0 || (ret == 0 && gen != seen)) {
+                publish(mysql);
+                seen = gen;
+            }
+            pool_put(mysql);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += lease / 3 ? lease / 3 : 1;
+
+        pthread_mutex_lock(&session_lock);
+        if (!stopping)
+            pthread_cond_timedwait(&session_cond, &session_lock, &until);
+    }
+    pthread_mutex_unlock(&session_lock);
+
+    return NULL;
+}
+
+int session_init(struct mysqlfs_opt *opt)
+{
+    MYSQL *mysql;
+    int ret;
+
+    lease = opt->lease;
+    /* The kernel may still refer to a closed inode of a lowlevel mount by
+     * number; forget hands it to the reaper, as for reaper_init() */
+    lowlevel = opt->lowlevel;
+    if (!lease)
+        return 0;
+
+    if ((mysql = pool_get()) == NULL)
+        return -EMFILE;
+    ret = query_session_begin(mysql, lease);
+    pool_put(mysql);
+
+    if (ret < 0)
+        lease = 0;
+    return ret;
+}
+
+void session_cleanup()
+{
+    MYSQL *mysql;
+
+    pthread_mutex_lock(&session_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&session_cond);
+    pthread_mutex_unlock(&session_lock);
+
+    if (started)
+        pthread_join(thread, NULL);
+    started = 0;
+
+    if (lease && (mysql = pool_get()) != NULL) {
+        query_session_end(mysql);
+        pool_put(mysql);
+    }
+
+    free(published);
+    published = NULL;
+    nr_published = 0;
+    lease = 0;
+}
+
+void session_opened()
+{
+    if (!lease)
+        return;
+
+    pthread_mutex_lock(&session_lock);
+    if (!started && !stopping) {
+        if (pthread_create(&thread, NULL, session_thread, NULL))
+            log_printf(LOG_ERROR, "%s(): pthread_create: %s\n", __func__, strerror(errno));
+        else
+            started = 1;
+    }
+    pthread_mutex_unlock(&session_lock);
+}
@@ -0,0 +1,20 @@
+/*
+  mysqlfs - MySQL Filesystem
+  $Id$
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+/** @file */
+
+struct mysqlfs_opt;
+
+/** Start the session of this mount in the database; a zero mysqlfs_opt::lease goes without one */
+int session_init(struct mysqlfs_opt *opt);
+
+/** Stop the session thread and end the session; call before pool_cleanup() */
+void session_cleanup();
+
+/** Call on each open: starts the thread that keeps the session alive, the first time */
+void session_opened();
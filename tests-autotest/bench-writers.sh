@@ -0,0 +1,36 @@
+#!/bin/sh
+# $Id$
+#
+# Throughput of concurrent writers on a mounted mysqlfs: each writer
+# writes a file of its own, a block at a time, and the total rate is
+# printed.  Mount with -owrite_buffer=0 so that every write goes to the
+# database, then run it against a database made with schema.sql (MyISAM)
+# and one made with schema-innodb.sql to compare the two.
+#
+# usage: bench-writers.sh <mountpoint> [writers [MiB each [block bytes]]]
+
+mnt=${1:?usage: $0 <mountpoint> [writers [MiB each [block bytes]]]}
+writers=${2:-32}
+mib=${3:-4}
+bs=${4:-4096}
+count=$((mib * 1048576 / bs))
+
+dir=$mnt/bench-writers.$$
+mkdir "$dir" || exit 1
+
+start=$(date +%s.%N)
+i=0
+while [ $i -lt $writers ]; do
+    dd if=/dev/zero bs=$bs count=$count 2>/dev/null | tr '\0' 'x' |
+        dd of="$dir/w$i" bs=$bs iflag=fullblock 2>/dev/null &
+    i=$((i + 1))
+done
+wait
+end=$(date +%s.%N)
+
+rm -rf "$dir"
+
+awk -v w=$writers -v m=$mib -v s=$start -v e=$end 'BEGIN {
+    t = e - s
+    printf "%d writers x %d MiB: %.2f s, %.2f MiB/s\n", w, m, t, w * m / t
+}'
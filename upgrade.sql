@@ -0,0 +1,84 @@
+-- Bring the tables of an existing mysqlfs database up to date with schema.sql.
+-- Each section can be applied on its own; skip those already applied.
+-- as root: mysql -u root -p mysqlfs < upgrade.sql
+
+-- directory listings page through (parent, name) in name order
+ALTER TABLE `tree` DROP KEY `parent`, ADD KEY `parent` (`parent`,`name`);
+
+-- inodes.nlink replaces counting the tree entries of an inode
+ALTER TABLE `inodes` ADD COLUMN `nlink` int(10) unsigned NOT NULL default '0' AFTER `size`;
+UPDATE inodes SET nlink=(SELECT COUNT(inode) FROM tree WHERE tree.inode=inodes.inode);
+
+-- the superblock records the block size; existing filesystems have 4 KiB blocks
+CREATE TABLE `superblock` (
+  `name` varchar(64) NOT NULL,
+  `value` bigint(20) NOT NULL,
+  PRIMARY KEY  (`name`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+INSERT INTO superblock (name, value) VALUES ('block_size', 4096);
+
+-- blocks of 64 KiB and more do not fit in a BLOB
+ALTER TABLE `data_blocks` MODIFY `data` mediumblob;
+
+-- extents store aligned 1 MiB runs of blocks as one row each
+CREATE TABLE `extents` (
+  `inode` bigint(20) NOT NULL,
+  `seq` int unsigned not null,
+  `data` mediumblob ,
+  PRIMARY KEY  (`inode`, `seq`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+DROP TRIGGER IF EXISTS `drop_data`;
+DELIMITER ;;
+CREATE TRIGGER `drop_data` AFTER DELETE ON `inodes` FOR EACH ROW BEGIN DELETE FROM data_blocks WHERE inode=OLD.inode; DELETE FROM extents WHERE inode=OLD.inode; END;;
+DELIMITER ;
+REPLACE INTO superblock (name, value)
+  SELECT 'extent_blocks', 1048576 DIV value FROM superblock
+  WHERE name='block_size' AND 1048576 DIV value >= 2;
+
+-- files of up to 2 KiB keep their data in the inodes row; existing ones stay in blocks
+ALTER TABLE `inodes` ADD COLUMN `inline_data` varbinary(4096) default NULL AFTER `nlink`;
+REPLACE INTO superblock (name, value)
+  SELECT 'inline_max', LEAST(2048, value) FROM superblock WHERE name='block_size';
+
+-- rename() is one call of a stored procedure; the account needs EXECUTE on the database
+DROP PROCEDURE IF EXISTS `mysqlfs_rename`;
+DELIMITER ;;
+CREATE PROCEDURE `mysqlfs_rename`(IN from_parent bigint, IN from_name varchar(255), IN to_parent bigint, IN to_name varchar(255))
+  MODIFIES SQL DATA
+BEGIN
+  DECLARE src, dst bigint DEFAULT NULL;
+  DECLARE EXIT HANDLER FOR SQLEXCEPTION BEGIN ROLLBACK; RESIGNAL; END;
+  START TRANSACTION;
+  SET src = (SELECT inode FROM tree WHERE parent=from_parent AND name=from_name);
+  SET dst = (SELECT inode FROM tree WHERE parent=to_parent AND name=to_name);
+  IF src IS NOT NULL AND (dst IS NULL OR dst <> src) THEN
+    IF dst IS NOT NULL THEN
+      DELETE FROM tree WHERE parent=to_parent AND name=to_name;
+      UPDATE inodes SET nlink = nlink - 1, deleted = IF(nlink = 0, 1, deleted) WHERE inode=dst;
+    END IF;
+    UPDATE tree SET parent=to_parent, name=to_name WHERE parent=from_parent AND name=from_name;
+  END IF;
+  COMMIT;
+  SELECT src, dst;
+END;;
+DELIMITER ;
+
+-- mysqlfs deletes the data of a purged inode itself, a chunk at a time; the
+-- drop_data trigger would delete it all at once.  Optional: older mysqlfs
+-- versions still need the trigger
+DROP TRIGGER IF EXISTS `drop_data`;
+
+-- open files are counted in memory; each mount records those other mounts must not purge under a session
+CREATE TABLE `sessions` (
+  `id` bigint(20) NOT NULL auto_increment,
+  `host` varchar(255) NOT NULL default '',
+  `pid` int(10) unsigned NOT NULL default '0',
+  `expires` int(10) unsigned NOT NULL default '0',
+  PRIMARY KEY  (`id`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;
+CREATE TABLE `session_inodes` (
+  `session` bigint(20) NOT NULL,
+  `inode` bigint(20) NOT NULL,
+  PRIMARY KEY  (`session`,`inode`),
+  KEY `inode` (`inode`)
+) ENGINE=MyISAM DEFAULT CHARSET=binary;